@@ -0,0 +1,201 @@
+#include "AddrRope.h"
+
+//---------------------------------------------------------------------------
+AddrRope::AddrRope(void)
+	: Root(0),
+	Seed(2463534242u)
+{
+	clear();
+}
+
+void AddrRope::clear()
+{
+	node empty = { 0, 0, 0, 0, 0, 0 };
+	Nodes.assign(1, empty);
+	Free.clear();
+	Root = 0;
+}
+
+unsigned int AddrRope::newNode(unsigned char size)
+{
+	// xorshift32; the heap order on prio keeps the tree O(log n) deep
+	Seed ^= Seed << 13;
+	Seed ^= Seed >> 17;
+	Seed ^= Seed << 5;
+
+	node n = { 0, 0, Seed, 1, size, size };
+	if (!Free.empty())
+	{
+		unsigned int t = Free.back();
+		Free.pop_back();
+		Nodes[t] = n;
+		return t;
+	}
+	Nodes.push_back(n);
+	return Nodes.size() - 1;
+}
+
+void AddrRope::update(unsigned int t)
+{
+	node & n = Nodes[t];
+	n.count = Nodes[n.left].count + 1 + Nodes[n.right].count;
+	n.sum = Nodes[n.left].sum + n.size + Nodes[n.right].sum;
+}
+
+// Nodes come in program order, so the tree is built along its right
+// spine; a node is complete once it leaves the spine
+void AddrRope::build(const unsigned char * sizes, size_t count, size_t stride)
+{
+	clear();
+	Nodes.reserve(count + 1);
+
+	std::vector<unsigned int> spine;
+	for (size_t i = 0; i < count; ++i)
+	{
+		unsigned int t = newNode(sizes[i * stride]);
+		unsigned int last = 0;
+		while (!spine.empty() && Nodes[spine.back()].prio < Nodes[t].prio)
+		{
+			last = spine.back();
+			spine.pop_back();
+			update(last);
+		}
+		Nodes[t].left = last;
+		if (!spine.empty())
+			Nodes[spine.back()].right = t;
+		spine.push_back(t);
+	}
+	Root = spine.empty() ? 0 : spine.front();
+	while (!spine.empty())
+	{
+		update(spine.back());
+		spine.pop_back();
+	}
+}
+
+//---------------------------------------------------------------------------
+unsigned int AddrRope::prefix(size_t idx) const
+{
+	unsigned int sum = 0;
+	unsigned int t = Root;
+	while (t)
+	{
+		const node & n = Nodes[t];
+		size_t left = Nodes[n.left].count;
+		if (idx <= left)
+			t = n.left;
+		else
+		{
+			sum += Nodes[n.left].sum + n.size;
+			idx -= left + 1;
+			t = n.right;
+		}
+	}
+	return sum;
+}
+
+size_t AddrRope::lowerBound(unsigned int addr) const
+{
+	size_t idx = 0;
+	unsigned int base = 0;
+	size_t found = size();
+	unsigned int t = Root;
+	while (t)
+	{
+		const node & n = Nodes[t];
+		unsigned int at = base + Nodes[n.left].sum;
+		if (at >= addr)
+		{
+			found = idx + Nodes[n.left].count;
+			t = n.left;
+		}
+		else
+		{
+			base = at + n.size;
+			idx += Nodes[n.left].count + 1;
+			t = n.right;
+		}
+	}
+	return found;
+}
+
+//---------------------------------------------------------------------------
+// a gets the first k nodes of t, b the rest
+void AddrRope::split(unsigned int t, size_t k, unsigned int & a, unsigned int & b)
+{
+	if (!t)
+	{
+		a = b = 0;
+		return;
+	}
+	size_t left = Nodes[Nodes[t].left].count;
+	if (k <= left)
+	{
+		unsigned int l;
+		split(Nodes[t].left, k, a, l);
+		Nodes[t].left = l;
+		b = t;
+	}
+	else
+	{
+		unsigned int r;
+		split(Nodes[t].right, k - left - 1, r, b);
+		Nodes[t].right = r;
+		a = t;
+	}
+	update(t);
+}
+
+unsigned int AddrRope::merge(unsigned int a, unsigned int b)
+{
+	if (!a || !b)
+		return a ? a : b;
+	if (Nodes[a].prio > Nodes[b].prio)
+	{
+		unsigned int r = merge(Nodes[a].right, b);
+		Nodes[a].right = r;
+		update(a);
+		return a;
+	}
+	unsigned int l = merge(a, Nodes[b].left);
+	Nodes[b].left = l;
+	update(b);
+	return b;
+}
+
+void AddrRope::insert(size_t idx, unsigned char size)
+{
+	unsigned int a, b;
+	split(Root, idx, a, b);
+	unsigned int t = newNode(size);
+	Root = merge(merge(a, t), b);
+}
+
+void AddrRope::erase(size_t idx)
+{
+	unsigned int a, b, m;
+	split(Root, idx, a, b);
+	split(b, 1, m, b);
+	if (m)
+		Free.push_back(m);
+	Root = merge(a, b);
+}
+
+void AddrRope::resize(size_t idx, unsigned char size)
+{
+	if (idx < this->size())
+		resize(Root, idx, size);
+}
+
+void AddrRope::resize(unsigned int t, size_t idx, unsigned char size)
+{
+	node & n = Nodes[t];
+	size_t left = Nodes[n.left].count;
+	if (idx < left)
+		resize(n.left, idx, size);
+	else if (idx > left)
+		resize(n.right, idx - left - 1, size);
+	else
+		n.size = size;
+	update(t);
+}
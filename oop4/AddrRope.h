@@ -0,0 +1,55 @@
+#ifndef __AddrRope_h_
+#define __AddrRope_h_
+
+#include <cstddef>
+#include <vector>
+
+//---------------------------------------------------------------------------
+// Instruction sizes in program order, kept as an implicit treap with the
+// byte and node count of every subtree. The address of an instruction,
+// the instruction at an address, and inserting, erasing or resizing one
+// are all O(log n), so an edit does not re-address the program.
+class AddrRope
+{
+public:
+	AddrRope(void);
+
+	// Rebuilds from sizes[0 .. count - 1] in O(n)
+	void build(const unsigned char * sizes, size_t count, size_t stride);
+	void clear();
+
+	size_t size() const { return Nodes[Root].count; }
+	unsigned int prefix(size_t idx) const;				// sum of the sizes before idx
+	size_t lowerBound(unsigned int addr) const;			// first idx with prefix(idx) >= addr, size() if none
+
+	void insert(size_t idx, unsigned char size);
+	void erase(size_t idx);
+	void resize(size_t idx, unsigned char size);
+
+private:
+	// Children are indices into Nodes; 0 is the empty tree
+	struct node
+	{
+		unsigned int left;
+		unsigned int right;
+		unsigned int prio;
+		unsigned int count;
+		unsigned int sum;
+		unsigned char size;
+	};
+
+	unsigned int newNode(unsigned char size);
+	void update(unsigned int t);
+	void split(unsigned int t, size_t k, unsigned int & a, unsigned int & b);
+	unsigned int merge(unsigned int a, unsigned int b);
+	void resize(unsigned int t, size_t idx, unsigned char size);
+
+	std::vector<node>			Nodes;
+	std::vector<unsigned int>	Free;
+	unsigned int				Root;
+	unsigned int				Seed;
+};
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __AddrRope_h_
@@ -0,0 +1,213 @@
+#include "AsmLexer.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//---------------------------------------------------------------------------
+MappedFile::MappedFile(void)
+	: Data(0),
+	Size(0),
+#if defined(_WIN32)
+	File(INVALID_HANDLE_VALUE),
+	Mapping(0)
+#else
+	Fd(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile(void)
+{
+	close();
+}
+
+bool MappedFile::open(const std::string & path)
+{
+	close();
+
+#if defined(_WIN32)
+	File = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (File == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(File, &size))
+	{
+		close();
+		return false;
+	}
+	Size = (size_t)size.QuadPart;
+	if (Size == 0)
+		return true;
+
+	Mapping = CreateFileMappingA(File, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!Mapping)
+	{
+		close();
+		return false;
+	}
+	Data = (const char *)MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	Fd = ::open(path.c_str(), O_RDONLY);
+	if (Fd == -1)
+		return false;
+
+	struct stat st;
+	if (fstat(Fd, &st) != 0)
+	{
+		close();
+		return false;
+	}
+	Size = (size_t)st.st_size;
+	if (Size == 0)
+		return true;
+
+	void * p = mmap(0, Size, PROT_READ, MAP_PRIVATE, Fd, 0);
+	Data = (p != MAP_FAILED) ? (const char *)p : 0;
+	if (Data)
+		madvise(p, Size, MADV_SEQUENTIAL);
+#endif
+
+	if (!Data)
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close()
+{
+#if defined(_WIN32)
+	if (Data) UnmapViewOfFile(Data);
+	if (Mapping) CloseHandle(Mapping);
+	if (File != INVALID_HANDLE_VALUE) CloseHandle(File);
+	Mapping = 0;
+	File = INVALID_HANDLE_VALUE;
+#else
+	if (Data) munmap((void *)Data, Size);
+	if (Fd != -1) ::close(Fd);
+	Fd = -1;
+#endif
+	Data = 0;
+	Size = 0;
+}
+
+//---------------------------------------------------------------------------
+// Character classes, looked up once per byte
+enum
+{
+	C_OTHER = 0,
+	C_SPACE,
+	C_NEWLINE,
+	C_ALPHA,
+	C_DIGIT,
+	C_COMMA,
+	C_COLON,
+	C_COMMENT
+};
+
+static unsigned char char_class[256];
+
+static bool init_char_class()
+{
+	for (int c = 0; c < 256; ++c)
+	{
+		if (c == ' ' || c == '\t' || c == '\r')
+			char_class[c] = C_SPACE;
+		else if (c == '\n')
+			char_class[c] = C_NEWLINE;
+		else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '.')
+			char_class[c] = C_ALPHA;
+		else if (c >= '0' && c <= '9')
+			char_class[c] = C_DIGIT;
+		else if (c == ',')
+			char_class[c] = C_COMMA;
+		else if (c == ':')
+			char_class[c] = C_COLON;
+		else if (c == ';')
+			char_class[c] = C_COMMENT;
+		else
+			char_class[c] = C_OTHER;
+	}
+	return true;
+}
+
+static const bool char_class_ready = init_char_class();
+
+//---------------------------------------------------------------------------
+AsmLexer::AsmLexer(const char * begin, const char * end)
+	: Cur(begin),
+	End(end),
+	Line(1)
+{
+}
+
+void AsmLexer::next(asm_token & tok)
+{
+	// Skip blanks and comments
+	for (;;)
+	{
+		while (Cur < End && char_class[(unsigned char)*Cur] == C_SPACE)
+			++Cur;
+		if (Cur < End && *Cur == ';')
+		{
+			while (Cur < End && *Cur != '\n')
+				++Cur;
+			continue;
+		}
+		break;
+	}
+
+	tok.text = Cur;
+	tok.len = 1;
+	tok.line = Line;
+
+	if (Cur == End)
+	{
+		tok.type = T_END;
+		tok.len = 0;
+		return;
+	}
+
+	const char * start = Cur;
+	switch (char_class[(unsigned char)*Cur++])
+	{
+	case C_NEWLINE:
+		tok.type = T_NEWLINE;
+		++Line;
+		return;
+	case C_COMMA:
+		tok.type = T_COMMA;
+		return;
+	case C_COLON:
+		tok.type = T_COLON;
+		return;
+	case C_ALPHA:
+		tok.type = T_IDENT;
+		break;
+	case C_DIGIT:
+		tok.type = T_NUMBER;
+		break;
+	default:
+		tok.type = T_ERROR;
+		return;
+	}
+
+	// Identifiers and numbers share the tail: letters, digits, '_' and '.'
+	while (Cur < End)
+	{
+		unsigned char cls = char_class[(unsigned char)*Cur];
+		if (cls != C_ALPHA && cls != C_DIGIT)
+			break;
+		++Cur;
+	}
+	tok.len = (unsigned int)(Cur - start);
+}
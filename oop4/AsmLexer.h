@@ -0,0 +1,73 @@
+#ifndef __AsmLexer_h_
+#define __AsmLexer_h_
+
+#include <cstddef>
+#include <string>
+
+//---------------------------------------------------------------------------
+// Read-only view of a whole file, mapped into memory
+class MappedFile
+{
+public:
+	MappedFile(void);
+	~MappedFile(void);
+
+	bool open(const std::string & path);
+	void close();
+
+	const char * data() const { return Data; }
+	size_t size() const { return Size; }
+
+private:
+	MappedFile(const MappedFile &);
+	MappedFile & operator=(const MappedFile &);
+
+	const char *	Data;
+	size_t			Size;
+#if defined(_WIN32)
+	void *			File;
+	void *			Mapping;
+#else
+	int				Fd;
+#endif
+};
+
+//---------------------------------------------------------------------------
+enum asm_token_type
+{
+	T_IDENT,	// mnemonic, register or label
+	T_NUMBER,	// 123, 7Bh or 0x7B
+	T_COMMA,
+	T_COLON,
+	T_NEWLINE,
+	T_ERROR,	// any other character
+	T_END
+};
+
+// Tokens point into the lexed buffer, nothing is copied
+struct asm_token
+{
+	unsigned char	type;
+	const char *	text;
+	unsigned int	len;
+	unsigned int	line;
+};
+
+//---------------------------------------------------------------------------
+// Hand-written lexer for Intel-syntax lines like "mov eax, 100h ; comment"
+class AsmLexer
+{
+public:
+	AsmLexer(const char * begin, const char * end);
+
+	void next(asm_token & tok);
+
+private:
+	const char *	Cur;
+	const char *	End;
+	unsigned int	Line;
+};
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __AsmLexer_h_
@@ -17,10 +17,32 @@ http://www.ogre3d.org/wiki/
 
 #include "BaseApplication.h"
 
+#include <algorithm>
+#include <OgreOverlayContainer.h>
+#include <OgreOverlayManager.h>
+
 #if OGRE_PLATFORM == OGRE_PLATFORM_APPLE
 #include <macUtils.h>
 #endif
 
+// Registers and slots written in the last steps are highlighted, the
+// colour fading back to white over this many steps
+static const unsigned long long HIGHLIGHT_STEPS = 8;
+
+static Ogre::ColourValue write_colour(unsigned long long age)
+{
+	if (age >= HIGHLIGHT_STEPS)
+		return Ogre::ColourValue::White;
+	Ogre::Real t = (Ogre::Real)age / HIGHLIGHT_STEPS;
+	return Ogre::ColourValue(1, 0.55f + 0.45f * t, 0.1f + 0.9f * t);
+}
+
+// Code lines that can have written the selected value, and the one that did
+static const Ogre::ColourValue ORIGIN_MAY(0.45f, 0.8f, 1);
+static const Ogre::ColourValue ORIGIN_DID(0.2f, 1, 0.4f);
+
+static const unsigned char origin_regs[] = { 0, REG_EAX, REG_EBP, REG_ESP };
+
 //---------------------------------------------------------------------------
 BaseApplication::BaseApplication(void)
     : mRoot(0),
@@ -42,10 +64,25 @@ BaseApplication::BaseApplication(void)
 	StackBox(0),
 	CodeBox(0),
 	RegBox(0),
-	eax(0),
-	ebp(0),
-	esp(0),
-	eip(0)
+	CodeGrid(0),
+	StackGrid(0),
+	RegGrid(0),
+	CodeTop(0),
+	ShowCursor(false),
+	StepsPerFrame(100000),
+	Server(0),
+	MetricsPanel(0),
+	EditLine(0),
+	EditCursor(0),
+	EditMode(EDIT_NONE),
+	OriginMode(ORIGIN_OFF),
+	OriginDepth(0),
+	OriginKnown(false),
+	OriginLast(-1),
+	OriginStale(true),
+	OriginSteps(0),
+	OriginEip(0),
+	OriginRevision(0)
 {
 #if OGRE_PLATFORM == OGRE_PLATFORM_APPLE
     m_ResourcePath = Ogre::macBundlePath() + "/Contents/Resources/";
@@ -57,9 +94,12 @@ BaseApplication::BaseApplication(void)
 //---------------------------------------------------------------------------
 BaseApplication::~BaseApplication(void)
 {
+	Recorder.stop();	// its render textures go with the root
+	Heatmap.destroy();	// and its overlay with the overlay system
     if (mTrayMgr) delete mTrayMgr;
     if (mCameraMan) delete mCameraMan;
     if (mOverlaySystem) delete mOverlaySystem;
+	if (Server) delete Server;
 
     // Remove ourself as a Window listener
     Ogre::WindowEventUtilities::removeWindowEventListener(mWindow, this);
@@ -242,6 +282,31 @@ bool BaseApplication::frameRenderingQueued(const Ogre::FrameEvent& evt)
 
     mTrayMgr->frameRenderingQueued(evt);
 
+	// oop5
+	ScopedTimer frameTimer(Stats, METRIC_FRAME);
+	bool remote = Server && Server->poll(0);
+	if (Running)
+	{
+		ScopedTimer timer(Stats, METRIC_INTERPRET);
+		unsigned int budget = Server ? Server->runBudget(StepsPerFrame) : StepsPerFrame;
+		Stats.add(METRIC_STEPS, runInstructions(Recorder.isRecording() ? 1 : budget));
+	}
+	if (Running || remote)
+	{
+		PrintCode();
+		PrintReg();
+		PrintStack();
+	}
+	// Runs publish on their own; keys and requests change the machine
+	// between them
+	if (!Running)
+		SharedOut.publish(*this);
+	if (Heatmap.mode() != HEAT_OFF)
+		Heatmap.update(*this);
+	Recorder.capture();
+	if (Stats.tick())
+		PrintMetrics();
+
     if (!mTrayMgr->isDialogVisible())
     {
         mCameraMan->frameRenderingQueued(evt);   // If dialog isn't up, then update the camera
@@ -321,6 +386,7 @@ void BaseApplication::windowClosed(Ogre::RenderWindow* rw)
 bool BaseApplication::keyPressed( const OIS::KeyEvent &arg )
 {
     if (mTrayMgr->isDialogVisible()) return true;   // don't process any more keys if dialog is up
+	if (EditMode != EDIT_NONE) return editKey(arg);	// typing goes to the edit line only
 
     if (arg.key == OIS::KC_F)   // toggle visibility of advanced frame stats
     {
@@ -413,11 +479,180 @@ bool BaseApplication::keyPressed( const OIS::KeyEvent &arg )
 		instructionHandler();
 
 	}
+	else if (arg.key == OIS::KC_RETURN)   // run until a breakpoint or the end
+	{
+		Running = !Running;
+		StopDepth = -1;
+		BreakReason = "";
+		ShowCursor = false;
+		PrintReg();
+	}
+	else if (arg.key == OIS::KC_F10)   // step over calls
+	{
+		if (stepOver())
+			PrintReg();
+		else
+			instructionHandler();
+	}
+	else if (arg.key == OIS::KC_F11)   // run until the current frame returns
+	{
+		if (stepOut())
+			PrintReg();
+	}
+	else if (arg.key == OIS::KC_B)   // toggle breakpoint on the current instruction
+	{
+		toggleBreakpoint();
+		PrintCode();
+	}
+	else if (arg.key == OIS::KC_M)   // toggle the interpreter and panel metrics
+	{
+		if (MetricsPanel->getTrayLocation() == OgreBites::TL_NONE)
+		{
+			mTrayMgr->moveWidgetToTray(MetricsPanel, OgreBites::TL_BOTTOMLEFT, 0);
+			MetricsPanel->show();
+			PrintMetrics();
+		}
+		else
+		{
+			mTrayMgr->removeWidgetFromTray(MetricsPanel);
+			MetricsPanel->hide();
+		}
+	}
+	else if (arg.key == OIS::KC_PGUP || arg.key == OIS::KC_PGDOWN)   // move the edit cursor
+	{
+		EditCursor += (arg.key == OIS::KC_PGUP) ? -1 : 1;
+		EditCursor = std::max(0, std::min(EditCursor, (int)Instructions.size() - 1));
+		ShowCursor = true;
+		PrintCode();
+		return true;	// SdkCameraMan would also move the camera up or down
+	}
+	else if (arg.key == OIS::KC_E || arg.key == OIS::KC_INSERT)   // edit or insert at the cursor
+	{
+		EditMode = (arg.key == OIS::KC_E && EditCursor < (int)Instructions.size()) ? EDIT_REPLACE : EDIT_INSERT;
+		EditText = (EditMode == EDIT_REPLACE) ? instruction_text(EditCursor) : "";
+		mTrayMgr->moveWidgetToTray(EditLine, OgreBites::TL_TOP, 0);
+		EditLine->show();
+		PrintEdit();
+		return true;
+	}
+	else if (arg.key == OIS::KC_DELETE)   // drop the instruction at the cursor
+	{
+		std::string error;
+		if (!eraseInstruction(EditCursor, error))
+			log("oop5: delete: " + error);
+		EditCursor = std::max(0, std::min(EditCursor, (int)Instructions.size() - 1));
+		PrintCode();
+		PrintReg();
+		PrintStack();
+	}
+	else if (arg.key == OIS::KC_H)   // cycle the stack heatmap: value, age, writer, off
+	{
+		int mode = Heatmap.nextMode();
+		if (mode != HEAT_OFF)
+			Heatmap.update(*this);
+		log(std::string("oop5: heatmap ") + StackHeatmap::modeName(mode));
+	}
+	else if (arg.key == OIS::KC_O)   // show where a value came from: eax, ebp, esp, a stack slot, off
+	{
+		OriginMode = (OriginMode + 1) % ORIGIN_MODES;
+		if (OriginMode == ORIGIN_SLOT && Stack.empty())
+			OriginMode = ORIGIN_OFF;
+		OriginDepth = 0;
+		OriginStale = true;
+		PrintCode();
+		PrintReg();
+		PrintStack();
+	}
+	else if ((arg.key == OIS::KC_HOME || arg.key == OIS::KC_END) && OriginMode == ORIGIN_SLOT)   // the slot above or below
+	{
+		if (arg.key == OIS::KC_HOME && OriginDepth > 0)
+			--OriginDepth;
+		else if (arg.key == OIS::KC_END && OriginDepth + 1 < Stack.size())
+			++OriginDepth;
+		OriginStale = true;
+		PrintCode();
+		PrintReg();
+		PrintStack();
+	}
+	else if (arg.key == OIS::KC_F6)   // save the machine state next to the program
+	{
+		saveSnapshot(ProgramPath + ".snap");
+	}
+	else if (arg.key == OIS::KC_F7)   // and restore it
+	{
+		if (loadSnapshot(ProgramPath + ".snap"))
+		{
+			PrintCode();
+			PrintReg();
+			PrintStack();
+		}
+	}
+	else if (arg.key == OIS::KC_F8)   // record the run as a PNG sequence, offscreen
+	{
+		if (Recorder.isRecording())
+		{
+			Recorder.stop();
+			log("oop5: recorded " + std::to_string((unsigned long long)Recorder.frames()) + " frames, "
+				+ std::to_string((unsigned long long)Recorder.dropped()) + " dropped, "
+				+ std::to_string((unsigned long long)Recorder.failed()) + " not written");
+		}
+		else
+		{
+			const char * prefix = getenv("OOP5_RECORD");
+			if (!Recorder.start(mCamera, mWindow->getWidth(), mWindow->getHeight(), prefix ? prefix : "oop5_frame_"))
+				log("oop5: cannot create the recording targets");
+		}
+	}
 
     mCameraMan->injectKeyDown(arg);
     return true;
 }
 
+// Enter applies the edit line, Escape drops it; anything printable is typed
+bool BaseApplication::editKey(const OIS::KeyEvent &arg)
+{
+	if (arg.key == OIS::KC_RETURN)
+	{
+		std::string error;
+		bool ok = (EditMode == EDIT_REPLACE) ? replaceInstruction(EditCursor, EditText, error)
+			: insertInstruction(EditCursor, EditText, error);
+		if (!ok)
+		{
+			EditLine->setCaption("oop5: " + error);
+			return true;
+		}
+		PrintCode();
+		PrintReg();
+		PrintStack();
+	}
+	else if (arg.key == OIS::KC_BACK)
+	{
+		if (!EditText.empty())
+			EditText.erase(EditText.size() - 1);
+		PrintEdit();
+		return true;
+	}
+	else if (arg.key != OIS::KC_ESCAPE)
+	{
+		if (arg.text >= 32 && arg.text < 127)
+			EditText += (char)arg.text;
+		PrintEdit();
+		return true;
+	}
+
+	EditMode = EDIT_NONE;
+	mTrayMgr->removeWidgetFromTray(EditLine);
+	EditLine->hide();
+	return true;
+}
+
+void BaseApplication::PrintEdit()
+{
+	std::string where = (EditCursor < (int)Instructions.size())
+		? "0x" + fill_zeros(decint_to_hexstr(addressOf(EditCursor))) : "end";
+	EditLine->setCaption(std::string(EditMode == EDIT_REPLACE ? "edit " : "insert at ") + where + ": " + EditText + "_");
+}
+
 void BaseApplication::createFrameListener(void)
 {
     Ogre::LogManager::getSingletonPtr()->logMessage("*** Initializing OIS ***");
@@ -474,428 +709,451 @@ void BaseApplication::createFrameListener(void)
 	//***********************************
 	// oop5
 	//***********************************
+	GlyphGrid::registerFactory();
+
 	// Initializing StackBox
 	StackBox = mTrayMgr->createTextBox(OgreBites::TL_TOPRIGHT, "Stack", "", 450, 350);
+	StackGrid = createGrid(StackBox);
 
 	//***********************************
 	// Initializing CodeBox
 	CodeBox = mTrayMgr->createTextBox(OgreBites::TL_TOPLEFT, "Code", "", 450, 500);
+	CodeGrid = createGrid(CodeBox);
 	
-	TiXmlDocument doc("C:\\Users\\japro_000\\Desktop\\Universe\\power of 5\\OOP\\lab5\\project\\oop4\\sample.xml");
-	if ( !doc.LoadFile() )
+	bool loaded;
+	{
+		ScopedTimer timer(Stats, METRIC_LOAD);
+		loaded = loadProgram(ProgramPath);
+	}
+	if (!loaded)
 		exit( 1 );
 
-	TiXmlElement* itemElement = 0;
-	for( itemElement = doc.FirstChildElement("instruction");
-			 itemElement;
-			 itemElement = itemElement->NextSiblingElement() )
-	{
-		std::string command = itemElement->Attribute("command");
-		std::string arg1 = (command != "retn") ? itemElement->Attribute("arg1") : "";
-		bool b = command == "mov";
-		std::string arg2 = (command != "retn" && command == "mov") ? itemElement->Attribute("arg2") : "";
-		struct instruction s;
-		s.command = command;
-
-		bool is_hex = false;
-		s.arg1 = /* arg1; */ parse_value(arg1, is_hex);
-		s.arg2 = /* arg2; */ parse_value(arg2, is_hex);
-		s.is_hex = is_hex;
-
-		int size;
-		int addr;
-		if (command == "mov")
-		{
-			if (arg2 == "esp" || arg2 == "ebp" || arg2 == "eax")
-				size = 2;
-			else
-				size = 5;
-		}
-		else if (command == "jmp" || command == "call")
-		{
-			if (arg1 == "esp" || arg1 == "ebp" || arg1 == "eax")
-				size = 2;
-			else
-				size = 5;
-		}
-		else if (command.compare("pop") || command.compare("push"))
-		{
-			if (arg1 == "esp" || arg1 == "ebp" || arg1 == "eax")
-				size = 2;
-			else
-				size = 1;
-		}
-		else // retn
-		{
-			size = 1;
-		}
-
-		s.size = size;
-			
-		if (Instructions.size() == 0)
-			s.addr = 0;
-		else
-			s.addr = Instructions[Instructions.size() - 1].addr + Instructions[Instructions.size() - 1].size;
-
-		Instructions.push_back(s);
-
-	}	
-
 	PrintCode();
 
+	EditLine = mTrayMgr->createLabel(OgreBites::TL_NONE, "EditLine", "", 450);
+	EditLine->hide();
+
 
 	//***********************************
 	// Initializing RegBox
 	RegBox = mTrayMgr->createTextBox(OgreBites::TL_BOTTOMRIGHT, "Reg", "", 300, 150);
+	RegGrid = createGrid(RegBox);
 	PrintReg();
-}
-
-std::string BaseApplication::parse_value(std::string value, bool & is_hex)
-{
-	is_hex = false;
-	if (value.size() > 0 && (value[value.size() - 1] == 'h' || value[value.size() - 1] == 'H') && (value[0] >= '0' && value[0] <= '9'))
-	{
-		unsigned int x;   
-		std::stringstream ss;
-		value.pop_back();
-		ss << std::hex << value.c_str();
-		ss >> x;
-
-		is_hex = true;
-		return std::to_string(x);
-	}
-	else
-		return value;
-}
 
-unsigned int BaseApplication::hexstr_to_dec(std::string str)
-{
-	unsigned int x;   
-	std::stringstream ss;
-	ss << std::hex << str;
-	ss >> x;
-	return x;
-}
+	//***********************************
+	// Stack heatmap under the stack panel, hidden until H
+	Heatmap.create(mWindow->getWidth() - 460.0f, 360, 450, 180);
 
-void BaseApplication::inst_mov(int idx)
-{
-	if (Instructions[idx].arg1 == "ebp")
+	//***********************************
+	// Metrics panel, hidden until M; OOP5_METRICS=<file.csv|file.json>
+	// also writes every window out, OOP5_METRICS_INTERVAL seconds long
+	Ogre::StringVector names;
+	for (int id = 0; id < METRIC_COUNT; ++id)
+		names.push_back(Metrics::name((metric_id)id));
+	MetricsPanel = mTrayMgr->createParamsPanel(OgreBites::TL_NONE, "MetricsPanel", 300, names);
+	MetricsPanel->hide();
+
+	const char * metricsPath = getenv("OOP5_METRICS");
+	const char * metricsInterval = getenv("OOP5_METRICS_INTERVAL");
+	if (metricsInterval && atof(metricsInterval) > 0)
+		Stats.setInterval(atof(metricsInterval));
+	if (metricsPath && !Stats.setExport(metricsPath))
+		log(std::string("oop5: cannot write metrics to ") + metricsPath);
+
+	// OOP5_DETECT_CYCLES=1 stops runs that only repeat themselves
+	const char * detectCycles = getenv("OOP5_DETECT_CYCLES");
+	setCycleDetection(detectCycles && atoi(detectCycles) != 0);
+
+	// OOP5_DIAGNOSTICS=<file|-> writes what the handlers report on bad
+	// operands, stderr for -
+	const char * diagPath = getenv("OOP5_DIAGNOSTICS");
+	if (diagPath)
 	{
-		if (Instructions[idx].arg2 == "esp")
-			ebp = esp;
-		else if (Instructions[idx].arg2 == "eax")
-			ebp = eax;
+		if (DiagLog.start(diagPath))
+			Diag = &DiagLog;
 		else
-			ebp = atoi(Instructions[idx].arg2.c_str());
+			log(std::string("oop5: cannot write diagnostics to ") + diagPath);
 	}
-	else if (Instructions[idx].arg1 == "esp")
-	{
-		if (Instructions[idx].arg2 == "eax")
-			esp = eax;
-		else if (Instructions[idx].arg2 == "ebp")
-			esp = ebp;
-		else
-			esp = atoi(Instructions[idx].arg2.c_str());
 
-		if (esp == 0) Stack.clear();
-		else
-		{
-			for (int i = Stack.size() - 1; i >= 0; --i)
-			{
-				if ((unsigned int)esp > (unsigned int)((-1) * i * 4) - 1)
-					Stack.pop_back();
-				else
-					break;
-			}
-		}
-	}
-	else if (Instructions[idx].arg1 == "eax")
+	// OOP5_QUANTUM=<steps> sets the turn length of guest threads
+	const char * quantum = getenv("OOP5_QUANTUM");
+	if (quantum && atoi(quantum) > 0)
+		Quantum = atoi(quantum);
+
+	// OOP5_DIVERGE=<original program> opens this one right before the
+	// first step at which it stops doing what the original does
+	const char * original = getenv("OOP5_DIVERGE");
+	if (original)
+		openDivergence(original);
+
+	// OOP5_SHARED_STATE=<name|1> publishes registers and the top of the
+	// stack for external viewers, see StateExport.h; 1 for the default name
+	const char * sharedName = getenv("OOP5_SHARED_STATE");
+	if (sharedName)
 	{
-		if (Instructions[idx].arg2 == "esp")
-			eax = esp;
-		else if (Instructions[idx].arg2 == "ebp")
-			eax = ebp;
+		std::string name = (std::string(sharedName) == "1") ? SHARED_STATE_NAME : sharedName;
+		std::string error;
+		if (SharedOut.start(name, SHARED_STATE_WINDOW, error))
+			Export = &SharedOut;
 		else
-			eax = atoi(Instructions[idx].arg2.c_str());
-	}
-	else
-		std::cout << "" << std::endl;
-
-	//eip = (idx + 1 < Instructions.size()) ? Instructions[idx + 1].addr : eip;
-	eip = Instructions[idx].addr + Instructions[idx].size;
-}
-
-void BaseApplication::inst_push(int idx)
-{
-	if (Instructions[idx].arg1 == "ebp")
-	{
-		Stack.push_back(ebp);
-	}
-	else if (Instructions[idx].arg1 == "esp")
-	{
-		Stack.push_back(esp);
-	}
-	else if (Instructions[idx].arg1 == "eax")
-	{
-		Stack.push_back(eax);
-	}
-	else
-		Stack.push_back(atoi(Instructions[idx].arg1.c_str()));
-
-	esp -= 4;
-
-	//eip = (idx + 1 < Instructions.size()) ? Instructions[idx + 1].addr : eip;
-	eip = Instructions[idx].addr + Instructions[idx].size;
-}
-
-void BaseApplication::inst_pop(int idx)
-{
-	if (esp == 0)
-		std::cout << "" << std::endl;
-
-	if (Instructions[idx].arg1 == "ebp")
-	{
-		ebp = Stack[Stack.size() - 1];
-	}
-	else if (Instructions[idx].arg1 == "esp")
-	{
-		esp = Stack[Stack.size() - 1];
-	}
-	else if (Instructions[idx].arg1 == "eax")
-	{
-		eax = Stack[Stack.size() - 1];
+			log("oop5: " + error);
 	}
-	else
-		std::cout << "" << std::endl;
-	
-	Stack.pop_back();
-	esp += 4;
-
-	//eip = (idx + 1 < Instructions.size()) ? Instructions[idx + 1].addr : eip;
-	eip = Instructions[idx].addr + Instructions[idx].size;
-}
 
-void BaseApplication::inst_jmp(int idx)
-{
-	if (Instructions[idx].arg1 == "ebp")
-	{
-		eip = ebp;
-	}
-	else if (Instructions[idx].arg1 == "esp")
-	{
-		eip = esp;
-	}
-	else if (Instructions[idx].arg1 == "eax")
+	//***********************************
+	// Scripted control, see DebugServer.h
+	const char * socketPath = getenv("OOP5_DEBUG_SOCKET");
+	if (socketPath)
 	{
-		eip = eax;
+		Server = new DebugServer(*this);
+		if (!Server->start(socketPath))
+			log(std::string("oop5: cannot listen on ") + socketPath);
+		// Long runs are stepped by frameRenderingQueued like Enter's
+		Server->setRunSlice(StepsPerFrame);
 	}
-	else
-		eip = atoi(Instructions[idx].arg1.c_str());
 }
 
-void BaseApplication::inst_call(int idx)
+void BaseApplication::instructionHandler()
 {
-	Stack.push_back(eip + Instructions[idx].size);
-	esp -= 4;
-
-	if (Instructions[idx].arg1 == "ebp")
-	{
-		eip = ebp;
-	}
-	else if (Instructions[idx].arg1 == "esp")
+	Running = false;
+	StopDepth = -1;
+	BreakReason = "";
+	ShowCursor = false;
 	{
-		eip = esp;
+		ScopedTimer timer(Stats, METRIC_INTERPRET);
+		step_event ev;
+		Stats.add(METRIC_STEPS, StepGenerator(*this).next(ev) ? 1 : 0);
 	}
-	else if (Instructions[idx].arg1 == "eax")
-	{
-		eip = eax;
-	}
-	else
-		eip = atoi(Instructions[idx].arg1.c_str());
-
-	
-
-}
 
-void BaseApplication::inst_retn(int idx)
-{
-	eip = ebp = Stack[Stack.size() - 1];
-	Stack.pop_back();
-	esp += 4;
+	PrintCode();
+	PrintReg();
+	PrintStack();
 }
 
-void BaseApplication::instructionHandler()
+// Runs both programs offscreen, see DivergenceFinder.h, then this one up
+// to the step before; the report goes to the log
+void BaseApplication::openDivergence(const std::string & original)
 {
-	// Find current instruction
-	int idx = -1;
-	for (int i = 0; i < Instructions.size(); ++i)
+	DivergenceFinder finder;
+	std::string error;
+	if (!finder.open(original, ProgramPath, error))
 	{
-		if (Instructions[i].addr >= eip)
-		{
-			idx = i;
-			break;
-		}	
-	}
-
-	// When all instructions passed
-	if (idx == -1)
-	{
-		PrintCode();
-		PrintStack();
-		PrintReg();
-
+		log("oop5: divergence " + error);
 		return;
 	}
 
-	if (Instructions[idx].command == "mov")
-	{
-		inst_mov(idx);
-	}
-	else if (Instructions[idx].command == "push")
-	{
-		inst_push(idx);
-	}
-	else if (Instructions[idx].command == "pop")
-	{
-		inst_pop(idx);
-	}
-	else if (Instructions[idx].command == "jmp")
-	{
-		inst_jmp(idx);
-	}
-	else if (Instructions[idx].command == "call")
-	{
-		inst_call(idx);
-	}
-	else if (Instructions[idx].command == "retn")
+	bool found = finder.find(DIVERGE_MAX_STEPS, DIVERGE_INTERVAL);
+	std::string steps = std::to_string(finder.step());
+	if (!finder.error().empty())
+		BreakReason = "divergence: " + finder.error();
+	else if (!found)
+		BreakReason = "no divergence in " + steps + " steps";
+	else
 	{
-		inst_retn(idx);
+		DivergenceFinder::seek(*this, finder.step() - 1);
+		BreakReason = "diverges from " + original + " at step " + steps;
+		log("oop5: " + BreakReason + ", " + std::to_string(finder.checkpoints()) + " checkpoints, "
+			+ std::to_string((unsigned long long)finder.probes()) + " probes\n" + finder.report());
 	}
-	else
-		std::cout << "" << std::endl;
 
 	PrintCode();
 	PrintReg();
 	PrintStack();
 }
 
+//---------------------------------------------------------------------------
+void BaseApplication::log(const std::string & message)
+{
+	Ogre::LogManager::getSingletonPtr()->logMessage(message);
+}
+
 void BaseApplication::PrintReg()
 {
-	RegBox->clearText();
+	ScopedTimer timer(Stats, METRIC_PRINT_REG);
 	
 	std::string str = "";
+	findOrigin();
 	
 	str += "EBP 0x";
-	str += fill_zeros_8(decint_to_hexstr(ebp));
-	str += "\n";
+	str += fill_word(decint_to_hexstr(ebp));
+	str += (OriginMode == ORIGIN_EBP) ? " <\n" : "\n";
 
 	str += "ESP 0x";
-	str += fill_zeros_8(decint_to_hexstr(esp));
-	str += "\n";
+	str += fill_word(decint_to_hexstr(esp));
+	str += (OriginMode == ORIGIN_ESP) ? " <\n" : "\n";
 
 	str += "EAX 0x";
-	str += fill_zeros_8(decint_to_hexstr(eax));
+	str += fill_word(decint_to_hexstr(eax));
+	if (OriginMode == ORIGIN_EAX)
+		str += " <";
+
+	if (!Threads.empty())
+		str += "\nthread " + std::to_string((unsigned long long)ThreadId) + " of "
+			+ std::to_string((unsigned long long)threadCount());
+
+	if (Running)
+		str += "\nrunning...";
+	else if (BreakReason.size() > 0)
+		str += "\nstopped: " + BreakReason;
+
+	if (OriginMode != ORIGIN_OFF)
+		str += "\n" + origin_text();
+
+	// From the write journal, in the order of the lines above
+	LineColours.clear();
+	LineColours.push_back(write_colour(regAge(REG_EBP)));
+	LineColours.push_back(write_colour(regAge(REG_ESP)));
+	LineColours.push_back(write_colour(regAge(REG_EAX)));
+	RegGrid->setText(str, LineColours);
+}
+
+void BaseApplication::PrintMetrics()
+{
+	if (!MetricsPanel->isVisible())
+		return;
 
-	RegBox->setText(str);
+	for (int id = 0; id < METRIC_COUNT; ++id)
+		MetricsPanel->setParamValue(id, Stats.format((metric_id)id));
 }
 
 void BaseApplication::PrintCode()
 {
-	CodeBox->clearText();
-
+	ScopedTimer timer(Stats, METRIC_PRINT_CODE);
+
+	// Only the rows that fit are formatted; the view scrolls to keep the
+	// cursor or eip in its upper part
+	int rows = std::max(1, (int)CodeGrid->rows());
+	int count = Instructions.size();
+	int current = findInstruction(eip);
+	if (current < 0)
+		current = count;
+	int focus = ShowCursor ? EditCursor : current;
+	if (focus < CodeTop || focus >= CodeTop + rows - rows / 4)
+		CodeTop = std::max(0, std::min(focus - rows / 4, count - rows / 2));
+
+	findOrigin();
 	std::string new_code = "";
-	bool is_eiped = false;
-	
-	for (int i = 0; i < Instructions.size(); ++i)
+	LineColours.clear();
+	int lines = 0;
+	for (int i = CodeTop; i < count && lines < rows; ++i)
 	{
-		if (Instructions[i].addr >= eip && is_eiped == false)
-		{
-			new_code += "-> 0x";
-			is_eiped = true;
-		}
-		else
+		const char * labels = label(i);
+		if (labels[0])
 		{
-			new_code += "   0x";
+			new_code += std::string("        ") + labels + ":\n";
+			LineColours.push_back(Ogre::ColourValue::White);
+			++lines;
 		}
 
+		if (i == current)
+			new_code += (i == EditCursor) ? "=>" : "->";
+		else
+			new_code += (i == EditCursor) ? " >" : "  ";
+		new_code += (i < (int)BreakAt.size() && BreakAt[i]) ? "*0x" : " 0x";
 
 		std::stringstream stream;
-		stream << std::hex << Instructions[i].addr;
+		stream << std::hex << addressOf(i);
 		std::string tmp(stream.str());
 		for (int j = tmp.size(); j < 4; j++)
 			new_code += "0";
 		new_code += tmp;
 		
 		new_code += "  ";
-		new_code += Instructions[i].command;
-		new_code += " ";
-		
-		if (Instructions[i].arg1.size() > 0 && Instructions[i].arg1[0] >= '0' && Instructions[i].arg1[0] <= '9' && Instructions[i].is_hex)
-			new_code += decint_to_hexstr(atoi(Instructions[i].arg1.c_str())) + 'h';
-		else
-			new_code += Instructions[i].arg1;
-		
-		if (Instructions[i].arg2.size() > 0) new_code += ", ";
-
-		if (Instructions[i].arg2.size() > 0 && Instructions[i].arg2[0] >= '0' && Instructions[i].arg2[0] <= '9' && Instructions[i].is_hex)
-			new_code += decint_to_hexstr(atoi(Instructions[i].arg2.c_str())) + 'h';
-		else
-			new_code += Instructions[i].arg2;
-
+		new_code += instruction_text(i);
 		new_code += "\n";
-
+		++lines;
+
+		if (OriginMode == ORIGIN_OFF)
+			LineColours.push_back(Ogre::ColourValue::White);
+		else if (i == OriginLast)
+			LineColours.push_back(ORIGIN_DID);
+		else if (std::binary_search(OriginWriters.begin(), OriginWriters.end(), i))
+			LineColours.push_back(ORIGIN_MAY);
+		else
+			LineColours.push_back(Ogre::ColourValue::White);
 	}
 
-	if (!is_eiped)
+	if (current == count && lines < rows)
 	{
 		new_code += "->\n";
 	}
 
-	CodeBox->setText(new_code);
+	CodeGrid->setText(new_code, LineColours);
 }
 
 void BaseApplication::PrintStack()
 {
-	StackBox->clearText();
+	ScopedTimer timer(Stats, METRIC_PRINT_STACK);
 
 	std::string new_stack = "";
+	LineColours.clear();
+	findOrigin();
+	int selected = (OriginMode == ORIGIN_SLOT) ? (int)(Stack.size() - 1 - OriginDepth) : -1;
+
+	// With guest threads the running one comes first under its own header
+	int rows = StackGrid->rows();
+	int lines = 0;
+	if (!Threads.empty())
+	{
+		new_stack += thread_header(ThreadId, eip, esp, Stack.size());
+		LineColours.push_back(Ogre::ColourValue::White);
+		++lines;
+	}
 
-	for (int i = 0; i < Stack.size(); ++i)
+	// Slots are grouped by frame, top of the stack first; the frame header
+	// goes above its slots and the return address closes the frame
+	int k = CallStack.size() - 1;
+	while (k >= 0 && CallStack[k].depth > Stack.size())
+		--k;
+	if (k >= 0)
 	{
-		std::string tmp;
-		unsigned int address = -1;
-		tmp = decint_to_hexstr(address + 1 - (i + 1) * 4).c_str();
-		tmp = "0x" + tmp + "  ";
-		tmp += fill_zeros_8(decint_to_hexstr(Stack[i]).c_str());
-		tmp += "\n";
+		new_stack += frame_header(k);
+		LineColours.push_back(Ogre::ColourValue::White);
+		++lines;
+	}
+
+	// Formatting stops at the last row that fits
+	for (int i = Stack.size() - 1; i >= 0 && lines < rows; --i, ++lines)
+	{
+		new_stack += slot_text(i, Stack[i]);
+		if (i == selected)
+			new_stack.insert(new_stack.size() - 1, " <");
+		LineColours.push_back(write_colour(slotAge(i)));
+
+		if (k >= 0 && i == (int)CallStack[k].depth - 1)
+		{
+			--k;
+			if (i > 0)
+			{
+				new_stack += frame_header(k);
+				LineColours.push_back(Ogre::ColourValue::White);
+				++lines;
+			}
+		}
+	}
 
-		new_stack = tmp + new_stack;
+	// Then the parked threads in the order they get their turns, dimmed,
+	// for as many rows as are left; thousands of them cost no more
+	for (size_t n = 0; n < Threads.size() && lines < rows; ++n)
+	{
+		const Machine::guest_thread & t = Threads[(NextThread + n) % Threads.size()];
+		new_stack += thread_header(t.id, t.eip, t.esp, t.stack.size());
+		LineColours.push_back(Ogre::ColourValue::White);
+		++lines;
+		for (int i = t.stack.size() - 1; i >= 0 && lines < rows; --i, ++lines)
+		{
+			new_stack += slot_text(i, t.stack[i]);
+			LineColours.push_back(Ogre::ColourValue(0.6f, 0.6f, 0.6f));
+		}
 	}
 	
-	StackBox->setText(new_stack);
+	StackGrid->setText(new_stack, LineColours);
+}
+
+std::string BaseApplication::slot_text(int i, unsigned int value)
+{
+	unsigned int address = -1;
+	return "0x" + decint_to_hexstr(address + 1 - (i + 1) * 4) + "  " + fill_word(decint_to_hexstr(value)) + "\n";
+}
+
+std::string BaseApplication::thread_header(unsigned int id, unsigned int at, unsigned int sp, size_t depth)
+{
+	return "== thread " + std::to_string((unsigned long long)id) + "  eip 0x" + fill_zeros(decint_to_hexstr(at))
+		+ "  esp 0x" + fill_word(decint_to_hexstr(sp)) + "  " + std::to_string((unsigned long long)depth) + " slots\n";
+}
+
+// Flow is asked for the instruction at eip, which the next step runs;
+// that replays at most a block, and only when something moved
+void BaseApplication::findOrigin()
+{
+	if (OriginMode == ORIGIN_OFF)
+		return;
+	if (!OriginStale && OriginSteps == Steps && OriginEip == eip && OriginRevision == Revision)
+		return;
+	OriginStale = false;
+	OriginSteps = Steps;
+	OriginEip = eip;
+	OriginRevision = Revision;
+
+	OriginWriters.clear();
+	OriginKnown = false;
+	OriginLast = -1;
+	int at = findInstruction(eip);
+	if (OriginMode == ORIGIN_SLOT)
+	{
+		if (Stack.empty())
+			return;
+		OriginDepth = std::min(OriginDepth, Stack.size() - 1);
+		OriginLast = SlotWrites[Stack.size() - 1 - OriginDepth].idx;
+		OriginKnown = at >= 0 && Flow.slotWriters(*this, at, OriginDepth, OriginWriters);
+	}
+	else
+	{
+		int r = origin_regs[OriginMode];
+		OriginLast = RegWriters[r];
+		OriginKnown = at >= 0 && Flow.registerWriters(*this, at, r, OriginWriters);
+	}
 }
 
-std::string BaseApplication::decint_to_hexstr(unsigned int dec)
+// e.g. "eax by 0x0012, may be 0x0004 0x0012 reset"
+std::string BaseApplication::origin_text()
 {
-	std::stringstream stream;
-	stream << std::hex << dec;
-	return stream.str();
+	static const char * names[] = { "", "eax", "ebp", "esp" };
+	std::string text = (OriginMode == ORIGIN_SLOT) ? "slot " + std::to_string((unsigned long long)OriginDepth)
+		: std::string(names[OriginMode]);
+	text += " by " + writer_text(OriginLast);
+	if (!OriginKnown)
+		return text + ", may be anything";
+
+	text += ", may be";
+	size_t shown = std::min(OriginWriters.size(), (size_t)4);
+	for (size_t k = 0; k < shown; ++k)
+		text += " " + writer_text(OriginWriters[k]);
+	if (OriginWriters.size() > shown)
+		text += " +" + std::to_string((unsigned long long)(OriginWriters.size() - shown));
+	return text;
 }
 
-std::string BaseApplication::fill_zeros(std::string str)
+std::string BaseApplication::writer_text(int idx)
 {
-	std::string tmp = "";
-	for (int j = str.size(); j < 4; j++)
-		tmp += "0";
-	tmp += str;
-	return tmp;
+	if (idx == DEFUSE_MANY)
+		return "many";
+	if (idx < 0 || idx >= (int)Instructions.size())
+		return "reset";
+	return "0x" + fill_zeros(decint_to_hexstr(addressOf(idx)));
 }
 
-std::string BaseApplication::fill_zeros_8(std::string str)
+std::string BaseApplication::instruction_text(int i)
 {
-	std::string tmp = "";
-	for (int j = str.size(); j < 8; j++)
-		tmp += "0";
-	tmp += str;
-	return tmp;
-}
\ No newline at end of file
+	const instruction & inst = Instructions[i];
+	std::string text = std::string(mnemonic(inst)) + " " + operand(inst, 0);
+	std::string arg2 = operand(inst, 1);
+	if (arg2.size() > 0)
+		text += ", " + arg2;
+	return text;
+}
+
+// A grid over the text area of the box, below its caption
+GlyphGrid * BaseApplication::createGrid(OgreBites::TextBox * box)
+{
+	Ogre::OverlayContainer * panel = static_cast<Ogre::OverlayContainer *>(box->getOverlayElement());
+	GlyphGrid * grid = static_cast<GlyphGrid *>(Ogre::OverlayManager::getSingleton().createOverlayElement(
+		GlyphGrid::TYPE_NAME, box->getName() + "/Grid"));
+	grid->initialise();
+	grid->setFontName("SdkTrays/Value");
+	grid->setCharHeight(16);
+	grid->setPosition(12, 34);
+	grid->setDimensions(panel->getWidth() - 24, panel->getHeight() - 46);
+	panel->addChild(grid);
+	return grid;
+}
+
+std::string BaseApplication::frame_header(int k)
+{
+	if (k < 0)
+		return "-- main\n";
+
+	const frame & f = CallStack[k];
+	return "-- 0x" + fill_zeros(decint_to_hexstr(f.target)) + " from 0x"
+		+ fill_zeros(decint_to_hexstr(addressOf(f.call_idx)))
+		+ "  ebp 0x" + fill_word(decint_to_hexstr(f.ebp)) + "\n";
+}
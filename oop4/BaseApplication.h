@@ -29,8 +29,15 @@ http://www.ogre3d.org/wiki/
 
 // oop5
 #include <string>
-#include "../../tinyxml/tinyxml.h"
 #include <vector>
+#include "Machine.h"
+#include "DebugServer.h"
+#include "Metrics.h"
+#include "GlyphGrid.h"
+#include "StepGenerator.h"
+#include "FrameRecorder.h"
+#include "StackHeatmap.h"
+#include "DivergenceFinder.h"
 
 #if OGRE_PLATFORM == OGRE_PLATFORM_APPLE
 #  include <OIS/OISEvents.h>
@@ -72,18 +79,7 @@ http://www.ogre3d.org/wiki/
 #endif
 
 //---------------------------------------------------------------------------
-struct instruction
-{
-	std::string command;
-	std::string arg1;
-	std::string arg2;
-	int addr;
-	int size;
-	bool is_hex;
-};
-
-
-class BaseApplication : public Ogre::FrameListener, public Ogre::WindowEventListener, public OIS::KeyListener, public OIS::MouseListener, OgreBites::SdkTrayListener
+class BaseApplication : public Ogre::FrameListener, public Ogre::WindowEventListener, public OIS::KeyListener, public OIS::MouseListener, OgreBites::SdkTrayListener, public Machine
 {
 public:
     BaseApplication(void);
@@ -145,31 +141,63 @@ protected:
 	OgreBites::TextBox *		StackBox;
 	OgreBites::TextBox *		CodeBox;
 	OgreBites::TextBox *		RegBox;
-	std::vector<unsigned int>	Stack;
-	std::vector<instruction>	Instructions;
-	// int							StackAddr;
-	unsigned int				esp;
-	unsigned int				ebp;
-	unsigned int				eax;
-	unsigned int				eip;
+	// The boxes keep their frame and caption; the grids draw their text
+	GlyphGrid *					CodeGrid;
+	GlyphGrid *					StackGrid;
+	GlyphGrid *					RegGrid;
+	std::vector<Ogre::ColourValue>	LineColours;	// scratch for the panels
+	int							CodeTop;		// first instruction in the code view
+	bool						ShowCursor;		// the code view follows the edit cursor, not eip
+	unsigned int				StepsPerFrame;
+	DebugServer *				Server;			// only with OOP5_DEBUG_SOCKET set
+	Metrics						Stats;
+	OgreBites::ParamsPanel *	MetricsPanel;	// toggled with M
+	FrameRecorder				Recorder;		// F8, one step per recorded frame
+	Diagnostics					DiagLog;		// with OOP5_DIAGNOSTICS set
+	StackHeatmap				Heatmap;		// H cycles its modes
+	StateExport					SharedOut;		// with OOP5_SHARED_STATE set
+
+	// Where a value came from: O picks eax, ebp, esp or a stack slot, Home
+	// and End move the slot up and down. The code view marks the
+	// instructions whose write can be in it at eip, and the one that made it
+	enum { ORIGIN_OFF, ORIGIN_EAX, ORIGIN_EBP, ORIGIN_ESP, ORIGIN_SLOT, ORIGIN_MODES };
+	int							OriginMode;
+	size_t						OriginDepth;	// of the slot, 0 for the top
+	std::vector<int>			OriginWriters;	// from Flow, ascending
+	bool						OriginKnown;	// false where Flow has no answer
+	int							OriginLast;		// the writer of this run, -1 for none
+	bool						OriginStale;	// the rest is for OriginSteps, OriginEip and OriginRevision
+	unsigned long long			OriginSteps;
+	unsigned int				OriginEip;
+	unsigned int				OriginRevision;
+
+	// Live editing: PgUp/PgDown move the cursor, E edits the instruction
+	// under it, Insert types a new one above it and Delete drops it
+	enum { EDIT_NONE, EDIT_REPLACE, EDIT_INSERT };
+	OgreBites::Label *			EditLine;		// shown while typing
+	int							EditCursor;
+	int							EditMode;
+	std::string					EditText;
 
 	void PrintCode();
 	void PrintReg();
 	void PrintStack();
-
-	std::string decint_to_hexstr(unsigned int dec);
-	std::string fill_zeros(std::string str);
-	std::string fill_zeros_8(std::string str);
-	std::string parse_value(std::string value, bool & is_hex);
-	unsigned int hexstr_to_dec(std::string str);
+	void PrintMetrics();
+
+	GlyphGrid * createGrid(OgreBites::TextBox * box);
+	std::string frame_header(int k);
+	std::string thread_header(unsigned int id, unsigned int at, unsigned int sp, size_t depth);
+	std::string slot_text(int i, unsigned int value);
+	std::string instruction_text(int i);
+	void findOrigin();
+	std::string origin_text();
+	std::string writer_text(int idx);
+	bool editKey(const OIS::KeyEvent &arg);
+	void PrintEdit();
 
 	void instructionHandler();
-	void inst_mov(int idx);
-	void inst_push(int idx);
-	void inst_pop(int idx);
-	void inst_jmp(int idx);
-	void inst_call(int idx);
-	void inst_retn(int idx);
+	void openDivergence(const std::string & original);
+	virtual void log(const std::string & message);
 	
 
 #ifdef OGRE_STATIC_LIB
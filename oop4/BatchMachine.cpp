@@ -0,0 +1,641 @@
+#include "BatchMachine.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Lanes are padded to a multiple of this, one AVX2 register of 32-bit values
+static const unsigned int VECTOR_WIDTH = 8;
+
+//---------------------------------------------------------------------------
+// Kernels over n lanes, n a multiple of VECTOR_WIDTH. Without AVX2 the
+// plain loops are left to the compiler's vectorizer.
+static void fill_lanes(unsigned int * dst, unsigned int value, unsigned int n)
+{
+#ifdef __AVX2__
+	__m256i v = _mm256_set1_epi32((int)value);
+	for (unsigned int i = 0; i < n; i += VECTOR_WIDTH)
+		_mm256_storeu_si256((__m256i *)(dst + i), v);
+#else
+	for (unsigned int i = 0; i < n; ++i)
+		dst[i] = value;
+#endif
+}
+
+static void copy_lanes(unsigned int * dst, const unsigned int * src, unsigned int n)
+{
+#ifdef __AVX2__
+	for (unsigned int i = 0; i < n; i += VECTOR_WIDTH)
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+#else
+	for (unsigned int i = 0; i < n; ++i)
+		dst[i] = src[i];
+#endif
+}
+
+static void add_lanes(unsigned int * dst, unsigned int delta, unsigned int n)
+{
+#ifdef __AVX2__
+	__m256i d = _mm256_set1_epi32((int)delta);
+	for (unsigned int i = 0; i < n; i += VECTOR_WIDTH)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(dst + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi32(v, d));
+	}
+#else
+	for (unsigned int i = 0; i < n; ++i)
+		dst[i] += delta;
+#endif
+}
+
+//---------------------------------------------------------------------------
+BatchMachine::BatchMachine(const std::vector<instruction> & program, unsigned int lanes, unsigned int max_depth)
+	: Program(program),
+	Count(lanes),
+	Width((lanes + VECTOR_WIDTH - 1) / VECTOR_WIDTH * VECTOR_WIDTH),
+	MaxDepth(max_depth),
+	Splits(0),
+	DetectCycles(false),
+	CycleArmed(false)
+{
+	Lanes.resize(Count);
+	for (unsigned int l = 0; l < Count; ++l)
+	{
+		batch_lane & lane = Lanes[l];
+		lane.reg[REG_ESP] = lane.reg[REG_EBP] = lane.reg[REG_EAX] = 0;
+		lane.eip = 0;
+		lane.steps = 0;
+		lane.limit = 0;
+		lane.reason = 0;
+		lane.cycle = 0;
+		lane.grouped = true;
+		lane.start[REG_ESP] = lane.start[REG_EBP] = lane.start[REG_EAX] = 0;
+		lane.hash = 0;
+	}
+
+	for (int r = 0; r < 3; ++r)
+		Group.reg[r].assign(Width, 0);
+	Group.live.assign(Width, 0);
+	for (unsigned int l = 0; l < Count; ++l)
+		Group.live[l] = ~0u;
+	Group.eip = 0;
+	Group.depth = 0;
+	Group.steps = 0;
+	Group.idx = -1;
+	Scratch.assign(Width, 0);
+}
+
+void BatchMachine::setRegisters(unsigned int lane, unsigned int esp, unsigned int ebp, unsigned int eax)
+{
+	batch_lane & l = Lanes[lane];
+	l.reg[REG_ESP] = esp;
+	l.reg[REG_EBP] = ebp;
+	l.reg[REG_EAX] = eax;
+	l.start[REG_ESP] = esp;
+	l.start[REG_EBP] = ebp;
+	l.start[REG_EAX] = eax;
+	if (l.grouped)
+	{
+		Group.reg[REG_ESP][lane] = esp;
+		Group.reg[REG_EBP][lane] = ebp;
+		Group.reg[REG_EAX][lane] = eax;
+		CycleArmed = false;
+	}
+}
+
+void BatchMachine::setCycleDetection(bool on)
+{
+	DetectCycles = on;
+	CycleArmed = false;
+	Cycles.restart();
+	Group.hash.assign(Width, 0);
+	if (!on)
+		return;
+
+	for (unsigned int d = 0; d < Group.depth; ++d)
+		hashRow(Group, d);
+	for (unsigned int l = 0; l < Count; ++l)
+	{
+		batch_lane & lane = Lanes[l];
+		lane.hash = 0;
+		for (size_t d = 0; d < lane.stack.size(); ++d)
+			lane.hash ^= slot_hash(d, lane.stack[d]);
+		lane.cycles.restart();
+	}
+}
+
+int BatchMachine::findInstruction(unsigned int addr) const
+{
+	int lo = 0;
+	int hi = Program.size();
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (Program[mid].addr < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < (int)Program.size()) ? lo : -1;
+}
+
+//---------------------------------------------------------------------------
+void BatchMachine::run(unsigned int budget)
+{
+	for (unsigned int l = 0; l < Count; ++l)
+	{
+		batch_lane & lane = Lanes[l];
+		unsigned int steps = lane.grouped ? Group.steps : lane.steps;
+		lane.limit = (steps > ~0u - budget) ? ~0u : steps + budget;
+	}
+
+	stepGroup(budget);
+
+	// Lanes split off above start from where they left the group
+	for (unsigned int l = 0; l < Count; ++l)
+	{
+		batch_lane & lane = Lanes[l];
+		if (lane.grouped)
+			continue;
+		while (!lane.reason && lane.steps < lane.limit)
+		{
+			unsigned int from = lane.eip;
+			if (!stepLane(lane))
+				break;
+			if (DetectCycles && lane.eip <= from)
+				sampleLane(lane);
+		}
+	}
+
+	syncGroup();
+}
+
+void BatchMachine::stepGroup(unsigned int budget)
+{
+	if (Count == 0 || !Lanes[0].grouped)
+		return;
+
+	// Samples start from the first step after detection was turned on or
+	// the registers set, the way Machine arms in step()
+	if (DetectCycles && !CycleArmed)
+	{
+		CycleStart = Group;
+		Cycles.restart();
+		CycleArmed = true;
+	}
+
+	for (unsigned int n = 0; n < budget; ++n)
+	{
+		unsigned int from = Group.eip;
+		if (const char * reason = execute(Group, false))
+		{
+			stopGroup(reason);
+			return;
+		}
+
+		// Only a jump backwards can close a loop
+		if (DetectCycles && Group.eip <= from && sampleGroup())
+			return;
+	}
+}
+
+// One instruction for every lane of g, or why the group cannot go on.
+// Lanes that stop agreeing with lane 0 are split off the running group;
+// a replay, which has seen them go before, only drops them
+const char * BatchMachine::execute(batch_group & g, bool replay)
+{
+	// Usually eip is where the last instruction ended
+	if (g.idx < 0 || Program[g.idx].addr != g.eip)
+	{
+		if (g.idx >= 0 && g.idx + 1 < (int)Program.size() && Program[g.idx + 1].addr == g.eip)
+			++g.idx;
+		else
+			g.idx = findInstruction(g.eip);
+	}
+
+	if (g.idx == -1)
+		return "end of program";
+
+	const instruction & in = Program[g.idx];
+	if (g.depth == 0 && (in.op == OP_POP || in.op == OP_RETN))
+		return "stack underflow";
+	if (g.depth >= MaxDepth && (in.op == OP_PUSH || in.op == OP_CALL))
+		return "stack overflow";
+	if (in.op == OP_SPAWN)
+		return "threads are not batched";
+
+	const unsigned int w = Width;
+	if ((in.op == OP_PUSH || in.op == OP_CALL) && (size_t)(g.depth + 1) * w > g.rows.size())
+		g.rows.resize(g.rows.size() * 2 + w);
+
+	++g.steps;
+	unsigned int * esp = &g.reg[REG_ESP][0];
+	unsigned int next = in.addr + in.size;
+	switch (in.op)
+	{
+	case OP_MOV:
+		if (in.dst != OPND_NONE && in.src == OPND_IMM)
+			fill_lanes(&g.reg[in.dst][0], in.imm, w);
+		else if (in.dst != OPND_NONE && in.src != in.dst)
+			copy_lanes(&g.reg[in.dst][0], &g.reg[in.src][0], w);
+
+		if (in.dst == REG_ESP && g.depth > 0)
+		{
+			// Slots below the new esp are gone, the bottom one only with esp == 0
+			for (unsigned int l = 0; l < w; ++l)
+			{
+				unsigned long long keep = (esp[l] == 0) ? 0 : ((1ull << 32) - esp[l] + 3) / 4;
+				Scratch[l] = (keep < g.depth) ? (unsigned int)keep : g.depth;
+			}
+
+			unsigned int depth = Scratch[0];
+			if (diverges(g, &Scratch[0], depth))
+				for (unsigned int l = 1; l < Count; ++l)
+					if (g.live[l] && Scratch[l] != depth)
+						leaveGroup(g, replay, l, next, Scratch[l]);
+			for (unsigned int d = depth; DetectCycles && d < g.depth; ++d)
+				hashRow(g, d);
+			g.depth = depth;
+		}
+		g.eip = next;
+		break;
+	case OP_PUSH:
+		if (in.src == OPND_IMM)
+			fill_lanes(&g.rows[g.depth * w], in.imm, w);
+		else
+			copy_lanes(&g.rows[g.depth * w], &g.reg[in.src][0], w);
+		if (DetectCycles)
+			hashRow(g, g.depth);
+		++g.depth;
+		add_lanes(esp, 0u - 4, w);
+		g.eip = next;
+		break;
+	case OP_POP:
+		--g.depth;
+		if (DetectCycles)
+			hashRow(g, g.depth);
+		if (in.dst != OPND_NONE)
+			copy_lanes(&g.reg[in.dst][0], &g.rows[g.depth * w], w);
+		add_lanes(esp, 4, w);
+		g.eip = next;
+		break;
+	case OP_JMP:
+		if (in.src == OPND_IMM)
+			g.eip = in.imm;
+		else
+			splitBranch(g, replay, &g.reg[in.src][0]);
+		break;
+	case OP_CALL:
+		// The return address is taken from eip, which may point before the call
+		fill_lanes(&g.rows[g.depth * w], g.eip + in.size, w);
+		if (DetectCycles)
+			hashRow(g, g.depth);
+		++g.depth;
+		add_lanes(esp, 0u - 4, w);
+		if (in.src == OPND_IMM)
+			g.eip = in.imm;
+		else
+			splitBranch(g, replay, &g.reg[in.src][0]);
+		break;
+	case OP_RETN:
+		--g.depth;
+		if (DetectCycles)
+			hashRow(g, g.depth);
+		copy_lanes(&g.reg[REG_EBP][0], &g.rows[g.depth * w], w);
+		add_lanes(esp, 4, w);
+		splitBranch(g, replay, &g.reg[REG_EBP][0]);
+		break;
+	default:
+		// Unknown instructions do nothing and leave eip where it is
+		break;
+	}
+	return 0;
+}
+
+// True if some lane still in the group has a value other than expected
+bool BatchMachine::diverges(const batch_group & g, const unsigned int * value, unsigned int expected) const
+{
+	const unsigned int * live = &g.live[0];
+#ifdef __AVX2__
+	__m256i e = _mm256_set1_epi32((int)expected);
+	for (unsigned int i = 0; i < Width; i += VECTOR_WIDTH)
+	{
+		__m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(value + i)), e);
+		__m256i differ = _mm256_andnot_si256(eq, _mm256_loadu_si256((const __m256i *)(live + i)));
+		if (!_mm256_testz_si256(differ, differ))
+			return true;
+	}
+	return false;
+#else
+	unsigned int differ = 0;
+	for (unsigned int i = 0; i < Width; ++i)
+		differ |= live[i] & (value[i] ^ expected);
+	return differ != 0;
+#endif
+}
+
+// Lane 0 picks the group's eip, lanes going elsewhere leave the group
+void BatchMachine::splitBranch(batch_group & g, bool replay, const unsigned int * target)
+{
+	g.eip = target[0];
+	if (diverges(g, target, g.eip))
+		for (unsigned int l = 1; l < Count; ++l)
+			if (g.live[l] && target[l] != g.eip)
+				leaveGroup(g, replay, l, target[l], g.depth);
+}
+
+void BatchMachine::leaveGroup(batch_group & g, bool replay, unsigned int l, unsigned int eip, unsigned int depth)
+{
+	if (replay)
+		g.live[l] = 0;
+	else
+		splitLane(l, eip, depth);
+}
+
+void BatchMachine::splitLane(unsigned int l, unsigned int eip, unsigned int depth)
+{
+	batch_lane & lane = Lanes[l];
+	for (int r = 0; r < 3; ++r)
+		lane.reg[r] = Group.reg[r][l];
+	lane.eip = eip;
+	lane.steps = Group.steps;
+	lane.stack.resize(depth);
+	for (unsigned int d = 0; d < depth; ++d)
+		lane.stack[d] = Group.rows[d * Width + l];
+
+	lane.grouped = false;
+	Group.live[l] = 0;
+	++Splits;
+
+	// The lane goes on with a hash of its own, the group with fewer lanes.
+	// The group keeps its CycleStart, where the lane is dropped on replay
+	if (DetectCycles)
+	{
+		lane.hash = 0;
+		for (unsigned int d = 0; d < depth; ++d)
+			lane.hash ^= slot_hash(d, lane.stack[d]);
+		lane.cycles.restart();
+		Cycles.restart();
+	}
+}
+
+void BatchMachine::stopGroup(const char * reason)
+{
+	syncGroup();
+	for (unsigned int l = 0; l < Count; ++l)
+	{
+		if (!Group.live[l])
+			continue;
+		Lanes[l].reason = reason;
+		Lanes[l].grouped = false;
+		Group.live[l] = 0;
+	}
+}
+
+// Copies the group state out to the lanes still in it
+void BatchMachine::syncGroup()
+{
+	for (unsigned int l = 0; l < Count; ++l)
+	{
+		if (!Group.live[l])
+			continue;
+
+		batch_lane & lane = Lanes[l];
+		for (int r = 0; r < 3; ++r)
+			lane.reg[r] = Group.reg[r][l];
+		lane.eip = Group.eip;
+		lane.steps = Group.steps;
+		lane.stack.resize(Group.depth);
+		for (unsigned int d = 0; d < Group.depth; ++d)
+			lane.stack[d] = Group.rows[d * Width + l];
+	}
+}
+
+//---------------------------------------------------------------------------
+// One step of a lane outside the group, same rules as Machine::step
+bool BatchMachine::stepLane(batch_lane & l)
+{
+	int idx = findInstruction(l.eip);
+	if (idx == -1)
+	{
+		l.reason = "end of program";
+		return false;
+	}
+
+	const instruction & in = Program[idx];
+	if (l.stack.empty() && (in.op == OP_POP || in.op == OP_RETN))
+	{
+		l.reason = "stack underflow";
+		return false;
+	}
+	if (l.stack.size() >= MaxDepth && (in.op == OP_PUSH || in.op == OP_CALL))
+	{
+		l.reason = "stack overflow";
+		return false;
+	}
+	if (in.op == OP_SPAWN)
+	{
+		l.reason = "threads are not batched";
+		return false;
+	}
+
+	++l.steps;
+	unsigned int value = (in.src < OPND_IMM) ? l.reg[in.src] : in.imm;
+	unsigned int next = in.addr + in.size;
+	switch (in.op)
+	{
+	case OP_MOV:
+		if (in.dst != OPND_NONE)
+			l.reg[in.dst] = value;
+		if (in.dst == REG_ESP)
+		{
+			unsigned int sp = l.reg[REG_ESP];
+			if (sp == 0)
+			{
+				l.stack.clear();
+				l.hash = 0;
+			}
+			while (l.stack.size() > 1 && sp >= (1ull << 32) - 4ull * (l.stack.size() - 1))
+			{
+				if (DetectCycles)
+					l.hash ^= slot_hash(l.stack.size() - 1, l.stack.back());
+				l.stack.pop_back();
+			}
+		}
+		l.eip = next;
+		break;
+	case OP_PUSH:
+		if (DetectCycles)
+			l.hash ^= slot_hash(l.stack.size(), value);
+		l.stack.push_back(value);
+		l.reg[REG_ESP] -= 4;
+		l.eip = next;
+		break;
+	case OP_POP:
+		if (in.dst != OPND_NONE)
+			l.reg[in.dst] = l.stack.back();
+		if (DetectCycles)
+			l.hash ^= slot_hash(l.stack.size() - 1, l.stack.back());
+		l.stack.pop_back();
+		l.reg[REG_ESP] += 4;
+		l.eip = next;
+		break;
+	case OP_JMP:
+		l.eip = value;
+		break;
+	case OP_CALL:
+		if (DetectCycles)
+			l.hash ^= slot_hash(l.stack.size(), l.eip + in.size);
+		l.stack.push_back(l.eip + in.size);
+		l.reg[REG_ESP] -= 4;
+		l.eip = (in.src == REG_ESP) ? l.reg[REG_ESP] : value;
+		break;
+	case OP_RETN:
+		l.eip = l.reg[REG_EBP] = l.stack.back();
+		if (DetectCycles)
+			l.hash ^= slot_hash(l.stack.size() - 1, l.stack.back());
+		l.stack.pop_back();
+		l.reg[REG_ESP] += 4;
+		break;
+	default:
+		break;
+	}
+	return true;
+}
+
+//---------------------------------------------------------------------------
+// Cycle detection
+
+// Slot depth of every lane goes in or out of its stack hash
+void BatchMachine::hashRow(batch_group & g, unsigned int depth)
+{
+	const unsigned int * row = &g.rows[depth * Width];
+	for (unsigned int l = 0; l < Width; ++l)
+		g.hash[l] ^= slot_hash(depth, row[l]);
+}
+
+// The group is back in an earlier state only if each lane in it is, and
+// then the steps since that state are a multiple of every lane's period
+bool BatchMachine::sampleGroup()
+{
+	const batch_group & g = Group;
+	unsigned long long h = mix_state(((unsigned long long)g.eip << 32) | g.depth);
+	for (unsigned int l = 0; l < Count; ++l)
+		if (g.live[l])
+			h ^= mix_state(state_hash(g.hash[l], g.reg[REG_ESP][l], g.reg[REG_EBP][l], g.reg[REG_EAX][l], g.eip) + l);
+	if (!Cycles.sample(h, g.steps))
+		return false;
+
+	unsigned int mark = (unsigned int)Cycles.markStep();
+	if (!confirmGroup(g.steps - mark, mark))
+	{
+		Cycles.restart();
+		return false;
+	}
+	stopGroup("entered cycle");
+	return true;
+}
+
+void BatchMachine::sampleLane(batch_lane & l)
+{
+	if (!l.cycles.sample(state_hash(l.hash, l.reg[REG_ESP], l.reg[REG_EBP], l.reg[REG_EAX], l.eip), l.steps))
+		return;
+
+	unsigned int mark = (unsigned int)l.cycles.markStep();
+	if (findCycleEntry((unsigned int)(&l - &Lanes[0]), l.steps - mark, mark, l.cycle))
+		l.reason = "entered cycle";
+	else
+		l.cycles.restart();
+}
+
+static bool same_in_group(const batch_group & a, const batch_group & b, unsigned int l, unsigned int width)
+{
+	if (!a.live[l] || !b.live[l] || a.hash[l] != b.hash[l])
+		return false;
+	for (int r = 0; r < 3; ++r)
+		if (a.reg[r][l] != b.reg[r][l])
+			return false;
+	for (unsigned int d = 0; d < a.depth; ++d)
+		if (a.rows[d * width + l] != b.rows[d * width + l])
+			return false;
+	return true;
+}
+
+// Replays the group from CycleStart with the same kernels: the hare goes
+// period steps ahead, then both step together. A lane entered its cycle
+// where its state first is the same in both, at last at the latest; every
+// lane still in the group has to get there for the cycle to count
+bool BatchMachine::confirmGroup(unsigned int period, unsigned int last)
+{
+	batch_group tortoise = CycleStart;
+	batch_group hare = CycleStart;
+	for (unsigned int n = 0; n < period; ++n)
+		if (execute(hare, true))
+			return false;
+
+	std::vector<bool> found(Count, false);
+	unsigned int open = 0;
+	for (unsigned int l = 0; l < Count; ++l)
+		if (Group.live[l])
+			++open;
+
+	while (tortoise.steps <= last)
+	{
+		if (tortoise.eip == hare.eip && tortoise.depth == hare.depth)
+		{
+			for (unsigned int l = 0; l < Count; ++l)
+			{
+				if (!Group.live[l] || found[l] || !same_in_group(tortoise, hare, l, Width))
+					continue;
+				Lanes[l].cycle = tortoise.steps;
+				found[l] = true;
+				--open;
+			}
+			if (open == 0)
+				return true;
+		}
+		if (execute(tortoise, true) || execute(hare, true))
+			return false;
+	}
+	return false;
+}
+
+static bool same_lane(const batch_lane & a, const batch_lane & b)
+{
+	return a.eip == b.eip && a.reg[REG_ESP] == b.reg[REG_ESP] && a.reg[REG_EBP] == b.reg[REG_EBP]
+		&& a.reg[REG_EAX] == b.reg[REG_EAX] && a.hash == b.hash && a.stack == b.stack;
+}
+
+// Replays the lane from step 0 with the scalar step: the hare goes period
+// steps ahead, then both step together until their states are equal,
+// which first happens where the cycle was entered, at last at the latest
+bool BatchMachine::findCycleEntry(unsigned int lane, unsigned int period, unsigned int last, unsigned int & entry)
+{
+	batch_lane tortoise;
+	for (int r = 0; r < 3; ++r)
+		tortoise.reg[r] = tortoise.start[r] = Lanes[lane].start[r];
+	tortoise.eip = 0;
+	tortoise.steps = 0;
+	tortoise.limit = 0;
+	tortoise.reason = 0;
+	tortoise.cycle = 0;
+	tortoise.grouped = false;
+	tortoise.hash = 0;
+
+	batch_lane hare = tortoise;
+	for (unsigned int n = 0; n < period; ++n)
+		if (!stepLane(hare))
+			return false;
+
+	while (tortoise.steps <= last)
+	{
+		if (same_lane(tortoise, hare))
+		{
+			entry = tortoise.steps;
+			return true;
+		}
+		if (!stepLane(tortoise) || !stepLane(hare))
+			return false;
+	}
+	return false;
+}
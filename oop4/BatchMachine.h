@@ -0,0 +1,107 @@
+#ifndef __BatchMachine_h_
+#define __BatchMachine_h_
+
+#include <vector>
+#include "Machine.h"
+#include "CycleDetector.h"
+
+//---------------------------------------------------------------------------
+// One instance of the program as seen from outside the batch
+struct batch_lane
+{
+	unsigned int reg[3];		// REG_ESP, REG_EBP, REG_EAX
+	unsigned int eip;
+	unsigned int steps;
+	unsigned int limit;			// steps allowed by the current run()
+	std::vector<unsigned int> stack;
+	const char * reason;		// why it stopped, 0 while it can go on
+	unsigned int cycle;			// with reason "entered cycle", the step it was entered at
+	bool grouped;				// still stepped by the vector kernels
+
+	// Cycle detection
+	unsigned int start[3];		// registers at step 0, where a cycle is replayed from
+	unsigned long long hash;	// of stack, kept once the lane has left the group
+	CycleDetector cycles;
+};
+
+//---------------------------------------------------------------------------
+// Lanes stepped together, structure of arrays over the padded width.
+// BatchMachine steps one; confirming a cycle replays copies of it
+struct batch_group
+{
+	std::vector<unsigned int>	reg[3];
+	std::vector<unsigned int>	live;		// ~0 for lanes in the group, 0 otherwise
+	std::vector<unsigned int>	rows;		// slot d of lane l at rows[d * width + l]
+	std::vector<unsigned long long>	hash;	// stack hash per lane, with cycle detection
+	unsigned int				eip;
+	unsigned int				depth;
+	unsigned int				steps;
+	int							idx;		// instruction at eip, -1 if unknown
+};
+
+//---------------------------------------------------------------------------
+// Runs many instances of one program in lockstep. Registers are
+// kept as one array per register and the stack as one row of slots per
+// depth, so every instruction is a handful of vector operations over all
+// instances (AVX2 when compiled with it).
+//
+// Instances in the group share eip and stack depth. Where they stop
+// agreeing (jmp/call through a register, retn, mov esp) the ones that
+// differ from lane 0 are split off and finish on their own with the
+// scalar step below. Lane 0 always agrees with itself, so it leads the
+// group for its whole life.
+//
+// Every instance is one guest thread; spawn stops it.
+class BatchMachine
+{
+public:
+	// The addresses in program have to be current, see Machine::refreshAddresses
+	BatchMachine(const std::vector<instruction> & program, unsigned int lanes, unsigned int max_depth = MAX_STACK_SLOTS);
+
+	unsigned int lanes() const { return Count; }
+	// Before the first run, which starts every instance from them
+	void setRegisters(unsigned int lane, unsigned int esp, unsigned int ebp, unsigned int eax);
+	// Instances that come back to a state they have been in stop with
+	// reason "entered cycle" instead of running to the step limit
+	void setCycleDetection(bool on);
+
+	// Steps every instance at most budget more times
+	void run(unsigned int budget);
+	const batch_lane & lane(unsigned int i) const { return Lanes[i]; }
+	unsigned int splitCount() const { return Splits; }
+
+private:
+	int findInstruction(unsigned int addr) const;
+	void stepGroup(unsigned int budget);
+	const char * execute(batch_group & g, bool replay);
+	bool diverges(const batch_group & g, const unsigned int * value, unsigned int expected) const;
+	void leaveGroup(batch_group & g, bool replay, unsigned int l, unsigned int eip, unsigned int depth);
+	void splitLane(unsigned int l, unsigned int eip, unsigned int depth);
+	void splitBranch(batch_group & g, bool replay, const unsigned int * target);
+	void stopGroup(const char * reason);
+	bool stepLane(batch_lane & l);
+	void syncGroup();
+	void hashRow(batch_group & g, unsigned int depth);
+	bool sampleGroup();
+	bool confirmGroup(unsigned int period, unsigned int last);
+	void sampleLane(batch_lane & l);
+	bool findCycleEntry(unsigned int lane, unsigned int period, unsigned int last, unsigned int & entry);
+
+	const std::vector<instruction> &	Program;
+	unsigned int				Count;
+	unsigned int				Width;		// Count rounded up to the vector width
+	unsigned int				MaxDepth;
+	std::vector<batch_lane>		Lanes;
+	unsigned int				Splits;
+	bool						DetectCycles;
+
+	batch_group					Group;
+	std::vector<unsigned int>	Scratch;
+	CycleDetector				Cycles;		// over the whole group
+	bool						CycleArmed;
+	batch_group					CycleStart;	// where the group's samples began
+};
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __BatchMachine_h_
@@ -0,0 +1,36 @@
+#include "CycleDetector.h"
+
+//---------------------------------------------------------------------------
+CycleDetector::CycleDetector(void)
+	: Mark(0),
+	MarkStep(0),
+	Power(1),
+	Length(0),
+	Marked(false)
+{
+}
+
+void CycleDetector::restart()
+{
+	Power = 1;
+	Length = 0;
+	Marked = false;
+}
+
+bool CycleDetector::sample(unsigned long long hash, unsigned long long step)
+{
+	if (Marked && hash == Mark)
+		return true;
+
+	if (!Marked || Length == Power)
+	{
+		if (Marked)
+			Power *= 2;
+		Mark = hash;
+		MarkStep = step;
+		Length = 0;
+		Marked = true;
+	}
+	++Length;
+	return false;
+}
@@ -0,0 +1,72 @@
+#ifndef __CycleDetector_h_
+#define __CycleDetector_h_
+
+//---------------------------------------------------------------------------
+// Hashes of machine state. The stack is hashed as the set of its (slot,
+// value) pairs, the xor of one mixed word per slot, so a push or pop
+// updates it in O(1); the registers are mixed in when a state is sampled.
+inline unsigned long long mix_state(unsigned long long x)
+{
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ull;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+inline unsigned long long slot_hash(unsigned int slot, unsigned int value)
+{
+	return mix_state((((unsigned long long)slot << 32) | value) ^ 0x9E3779B97F4A7C15ull);
+}
+
+inline unsigned long long state_hash(unsigned long long stack, unsigned int esp, unsigned int ebp,
+	unsigned int eax, unsigned int eip)
+{
+	return stack ^ mix_state((((unsigned long long)esp << 32) | ebp) ^ 0xC2B2AE3D27D4EB4Full)
+		^ mix_state((((unsigned long long)eax << 32) | eip) ^ 0x165667B19E3779F9ull);
+}
+
+// The 64-bit machine folds the high halves in on top
+inline unsigned long long slot_hash(unsigned int slot, unsigned long long value)
+{
+	return slot_hash(slot, (unsigned int)value) ^ mix_state((value >> 32) ^ ((unsigned long long)slot << 32));
+}
+
+inline unsigned long long state_hash(unsigned long long stack, unsigned long long esp, unsigned long long ebp,
+	unsigned long long eax, unsigned long long eip)
+{
+	return state_hash(stack, (unsigned int)esp, (unsigned int)ebp, (unsigned int)eax, (unsigned int)eip)
+		^ mix_state(((esp >> 32) << 32 | ebp >> 32) ^ 0x27D4EB2F165667C5ull)
+		^ mix_state(((eax >> 32) << 32 | eip >> 32) ^ 0x85EBCA77C2B2AE63ull);
+}
+
+//---------------------------------------------------------------------------
+// Brent's cycle finding over states sampled at loop heads, that is after
+// a jump backwards; a program that never ends passes one over and over.
+// The mark moves to the current state whenever the samples since the
+// last move reach the next power of two, so a cycle of p samples entered
+// after m is seen within about 2 * (m + p) samples, in O(1) memory.
+//
+// A match means the two states hash the same; callers confirm it by
+// replaying the run, which also finds the step the cycle was entered at.
+class CycleDetector
+{
+public:
+	CycleDetector(void);
+
+	void restart();
+	// True if hash matches the mark, i.e. the state at markStep() is back
+	bool sample(unsigned long long hash, unsigned long long step);
+	unsigned long long markStep() const { return MarkStep; }
+
+private:
+	unsigned long long	Mark;
+	unsigned long long	MarkStep;
+	unsigned long long	Power;
+	unsigned long long	Length;			// samples since the mark moved
+	bool				Marked;
+};
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __CycleDetector_h_
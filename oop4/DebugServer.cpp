@@ -0,0 +1,536 @@
+#include "DebugServer.h"
+#include "StepGenerator.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <afunix.h>		// AF_UNIX needs Windows 10 1803 and its SDK
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static const unsigned int DEFAULT_RUN_BUDGET = 100000000;
+// Longest request line; a client sending more without a newline is dropped
+static const size_t MAX_REQUEST_LINE = 65536;
+
+//---------------------------------------------------------------------------
+template <class Word>
+BasicDebugServer<Word>::BasicDebugServer(BasicMachine<Word> & machine)
+	: Vm(machine),
+	Listener(0),
+	Listening(false),
+	Shutdown(false),
+	RunSlice(0),
+	Handed(false)
+{
+}
+
+template <class Word>
+BasicDebugServer<Word>::~BasicDebugServer(void)
+{
+	stop();
+}
+
+//---------------------------------------------------------------------------
+template <class Word>
+bool BasicDebugServer<Word>::start(const std::string & path)
+{
+	stop();
+
+#if defined(_WIN32)
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+		return false;
+#endif
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		return false;
+	strcpy(addr.sun_path, path.c_str());
+
+	Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+#if defined(_WIN32)
+	if (Listener == INVALID_SOCKET)
+		return false;
+#else
+	if ((int)Listener < 0)
+		return false;
+#endif
+
+	// A socket file left behind by a previous run would make bind fail
+	remove(path.c_str());
+	if (bind(Listener, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(Listener, 4) != 0)
+	{
+		close_socket(Listener);
+		return false;
+	}
+
+	Path = path;
+	Listening = true;
+	Shutdown = false;
+	return true;
+}
+
+template <class Word>
+void BasicDebugServer<Word>::stop()
+{
+	for (size_t i = 0; i < Clients.size(); ++i)
+		close_socket(Clients[i].fd);
+	Clients.clear();
+	Handed = false;
+
+	if (Listening)
+	{
+		close_socket(Listener);
+		remove(Path.c_str());
+		Listening = false;
+#if defined(_WIN32)
+		WSACleanup();
+#endif
+	}
+}
+
+template <class Word>
+void BasicDebugServer<Word>::close_socket(socket_t fd)
+{
+#if defined(_WIN32)
+	closesocket(fd);
+#else
+	close(fd);
+#endif
+}
+
+//---------------------------------------------------------------------------
+template <class Word>
+bool BasicDebugServer<Word>::poll(int timeout_ms)
+{
+	if (!Listening || Shutdown)
+		return false;
+
+	// Nothing is read while the host has a run; once it stops, the requests
+	// that came after it go on from what was already read
+	bool touched = false;
+	if (Handed)
+	{
+		if (!finish_run())
+			return false;
+		touched = true;
+		for (size_t i = 0; i < Clients.size() && !Handed; ++i)
+			touched |= serve_lines(Clients[i]);
+		drop_closed();
+		if (Handed)
+			return touched;
+	}
+
+	fd_set readable;
+	FD_ZERO(&readable);
+	FD_SET(Listener, &readable);
+	socket_t top = Listener;
+	for (size_t i = 0; i < Clients.size(); ++i)
+	{
+		FD_SET(Clients[i].fd, &readable);
+		if (Clients[i].fd > top)
+			top = Clients[i].fd;
+	}
+
+	timeval tv;
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+	if (select((int)top + 1, &readable, 0, 0, &tv) <= 0)
+		return touched;
+
+	for (size_t i = 0; i < Clients.size() && !Handed; ++i)
+		if (FD_ISSET(Clients[i].fd, &readable))
+			touched |= serve(Clients[i]);
+	drop_closed();
+
+	if (FD_ISSET(Listener, &readable))
+		accept_clients();
+
+	return touched;
+}
+
+template <class Word>
+void BasicDebugServer<Word>::drop_closed()
+{
+	for (size_t i = 0; i < Clients.size(); )
+	{
+		if (Clients[i].closing)
+		{
+			close_socket(Clients[i].fd);
+			Clients.erase(Clients.begin() + i);
+		}
+		else
+			++i;
+	}
+}
+
+template <class Word>
+void BasicDebugServer<Word>::accept_clients()
+{
+	socket_t fd = accept(Listener, 0, 0);
+#if defined(_WIN32)
+	if (fd == INVALID_SOCKET)
+		return;
+#else
+	if ((int)fd < 0)
+		return;
+#endif
+
+	client c;
+	c.fd = fd;
+	c.closing = false;
+	Clients.push_back(c);
+}
+
+// Reads what is available and serves it
+template <class Word>
+bool BasicDebugServer<Word>::serve(client & c)
+{
+	char buf[65536];
+	int n = recv(c.fd, buf, sizeof(buf), 0);
+	if (n <= 0)
+	{
+		c.closing = true;
+		return false;
+	}
+	c.in.append(buf, n);
+	return serve_lines(c);
+}
+
+// Runs every complete line, up to one handed to the host, and answers
+// them in one write
+template <class Word>
+bool BasicDebugServer<Word>::serve_lines(client & c)
+{
+	std::string out;
+	bool touched = false;
+	size_t start = 0;
+	size_t eol;
+	while (!c.closing && !Handed && (eol = c.in.find('\n', start)) != std::string::npos)
+	{
+		std::string line = c.in.substr(start, eol - start);
+		if (line.size() > 0 && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+		start = eol + 1;
+
+		if (line.size() > MAX_REQUEST_LINE)
+		{
+			out += "ERR line too long\n";
+			c.closing = true;
+		}
+		else if (line.size() > 0)
+			touched |= handle(line, out, c);
+	}
+	c.in.erase(0, start);
+	if (!c.closing && !Handed && c.in.size() > MAX_REQUEST_LINE)
+	{
+		out += "ERR line too long\n";
+		c.closing = true;
+	}
+
+	send_reply(c, out);
+	return touched;
+}
+
+template <class Word>
+void BasicDebugServer<Word>::send_reply(client & c, const std::string & out)
+{
+	size_t sent = 0;
+	while (sent < out.size())
+	{
+		int k = send(c.fd, out.data() + sent, (int)(out.size() - sent), MSG_NOSIGNAL);
+		if (k <= 0)
+		{
+			c.closing = true;
+			break;
+		}
+		sent += k;
+	}
+}
+
+//---------------------------------------------------------------------------
+template <class Word>
+unsigned int BasicDebugServer<Word>::runBudget(unsigned int slice) const
+{
+	if (!Handed)
+		return slice;
+	unsigned long long done = (Vm.Steps >= Run.start) ? Vm.Steps - Run.start : 0;
+	unsigned long long left = (done < Run.count) ? Run.count - done : 0;
+	return (left < slice) ? (unsigned int)left : slice;
+}
+
+// Answers the request whose run the host has been stepping once the run
+// stopped, by itself, by the user or by doing its count; false while it
+// goes on. A reset or load in between leaves the steps it reports at 0
+template <class Word>
+bool BasicDebugServer<Word>::finish_run()
+{
+	unsigned long long done = (Vm.Steps >= Run.start) ? Vm.Steps - Run.start : 0;
+	if (Vm.Running && done < Run.count)
+		return false;
+
+	Vm.Running = false;
+	Handed = false;
+	for (size_t i = 0; i < Clients.size(); ++i)
+	{
+		if (Clients[i].fd != Run.fd)
+			continue;
+		std::string out;
+		reply_run(out, (unsigned int)std::min<unsigned long long>(done, Run.count));
+		send_reply(Clients[i], out);
+	}
+	return true;
+}
+
+//---------------------------------------------------------------------------
+// 0x keeps replies from being read back as decimal by the request parser
+static void append_hex(std::string & out, unsigned long long value)
+{
+	char buf[24];
+	sprintf(buf, "0x%llx", value);
+	out += buf;
+}
+
+static bool parse_count(std::istringstream & in, unsigned int & count)
+{
+	std::string word;
+	if (!(in >> word))
+		return true;
+	return Predicate::parse_number(word, count);
+}
+
+template <class Word>
+void BasicDebugServer<Word>::reply_run(std::string & out, unsigned int done)
+{
+	out += "OK ";
+	append_hex(out, done);
+	out += ' ';
+	out += (Vm.BreakReason.size() > 0) ? Vm.BreakReason : "-";
+	out += '\n';
+}
+
+template <class Word>
+bool BasicDebugServer<Word>::handle(const std::string & line, std::string & out, client & c)
+{
+	std::istringstream in(line);
+	std::string cmd;
+	in >> cmd;
+
+	if (cmd == "regs")
+	{
+		out += "OK ";
+		append_hex(out, Vm.esp); out += ' ';
+		append_hex(out, Vm.ebp); out += ' ';
+		append_hex(out, Vm.eax); out += ' ';
+		append_hex(out, Vm.eip); out += '\n';
+		return false;
+	}
+	else if (cmd == "step" || cmd == "run")
+	{
+		unsigned int count = (cmd == "step") ? 1 : DEFAULT_RUN_BUDGET;
+		if (!parse_count(in, count))
+		{
+			out += "ERR bad count\n";
+			return false;
+		}
+
+		Vm.StopDepth = -1;
+		Vm.BreakReason = "";
+		if (RunSlice > 0 && count > RunSlice)
+		{
+			Vm.Running = true;
+			Handed = true;
+			Run.fd = c.fd;
+			Run.start = Vm.Steps;
+			Run.count = count;
+			return true;
+		}
+
+		Vm.Running = false;
+		reply_run(out, Vm.runInstructions(count));
+		return true;
+	}
+	else if (cmd == "trace")
+	{
+		unsigned int count = 0;
+		if (!parse_count(in, count) || count == 0)
+		{
+			out += "ERR bad count\n";
+			return false;
+		}
+
+		Vm.Running = false;
+		Vm.StopDepth = -1;
+		Vm.BreakReason = "";
+		std::string steps;
+		unsigned int done = 0;
+		BasicStepGenerator<Word> gen(Vm);
+		basic_step_event<Word> ev;
+		while (done < count && gen.next(ev))
+		{
+			++done;
+			steps += ' ';
+			append_hex(steps, ev.reg[REG_EIP]); steps += ',';
+			append_hex(steps, ev.reg[REG_ESP]); steps += ',';
+			append_hex(steps, ev.reg[REG_EBP]); steps += ',';
+			append_hex(steps, ev.reg[REG_EAX]);
+			if (ev.stop)
+				break;
+		}
+
+		out += "OK ";
+		append_hex(out, done);
+		out += steps;
+		out += '\n';
+		return true;
+	}
+	else if (cmd == "stack")
+	{
+		Word addr = 0;
+		unsigned int count = 1;
+		std::string word;
+		if (!(in >> word) || !Predicate::parse_number(word, addr) || !parse_count(in, count))
+		{
+			out += "ERR bad address\n";
+			return false;
+		}
+
+		out += "OK";
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			Word value;
+			if (!Vm.read_slot(addr + i * Vm.SLOT_BYTES, value))
+				break;
+			out += ' ';
+			append_hex(out, value);
+		}
+		out += '\n';
+		return false;
+	}
+	else if (cmd == "break" || cmd == "watch")
+	{
+		std::string addr;
+		std::string cond;
+		in >> addr;
+		std::getline(in, cond);
+		size_t first = cond.find_first_not_of(" \t");
+		cond = (first != std::string::npos) ? cond.substr(first) : "";
+
+		std::string error;
+		bool ok = (cmd == "break")
+			? Vm.addBreakpoint((addr == "*") ? "" : addr, cond, error)
+			: Vm.addWatchpoint(addr, cond, error);
+		out += ok ? "OK\n" : "ERR " + error + "\n";
+		return ok;
+	}
+	else if (cmd == "clear")
+	{
+		Vm.Breakpoints.clear();
+		Vm.Watchpoints.clear();
+		Vm.updateBreakAt();
+		out += "OK\n";
+		return true;
+	}
+	else if (cmd == "reset")
+	{
+		Vm.reset();
+		out += "OK\n";
+		return true;
+	}
+	else if (cmd == "save" || cmd == "load")
+	{
+		std::string path;
+		if (!(in >> path))
+		{
+			out += "ERR needs a path\n";
+			return false;
+		}
+
+		bool ok = (cmd == "save") ? Vm.saveSnapshot(path) : Vm.loadSnapshot(path);
+		out += ok ? "OK\n" : "ERR cannot " + cmd + " " + path + "\n";
+		return ok && cmd == "load";
+	}
+	else if (cmd == "edit" || cmd == "insert" || cmd == "delete")
+	{
+		unsigned int idx = 0;
+		std::string word;
+		if (!(in >> word) || !Predicate::parse_number(word, idx))
+		{
+			out += "ERR bad index\n";
+			return false;
+		}
+		std::string text;
+		std::getline(in, text);
+
+		std::string error;
+		bool ok = (cmd == "edit") ? Vm.replaceInstruction(idx, text, error)
+			: (cmd == "insert") ? Vm.insertInstruction(idx, text, error)
+			: Vm.eraseInstruction(idx, error);
+		out += ok ? "OK\n" : "ERR " + error + "\n";
+		return ok;
+	}
+	else if (cmd == "cycles")
+	{
+		std::string mode;
+		in >> mode;
+		if (mode != "on" && mode != "off")
+		{
+			out += "ERR expected on or off\n";
+			return false;
+		}
+		Vm.setCycleDetection(mode == "on");
+		out += "OK\n";
+		return false;
+	}
+	else if (cmd == "threads")
+	{
+		unsigned int quantum = Vm.Quantum;
+		if (!parse_count(in, quantum) || quantum == 0)
+		{
+			out += "ERR bad quantum\n";
+			return false;
+		}
+		Vm.Quantum = quantum;
+
+		out += "OK ";
+		append_hex(out, Vm.ThreadId); out += ' ';
+		append_hex(out, Vm.threadCount()); out += ' ';
+		append_hex(out, Vm.Quantum); out += '\n';
+		return false;
+	}
+	else if (cmd == "quit")
+	{
+		c.closing = true;
+		out += "OK\n";
+		return false;
+	}
+	else if (cmd == "shutdown")
+	{
+		c.closing = true;
+		Shutdown = true;
+		out += "OK\n";
+		return false;
+	}
+
+	out += "ERR unknown command " + cmd + "\n";
+	return false;
+}
+
+//---------------------------------------------------------------------------
+template class BasicDebugServer<unsigned int>;
+template class BasicDebugServer<unsigned long long>;
@@ -0,0 +1,121 @@
+#ifndef __DebugServer_h_
+#define __DebugServer_h_
+
+#include <string>
+#include <vector>
+#include "Machine.h"
+
+//---------------------------------------------------------------------------
+// Line protocol over a Unix domain socket for driving a Machine or a
+// Machine64 from scripts. Every request is one line, every reply is one
+// line starting with "OK" or "ERR". Numbers in replies are hex with a 0x
+// prefix, so they can be sent back as they are; requests accept 123 /
+// 7Bh / 0x7B.
+//
+//   regs                   OK <esp> <ebp> <eax> <eip>
+//   step [n]               OK <executed> <stop reason or "-">
+//   run [n]                same as step, n defaults to 100000000
+//   trace <n>              OK <executed> <eip>,<esp>,<ebp>,<eax> ... one
+//                          register set per executed step
+//   stack <addr> [count]   OK <value at addr> <value at addr+4> ..., +8
+//                          on a Machine64
+//   break <addr> [cond]    OK | ERR <reason>; addr may be a label or "*"
+//                          for a condition checked on every step
+//   watch <addr> [cond]    OK | ERR <reason>
+//   clear                  OK, removes all breakpoints and watchpoints
+//   reset                  OK, registers and stack back to zero
+//   save <path>            OK | ERR <reason>, writes a snapshot file
+//   load <path>            OK | ERR <reason>, restores one taken from the
+//                          same program
+//   edit <idx> <text>      OK | ERR <reason>, replaces instruction idx
+//                          (an index, not an address) with one .asm line
+//   insert <idx> <text>    OK | ERR <reason>, adds one before idx
+//   delete <idx>           OK | ERR <reason>
+//   cycles on|off          OK, step and run stop with "entered cycle at
+//                          step <n>" once the machine repeats a state
+//   threads [quantum]      OK <running thread> <threads alive> <quantum>,
+//                          setting the quantum first if given
+//   quit                   OK, then the server closes this connection
+//   shutdown               OK, then the server stops accepting requests
+//
+// Requests may be batched: everything that arrived is executed in order
+// and all replies go back in a single write. A line longer than 64K is
+// answered with "ERR line too long" and the connection is closed.
+//
+// In a host that steps the machine itself while Running (the GUI, see
+// setRunSlice) a step or run of more steps than a frame takes is handed
+// to it: the request sets Running, and its reply, like every request
+// after it, waits until the run stops or has done its count.
+template <class Word>
+class BasicDebugServer
+{
+public:
+	BasicDebugServer(BasicMachine<Word> & machine);
+	~BasicDebugServer(void);
+
+	bool start(const std::string & path);
+	void stop();
+
+	// Serves whatever is pending, waiting at most timeout_ms for something
+	// to arrive; returns true if a request touched the machine
+	bool poll(int timeout_ms);
+	bool isShutdown() const { return Shutdown; }
+
+	// Runs of more than slice steps go to the host, which then steps at
+	// most runBudget(slice) per frame; 0, the default, runs every request
+	// to its end before replying
+	void setRunSlice(unsigned int slice) { RunSlice = slice; }
+	unsigned int runBudget(unsigned int slice) const;
+
+private:
+	BasicDebugServer(const BasicDebugServer &);
+	BasicDebugServer & operator=(const BasicDebugServer &);
+
+#if defined(_WIN32)
+	typedef unsigned long long socket_t;	// SOCKET
+#else
+	typedef int socket_t;
+#endif
+
+	struct client
+	{
+		socket_t fd;
+		std::string in;
+		bool closing;
+	};
+
+	// The step or run the host is finishing for a request
+	struct host_run
+	{
+		socket_t fd;
+		unsigned long long start;	// Vm.Steps when it was handed over
+		unsigned int count;
+	};
+
+	void accept_clients();
+	bool serve(client & c);
+	bool serve_lines(client & c);
+	void send_reply(client & c, const std::string & out);
+	void drop_closed();
+	bool finish_run();
+	void reply_run(std::string & out, unsigned int done);
+	bool handle(const std::string & line, std::string & out, client & c);
+	void close_socket(socket_t fd);
+
+	BasicMachine<Word> &	Vm;
+	std::string				Path;
+	socket_t				Listener;
+	bool					Listening;
+	bool					Shutdown;
+	std::vector<client>		Clients;
+	unsigned int			RunSlice;
+	bool					Handed;			// Run is in the host's hands
+	host_run				Run;
+};
+
+typedef BasicDebugServer<unsigned int> DebugServer;
+typedef BasicDebugServer<unsigned long long> DebugServer64;
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __DebugServer_h_
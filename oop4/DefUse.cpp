@@ -0,0 +1,321 @@
+#include "DefUse.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include "Machine.h"
+
+//---------------------------------------------------------------------------
+template <class Word>
+BasicDefUse<Word>::BasicDefUse(void)
+	: Revision(0),
+	Analysed(false),
+	Visits(0)
+{
+}
+
+template <class Word>
+void BasicDefUse<Word>::analyze(BasicMachine<Word> & vm)
+{
+	size_t n = vm.Instructions.size();
+	Revision = vm.Revision;
+	Analysed = true;
+	Visits = 0;
+	Starts.clear();
+	Entry.clear();
+	Targets.assign(n, -1);
+	Labelled.clear();
+	ReturnSites.clear();
+	if (n == 0)
+		return;
+
+	// Blocks start at the entry, at every place control can go to other
+	// than the next instruction, after every transfer of control, and
+	// every DEFUSE_BLOCK instructions so a query never replays more
+	std::vector<unsigned char> leader(n, 0);
+	for (size_t k = 0; k < vm.Labels.size(); ++k)
+	{
+		size_t idx = vm.Labels[k].idx;
+		if (idx < n && !leader[idx])
+		{
+			leader[idx] = 1;
+			Labelled.push_back(idx);
+		}
+	}
+	for (size_t i = 0; i < n; ++i)
+	{
+		unsigned char op = vm.Instructions[i].op;
+		if (op == OP_JMP || op == OP_CALL || op == OP_SPAWN || op == OP_RETN)
+		{
+			if (op != OP_RETN)
+				Targets[i] = vm.targetOf(i);
+			if (Targets[i] >= 0)
+				leader[Targets[i]] = 1;
+			if (i + 1 < n)
+				leader[i + 1] = 1;
+			if (op == OP_CALL && i + 1 < n)
+				ReturnSites.push_back(i + 1);
+		}
+		if (i % DEFUSE_BLOCK == 0)
+			leader[i] = 1;
+	}
+	for (size_t i = 0; i < n; ++i)
+		if (leader[i])
+			Starts.push_back(i);
+	Entry.resize(Starts.size());
+	Queued.assign(Starts.size(), 0);
+	Indirect = flow_state();
+	Returning = flow_state();
+
+	// Registers start out written by nobody, the stack empty
+	flow_state s;
+	s.reached = true;
+	for (int r = 0; r < 3; ++r)
+		s.reg[r].assign(1, DEFUSE_INITIAL);
+	// A heap on block index: lowest first follows the program's order and
+	// settles in fewer visits than whatever was queued last
+	std::vector<size_t> work;
+	flowTo(0, s, work);
+
+	while (!work.empty())
+	{
+		std::pop_heap(work.begin(), work.end(), std::greater<size_t>());
+		size_t b = work.back();
+		work.pop_back();
+		Queued[b] = 0;
+		++Visits;
+
+		s = Entry[b];
+		size_t end = (b + 1 < Starts.size()) ? Starts[b + 1] : n;
+		for (size_t i = Starts[b]; i < end; ++i)
+			transfer(vm, i, s);
+
+		size_t last = end - 1;
+		const typename BasicMachine<Word>::instruction & inst = vm.Instructions[last];
+		bool indirect = inst.src != OPND_IMM;
+		switch (inst.op)
+		{
+		case OP_JMP:
+		case OP_CALL:
+			if (indirect)
+				flowToAll(Labelled, Indirect, s, work);
+			else if (Targets[last] >= 0)
+				flowTo(Targets[last], s, work);
+			break;
+		case OP_RETN:
+			flowToAll(ReturnSites, Returning, s, work);
+			break;
+		case OP_SPAWN:
+			{
+				// The new thread starts with registers the spawn set and
+				// a stack of its own
+				flow_state t;
+				t.reached = true;
+				for (int r = 0; r < 3; ++r)
+					t.reg[r].assign(1, (int)last);
+				if (indirect)
+					for (size_t k = 0; k < Labelled.size(); ++k)
+						flowTo(Labelled[k], t, work);
+				else if (Targets[last] >= 0)
+					flowTo(Targets[last], t, work);
+				if (end < n)
+					flowTo(end, s, work);
+			}
+			break;
+		default:
+			if (end < n)
+				flowTo(end, s, work);
+		}
+	}
+}
+
+template <class Word>
+void BasicDefUse<Word>::refresh(BasicMachine<Word> & vm)
+{
+	if (!Analysed || Revision != vm.Revision)
+		analyze(vm);
+}
+
+//---------------------------------------------------------------------------
+template <class Word>
+bool BasicDefUse<Word>::registerWriters(BasicMachine<Word> & vm, size_t idx, int r, std::vector<int> & writers)
+{
+	flow_state s;
+	if (r < REG_ESP || r > REG_EAX || !stateAt(vm, idx, s))
+		return false;
+	writers = s.reg[r];
+	return true;
+}
+
+template <class Word>
+bool BasicDefUse<Word>::slotWriters(BasicMachine<Word> & vm, size_t idx, size_t depth, std::vector<int> & writers)
+{
+	flow_state s;
+	if (!stateAt(vm, idx, s) || depth >= s.stack.size())
+		return false;
+	writers = s.stack[s.stack.size() - 1 - depth];
+	return true;
+}
+
+// Replays the block up to idx from the state at its start
+template <class Word>
+bool BasicDefUse<Word>::stateAt(BasicMachine<Word> & vm, size_t idx, flow_state & s)
+{
+	refresh(vm);
+	if (idx >= vm.Instructions.size())
+		return false;
+
+	size_t b = blockOf(idx);
+	if (!Entry[b].reached)
+		return false;
+	s = Entry[b];
+	for (size_t i = Starts[b]; i < idx; ++i)
+		transfer(vm, i, s);
+	return true;
+}
+
+template <class Word>
+size_t BasicDefUse<Word>::blockOf(size_t idx) const
+{
+	return std::upper_bound(Starts.begin(), Starts.end(), idx) - Starts.begin() - 1;
+}
+
+//---------------------------------------------------------------------------
+// What one instruction writes, as the handlers in Machine.cpp do it
+template <class Word>
+void BasicDefUse<Word>::transfer(const BasicMachine<Word> & vm, size_t idx, flow_state & s) const
+{
+	const typename BasicMachine<Word>::instruction & inst = vm.Instructions[idx];
+	switch (inst.op)
+	{
+	case OP_MOV:
+	case OP_POP:
+		if (inst.op == OP_POP)
+		{
+			if (!s.stack.empty())
+				s.stack.pop_back();
+			s.reg[REG_ESP].assign(1, (int)idx);
+		}
+		if (inst.dst < REG_EIP)
+			s.reg[inst.dst].assign(1, (int)idx);
+		if (inst.dst == REG_ESP)
+		{
+			s.stack.clear();
+			s.deep = true;
+		}
+		break;
+	case OP_PUSH:
+	case OP_CALL:
+		push_slot(s, (int)idx);
+		s.reg[REG_ESP].assign(1, (int)idx);
+		break;
+	case OP_RETN:
+		if (!s.stack.empty())
+			s.stack.pop_back();
+		s.reg[REG_ESP].assign(1, (int)idx);
+		s.reg[REG_EBP].assign(1, (int)idx);
+		break;
+	}
+}
+
+template <class Word>
+void BasicDefUse<Word>::push_slot(flow_state & s, int idx)
+{
+	s.stack.push_back(writer_set(1, idx));
+	if (s.stack.size() > DEFUSE_SLOTS)
+	{
+		s.stack.erase(s.stack.begin());
+		s.deep = true;
+	}
+}
+
+// Queues the block starting at idx if from adds anything to its state
+template <class Word>
+bool BasicDefUse<Word>::flowTo(size_t idx, const flow_state & from, std::vector<size_t> & work)
+{
+	size_t b = blockOf(idx);
+	if (!merge_state(Entry[b], from) || Queued[b])
+		return false;
+	Queued[b] = 1;
+	work.push_back(b);
+	std::push_heap(work.begin(), work.end(), std::greater<size_t>());
+	return true;
+}
+
+// Every one of targets gets the same state, so the sources are joined
+// first and the targets only see it when the join grew; a program full
+// of returns or jumps through registers is not merged sources x targets
+// times
+template <class Word>
+void BasicDefUse<Word>::flowToAll(const std::vector<size_t> & targets, flow_state & joined, const flow_state & from,
+	std::vector<size_t> & work)
+{
+	if (!merge_state(joined, from))
+		return;
+	for (size_t k = 0; k < targets.size(); ++k)
+		flowTo(targets[k], joined, work);
+}
+
+template <class Word>
+bool BasicDefUse<Word>::merge_set(writer_set & into, const writer_set & from)
+{
+	if (into.size() == 1 && into[0] == DEFUSE_MANY)
+		return false;
+	if (from.size() == 1 && from[0] == DEFUSE_MANY)
+	{
+		into.assign(1, DEFUSE_MANY);
+		return true;
+	}
+
+	// Most merges add nothing; only build the union when they do
+	if (std::includes(into.begin(), into.end(), from.begin(), from.end()))
+		return false;
+
+	writer_set both;
+	both.reserve(into.size() + from.size());
+	std::set_union(into.begin(), into.end(), from.begin(), from.end(), std::back_inserter(both));
+	if (both.size() == into.size())
+		return false;
+	if (both.size() > DEFUSE_MAX_WRITERS)
+		into.assign(1, DEFUSE_MANY);
+	else
+		into.swap(both);
+	return true;
+}
+
+// Sets only grow, the stack only gets shallower and deep only gets set,
+// so the worklist runs dry
+template <class Word>
+bool BasicDefUse<Word>::merge_state(flow_state & into, const flow_state & from)
+{
+	if (!into.reached)
+	{
+		into = from;
+		return true;
+	}
+
+	bool changed = false;
+	for (int r = 0; r < 3; ++r)
+		changed |= merge_set(into.reg[r], from.reg[r]);
+
+	// Stacks meet at their tops; what is below the shallower one is unknown
+	size_t common = std::min(into.stack.size(), from.stack.size());
+	bool deep = into.deep || from.deep || into.stack.size() != from.stack.size();
+	if (into.stack.size() > common)
+	{
+		into.stack.erase(into.stack.begin(), into.stack.begin() + (into.stack.size() - common));
+		changed = true;
+	}
+	for (size_t k = 0; k < common; ++k)
+		changed |= merge_set(into.stack[k], from.stack[from.stack.size() - common + k]);
+	if (deep != into.deep)
+	{
+		into.deep = true;
+		changed = true;
+	}
+	return changed;
+}
+
+//---------------------------------------------------------------------------
+template class BasicDefUse<unsigned int>;
+template class BasicDefUse<unsigned long long>;
@@ -0,0 +1,95 @@
+#ifndef __DefUse_h_
+#define __DefUse_h_
+
+#include <cstddef>
+#include <vector>
+
+template <class Word> class BasicMachine;
+
+// Writer sets hold instruction indices, ascending, or one of these
+static const int DEFUSE_INITIAL = -1;		// the value after a reset, written by no instruction
+static const int DEFUSE_MANY = -2;			// more than DEFUSE_MAX_WRITERS, not listed
+static const unsigned int DEFUSE_MAX_WRITERS = 16;
+static const unsigned int DEFUSE_SLOTS = 32;		// stack slots followed below the top
+static const unsigned int DEFUSE_BLOCK = 1024;		// instructions replayed by a query at most
+
+//---------------------------------------------------------------------------
+// Reaching definitions over the program's control-flow graph: for every
+// instruction, which instructions' writes to eax, ebp, esp and the top
+// DEFUSE_SLOTS stack slots can still be there when it is about to run.
+// That answers "where did this value come from" for whatever eip is at,
+// without running anything.
+//
+// The stack is followed relative to its top, the way push, pop, call and
+// retn move it; paths that meet with different depths keep the slots they
+// have in common. mov into esp can move the top anywhere, so the slots are
+// unknown after it until pushes make new ones. Jumps and calls through a
+// register may go to any labelled instruction, retn to the instruction
+// after any call.
+//
+// States are kept at the start of blocks of at most DEFUSE_BLOCK
+// instructions and a query replays from there. The loader runs analyze();
+// after an edit, Machine::Revision moves on and the next query runs it
+// again.
+template <class Word>
+class BasicDefUse
+{
+public:
+	typedef std::vector<int> writer_set;
+
+	struct flow_state
+	{
+		flow_state() : reached(false), deep(false) {}
+
+		bool reached;
+		bool deep;							// slots below stack may hold anything
+		writer_set reg[3];					// indexed by REG_ESP, REG_EBP, REG_EAX
+		std::vector<writer_set> stack;		// back() is the top
+	};
+
+	BasicDefUse(void);
+
+	void analyze(BasicMachine<Word> & vm);
+
+	// Writers of register r (REG_ESP, REG_EBP or REG_EAX), or of the slot
+	// depth slots below the top, 0 for the top, that can reach the
+	// instruction at idx; false if idx cannot be reached, or the slot is
+	// beyond what the analysis follows
+	bool registerWriters(BasicMachine<Word> & vm, size_t idx, int r, std::vector<int> & writers);
+	bool slotWriters(BasicMachine<Word> & vm, size_t idx, size_t depth, std::vector<int> & writers);
+	// All of it at once, for one replay instead of one per register and
+	// slot; false if idx cannot be reached
+	bool stateAt(BasicMachine<Word> & vm, size_t idx, flow_state & s);
+
+	size_t blocks() const { return Starts.size(); }
+	unsigned long long visits() const { return Visits; }	// of blocks until nothing changed
+
+private:
+	void refresh(BasicMachine<Word> & vm);
+	size_t blockOf(size_t idx) const;
+	void transfer(const BasicMachine<Word> & vm, size_t idx, flow_state & s) const;
+	bool flowTo(size_t idx, const flow_state & from, std::vector<size_t> & work);
+	void flowToAll(const std::vector<size_t> & targets, flow_state & joined, const flow_state & from,
+		std::vector<size_t> & work);
+	static void push_slot(flow_state & s, int idx);
+	static bool merge_set(writer_set & into, const writer_set & from);
+	static bool merge_state(flow_state & into, const flow_state & from);
+
+	unsigned int				Revision;		// of the program analysed, see Machine::Revision
+	bool						Analysed;
+	std::vector<size_t>			Starts;			// first instruction of each block, ascending
+	std::vector<flow_state>		Entry;			// per block
+	std::vector<int>			Targets;		// per instruction: immediate jump, call or spawn target, -1 for none
+	std::vector<size_t>			Labelled;		// where jumps through registers may go
+	std::vector<size_t>			ReturnSites;	// after every call
+	flow_state					Indirect;		// joined over jumps and calls through registers
+	flow_state					Returning;		// joined over retn
+	std::vector<unsigned char>	Queued;			// per block
+	unsigned long long			Visits;
+};
+
+typedef BasicDefUse<unsigned int> DefUse;
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __DefUse_h_
@@ -0,0 +1,158 @@
+#include "Diagnostics.h"
+
+#include <chrono>
+#include <cstring>
+
+static const char * diag_texts[DIAG_COUNT] =
+{
+	"mov into an unknown register",
+	"pop into an unknown register",
+	"pop with esp at 0",
+	"unknown instruction"
+};
+
+static const char * severity_names[] = { "info", "warning", "error" };
+
+//---------------------------------------------------------------------------
+Diagnostics::Diagnostics(void)
+	: Head(0),
+	Tail(0),
+	Quit(false),
+	Out(0),
+	Lost(0)
+{
+	memset(Window, 0, sizeof(Window));
+	memset(Sent, 0, sizeof(Sent));
+	memset(Held, 0, sizeof(Held));
+}
+
+Diagnostics::~Diagnostics(void)
+{
+	stop();
+}
+
+const char * Diagnostics::text(diag_id id)
+{
+	return diag_texts[id];
+}
+
+//---------------------------------------------------------------------------
+bool Diagnostics::start(const std::string & path)
+{
+	stop();
+
+	Out = (path == "-") ? stderr : fopen(path.c_str(), "a");
+	if (!Out)
+		return false;
+
+	Quit = false;
+	Writer = std::thread(&Diagnostics::work, this);
+	return true;
+}
+
+void Diagnostics::stop()
+{
+	if (!Out)
+		return;
+
+	Quit = true;
+	Writer.join();
+
+	// What the rate limit still holds would otherwise go unmentioned
+	for (int id = 0; id < DIAG_COUNT; ++id)
+	{
+		if (Held[id] > 0)
+			fprintf(Out, "oop5: %u more of \"%s\" held back\n", Held[id], diag_texts[id]);
+		Held[id] = 0;
+	}
+	if (Lost > 0)
+		fprintf(Out, "oop5: %u reports lost, the writer fell behind\n", Lost);
+	Lost = 0;
+
+	if (Out != stderr)
+		fclose(Out);
+	else
+		fflush(Out);
+	Out = 0;
+}
+
+//---------------------------------------------------------------------------
+void Diagnostics::report(diag_severity severity, diag_id id, unsigned long long step, unsigned long long eip,
+	int idx, const char * detail)
+{
+	if (!Out)
+		return;
+
+	if (step - Window[id] >= DIAG_WINDOW_STEPS || step < Window[id])
+	{
+		Window[id] = step;
+		Sent[id] = 0;
+	}
+	if (Sent[id] >= DIAG_BURST)
+	{
+		++Held[id];
+		return;
+	}
+
+	// Only this thread moves Head; the writer's Tail is read to see the
+	// ring is not full and the slot is published by the store of Head
+	unsigned int head = Head.load(std::memory_order_relaxed);
+	if (head - Tail.load(std::memory_order_acquire) >= DIAG_RING)
+	{
+		++Lost;
+		return;
+	}
+
+	diag_entry & e = Ring[head & (DIAG_RING - 1)];
+	e.step = step;
+	e.eip = eip;
+	e.idx = idx;
+	e.held = Held[id];
+	e.lost = Lost;
+	e.severity = (unsigned char)severity;
+	e.id = (unsigned char)id;
+	strncpy(e.detail, detail ? detail : "", sizeof(e.detail) - 1);
+	e.detail[sizeof(e.detail) - 1] = 0;
+	Head.store(head + 1, std::memory_order_release);
+
+	++Sent[id];
+	Held[id] = 0;
+	Lost = 0;
+}
+
+//---------------------------------------------------------------------------
+void Diagnostics::work()
+{
+	while (!Quit.load(std::memory_order_acquire))
+	{
+		drain();
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	drain();
+}
+
+// One line per report, e.g.
+//   oop5: warning at step 12, eip 0x1f, instruction 7: mov into an unknown register (ecx)
+void Diagnostics::drain()
+{
+	unsigned int tail = Tail.load(std::memory_order_relaxed);
+	unsigned int head = Head.load(std::memory_order_acquire);
+	if (tail == head)
+		return;
+
+	for (; tail != head; ++tail)
+	{
+		const diag_entry & e = Ring[tail & (DIAG_RING - 1)];
+		if (e.lost > 0)
+			fprintf(Out, "oop5: %u reports lost, the writer fell behind\n", e.lost);
+		fprintf(Out, "oop5: %s at step %llu, eip 0x%llx, instruction %d: %s", severity_names[e.severity],
+			e.step, e.eip, e.idx, diag_texts[e.id]);
+		if (e.detail[0])
+			fprintf(Out, " (%s)", e.detail);
+		if (e.held > 0)
+			fprintf(Out, ", %u more held back", e.held);
+		fputc('\n', Out);
+	}
+	Tail.store(tail, std::memory_order_release);
+	fflush(Out);
+}
@@ -0,0 +1,94 @@
+#ifndef __Diagnostics_h_
+#define __Diagnostics_h_
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+//---------------------------------------------------------------------------
+enum diag_severity { DIAG_INFO, DIAG_WARNING, DIAG_ERROR };
+
+// What the machine can report; the text is in Diagnostics.cpp
+enum diag_id
+{
+	DIAG_MOV_NO_DST = 0,	// mov into something that is not a register
+	DIAG_POP_NO_DST,		// pop into something that is not a register
+	DIAG_POP_ESP_ZERO,		// pop with esp at 0, the stack wraps
+	DIAG_UNKNOWN_OP,		// an unknown mnemonic, eip stays where it is
+	DIAG_COUNT
+};
+
+// One report, fixed size so the ring needs no allocation
+struct diag_entry
+{
+	unsigned long long step;		// Machine::Steps once the step ran
+	unsigned long long eip;
+	int idx;						// instruction index
+	unsigned int held;				// earlier reports of this id held back by the rate limit
+	unsigned int lost;				// reports of any id lost to a full ring since the last one
+	unsigned char severity;
+	unsigned char id;
+	char detail[30];				// operand or mnemonic as written, cut short
+};
+
+// Each id gets DIAG_BURST reports per DIAG_WINDOW_STEPS steps; the rest
+// are counted and the count goes out with the next one that is let
+// through. An unknown instruction, which leaves eip where it is, reports
+// DIAG_BURST times per window instead of once per step.
+static const unsigned int DIAG_RING = 1024;		// a power of two
+static const unsigned int DIAG_BURST = 8;
+static const unsigned long long DIAG_WINDOW_STEPS = 1000000;
+
+//---------------------------------------------------------------------------
+// Machine diagnostics, written out by a background thread. report() is
+// called by the thread that steps the machine and only fills a slot of a
+// single-producer ring, so the step loop never formats, locks or waits
+// on I/O; the writer drains the ring every few milliseconds.
+//
+// The machine only reports through a Diagnostics it has been given, and
+// only on paths that are errors anyway, so without one the cost is a
+// pointer test there. Building with OOP5_NO_DIAGNOSTICS removes even
+// that, see DIAGNOSE in Machine.cpp.
+class Diagnostics
+{
+public:
+	Diagnostics(void);
+	~Diagnostics(void);
+
+	// Appends to path, "-" for stderr; false if it cannot be opened
+	bool start(const std::string & path);
+	// Writes what is left in the ring and joins the writer; from the
+	// thread that reports, since the held-back counts are its own
+	void stop();
+	bool isRunning() const { return Out != 0; }
+
+	void report(diag_severity severity, diag_id id, unsigned long long step, unsigned long long eip,
+		int idx, const char * detail);
+
+	static const char * text(diag_id id);
+
+private:
+	Diagnostics(const Diagnostics &);
+	Diagnostics & operator=(const Diagnostics &);
+
+	void work();
+	void drain();
+
+	diag_entry					Ring[DIAG_RING];
+	std::atomic<unsigned int>	Head;			// next slot report() fills
+	std::atomic<unsigned int>	Tail;			// next slot the writer reads
+	std::atomic<bool>			Quit;
+	std::thread					Writer;
+	FILE *						Out;
+
+	// Producer side only
+	unsigned long long			Window[DIAG_COUNT];		// step the current window of an id began at
+	unsigned int				Sent[DIAG_COUNT];		// reports let through in it
+	unsigned int				Held[DIAG_COUNT];
+	unsigned int				Lost;
+};
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __Diagnostics_h_
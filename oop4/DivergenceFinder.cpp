@@ -0,0 +1,352 @@
+#include "DivergenceFinder.h"
+
+#include <algorithm>
+#include <thread>
+
+//---------------------------------------------------------------------------
+// One side of the search: a machine that steps without breakpoints,
+// watchpoints or cycle samples and can go back to its last checkpoint
+template <class Word>
+class basic_divergence_run : public BasicMachine<Word>
+{
+public:
+	typedef BasicMachine<Word> base;
+	typedef typename base::machine_state machine_state;
+	typedef typename base::instruction instruction;
+
+	basic_divergence_run(void)
+		: Ended(false),
+		Executed(0),
+		History(0),
+		SavedHistory(0),
+		SavedSlice(0),
+		SavedSpawned(1),
+		SavedThread(0),
+		SavedNext(0)
+	{
+	}
+
+	bool open(const std::string & path, std::string & error)
+	{
+		Messages.clear();
+		this->setProgramPath(path);
+		bool ok = this->loadProgram(path);
+		this->Watchpoints.clear();
+		if (!ok)
+			error += path + ": " + (Messages.empty() ? std::string("cannot load\n") : Messages);
+		return ok;
+	}
+
+	// To step steps in all, or until the program ends or faults. A step
+	// only changes registers, eip and the top of the stack, so those go
+	// into History after every one
+	void advance(unsigned long long step)
+	{
+		unsigned long long from = this->Steps;
+		while (!Ended && this->Steps < step)
+		{
+			if (!this->execute())
+			{
+				Ended = true;
+				History = mix_state(History ^ 0xD6E8FEB86659FD93ull);
+				break;
+			}
+			History = mix_state(History ^ fingerprint());
+		}
+		Executed += this->Steps - from;
+	}
+
+	// Cheaper than state_hash and good enough under the mix in advance():
+	// odd multipliers, so a change in any one register changes the sum
+	unsigned long long fingerprint() const
+	{
+		size_t depth = this->Stack.size();
+		unsigned long long v = depth ? (unsigned long long)this->Stack[depth - 1] : 0;
+		v = v * 0x9E3779B97F4A7C15ull + depth;
+		v = v * 0xC2B2AE3D27D4EB4Full + this->esp;
+		v = v * 0x165667B19E3779F9ull + this->ebp;
+		v = v * 0x27D4EB2F165667C5ull + this->eax;
+		return v * 0x85EBCA77C2B2AE63ull + this->eip;
+	}
+
+	bool sameAs(const basic_divergence_run & other) const
+	{
+		return Ended == other.Ended && this->esp == other.esp && this->ebp == other.ebp
+			&& this->eax == other.eax && this->eip == other.eip && this->Stack == other.Stack;
+	}
+
+	bool threaded() const { return !this->Threads.empty(); }
+
+	// Only taken with no thread parked, so this is all a replay needs.
+	// Slots below DirtyFrom have not been pushed or popped since the last
+	// save or restore, so only the ones above are copied
+	void save()
+	{
+		size_t from = std::min(this->DirtyFrom, Saved.stack.size());
+		Saved.stack.resize(this->Stack.size());
+		Saved.writes.resize(this->Stack.size());
+		std::copy(this->Stack.begin() + from, this->Stack.end(), Saved.stack.begin() + from);
+		std::copy(this->SlotWrites.begin() + from, this->SlotWrites.end(), Saved.writes.begin() + from);
+		this->DirtyFrom = this->Stack.size();
+
+		Saved.esp = this->esp;
+		Saved.ebp = this->ebp;
+		Saved.eax = this->eax;
+		Saved.eip = this->eip;
+		Saved.frames = this->CallStack;
+		Saved.steps = this->Steps;
+		SavedHistory = History;
+		SavedSlice = this->Slice;
+		SavedSpawned = this->SpawnedThreads;
+		SavedThread = this->ThreadId;
+		SavedNext = this->NextThread;
+	}
+
+	void restore()
+	{
+		size_t from = std::min(this->DirtyFrom, this->Stack.size());
+		this->Stack.resize(Saved.stack.size());
+		this->SlotWrites.resize(Saved.stack.size());
+		std::copy(Saved.stack.begin() + from, Saved.stack.end(), this->Stack.begin() + from);
+		std::copy(Saved.writes.begin() + from, Saved.writes.end(), this->SlotWrites.begin() + from);
+		this->DirtyFrom = this->Stack.size();
+
+		this->esp = Saved.esp;
+		this->ebp = Saved.ebp;
+		this->eax = Saved.eax;
+		this->eip = Saved.eip;
+		this->CallStack = Saved.frames;
+		this->Steps = Saved.steps;
+		History = SavedHistory;
+		this->Slice = SavedSlice;
+		this->SpawnedThreads = SavedSpawned;
+		this->ThreadId = SavedThread;
+		this->NextThread = SavedNext;
+		this->Threads.clear();
+		this->clearJournal();
+		Ended = false;
+	}
+
+	// e.g. "modified: step 12 ran push eax at 0x1f; eip 0x24 esp 0xfffffff8 ebp 0x0 eax 0x5, 2 slots"
+	std::string describe(const char * side, unsigned long long step)
+	{
+		std::string text = std::string(side) + ": ";
+		if (Ended && this->Steps < step)
+			return text + "ended at step " + std::to_string(this->Steps + 1) + ", " + this->BreakReason;
+
+		const instruction & inst = this->Instructions[this->ExecIdx];
+		text += "step " + std::to_string(this->Steps) + " ran " + this->mnemonic(inst) + " " + this->operand(inst, 0);
+		std::string arg2 = this->operand(inst, 1);
+		if (arg2.size() > 0)
+			text += ", " + arg2;
+		text += " at 0x" + this->decint_to_hexstr(this->addressOf(this->ExecIdx));
+		text += "; eip 0x" + this->decint_to_hexstr(this->eip) + " esp 0x" + this->decint_to_hexstr(this->esp)
+			+ " ebp 0x" + this->decint_to_hexstr(this->ebp) + " eax 0x" + this->decint_to_hexstr(this->eax)
+			+ ", " + std::to_string((unsigned long long)this->Stack.size()) + " slots";
+		return text;
+	}
+
+	bool				Ended;
+	unsigned long long	Executed;
+	unsigned long long	History;		// of every step so far
+
+protected:
+	void log(const std::string & message)
+	{
+		Messages += message + "\n";
+	}
+
+private:
+	std::string			Messages;		// of the loader
+	machine_state		Saved;
+	unsigned long long	SavedHistory;
+	unsigned int		SavedSlice;
+	unsigned int		SavedSpawned;
+	unsigned int		SavedThread;
+	size_t				SavedNext;
+};
+
+//---------------------------------------------------------------------------
+template <class Word>
+BasicDivergenceFinder<Word>::BasicDivergenceFinder(void)
+	: Original(0),
+	Modified(0),
+	Step(0),
+	Checkpoints(0),
+	Probes(0)
+{
+}
+
+template <class Word>
+BasicDivergenceFinder<Word>::~BasicDivergenceFinder(void)
+{
+	delete Original;
+	delete Modified;
+}
+
+template <class Word>
+bool BasicDivergenceFinder<Word>::open(const std::string & original, const std::string & modified, std::string & error)
+{
+	delete Original;
+	delete Modified;
+	Original = new basic_divergence_run<Word>();
+	Modified = new basic_divergence_run<Word>();
+
+	error.clear();
+	bool ok = Original->open(original, error);
+	ok = Modified->open(modified, error) && ok;
+	return ok;
+}
+
+template <class Word>
+unsigned long long BasicDivergenceFinder<Word>::executed() const
+{
+	return (Original && Modified) ? Original->Executed + Modified->Executed : 0;
+}
+
+//---------------------------------------------------------------------------
+template <class Word>
+bool BasicDivergenceFinder<Word>::find(unsigned long long max_steps, unsigned long long interval)
+{
+	Step = 0;
+	Error.clear();
+	Report.clear();
+	Checkpoints = 0;
+	Probes = 0;
+	if (!Original || !Modified)
+	{
+		Error = "nothing loaded";
+		return false;
+	}
+	if (interval == 0)
+		interval = DIVERGE_INTERVAL;
+
+	// Checkpoints until one differs; lo is the last that matched
+	unsigned long long lo = 0;
+	unsigned long long hi = 0;
+	save();
+	while (lo < max_steps)
+	{
+		unsigned long long next = std::min(lo + interval, max_steps);
+		if (!advance(next))
+			return false;
+		++Checkpoints;
+		if (!same())
+		{
+			hi = next;
+			break;
+		}
+		lo = next;
+		if (Original->Ended && Modified->Ended)
+			break;
+		save();
+	}
+	if (hi == 0)
+	{
+		Step = lo;
+		return false;
+	}
+
+	// Both sides are at hi, or at lo once a probe matched
+	bool atLo = false;
+	while (hi - lo > 1)
+	{
+		unsigned long long mid = lo + (hi - lo) / 2;
+		if (!atLo)
+			restore();
+		if (!advance(mid))
+			return false;
+		++Probes;
+		atLo = same();
+		if (atLo)
+		{
+			lo = mid;
+			save();
+		}
+		else
+			hi = mid;
+	}
+	if (!atLo)
+		restore();
+
+	// Matching hashes are taken for equal states; right before the
+	// divergent step they are checked in full
+	if (!Original->sameAs(*Modified))
+		Report = "hash collision: the states already differ at step " + std::to_string(lo)
+			+ ", they diverge at or before it\n";
+	if (!advance(hi))
+		return false;
+	Step = hi;
+	describe();
+	return true;
+}
+
+template <class Word>
+bool BasicDivergenceFinder<Word>::advance(unsigned long long step)
+{
+	// The two have nothing in common until they are compared
+	std::thread original(&basic_divergence_run<Word>::advance, Original, step);
+	Modified->advance(step);
+	original.join();
+	if (Original->threaded() || Modified->threaded())
+	{
+		Error = "threads are alive at step " + std::to_string(step) + ", they are not compared";
+		return false;
+	}
+	return true;
+}
+
+template <class Word>
+bool BasicDivergenceFinder<Word>::same()
+{
+	return Original->History == Modified->History;
+}
+
+template <class Word>
+void BasicDivergenceFinder<Word>::save()
+{
+	Original->save();
+	Modified->save();
+}
+
+template <class Word>
+void BasicDivergenceFinder<Word>::restore()
+{
+	Original->restore();
+	Modified->restore();
+}
+
+template <class Word>
+void BasicDivergenceFinder<Word>::describe()
+{
+	Report += Original->describe("original", Step) + "\n";
+	Report += Modified->describe("modified", Step) + "\n";
+}
+
+//---------------------------------------------------------------------------
+template <class Word>
+bool BasicDivergenceFinder<Word>::seek(BasicMachine<Word> & vm, unsigned long long step)
+{
+	std::vector<breakpoint> breakpoints;
+	std::vector<typename BasicMachine<Word>::watchpoint> watchpoints;
+	breakpoints.swap(vm.Breakpoints);
+	watchpoints.swap(vm.Watchpoints);
+	bool cycles = vm.cycleDetection();
+	vm.setCycleDetection(false);
+
+	bool ok = true;
+	while (ok && vm.Steps < step)
+	{
+		unsigned int budget = (unsigned int)std::min(step - vm.Steps, 1ull << 30);
+		ok = vm.runInstructions(budget) == budget;
+	}
+
+	vm.Breakpoints.swap(breakpoints);
+	vm.Watchpoints.swap(watchpoints);
+	vm.setCycleDetection(cycles);
+	return ok;
+}
+
+//---------------------------------------------------------------------------
+template class BasicDivergenceFinder<unsigned int>;
+template class BasicDivergenceFinder<unsigned long long>;
@@ -0,0 +1,81 @@
+#ifndef __DivergenceFinder_h_
+#define __DivergenceFinder_h_
+
+#include <string>
+#include "Machine.h"
+
+template <class Word> class basic_divergence_run;
+
+//---------------------------------------------------------------------------
+// Finds the first step at which a modified program's state differs from
+// the original's: registers, eip and stack after the same number of
+// steps, and whether the program has ended by then.
+//
+// Both run at full speed, each folding what every step changed into a
+// running hash of its history, and are compared only every interval
+// steps; the state at the last checkpoint that matched is kept. Since
+// the hash covers the whole history, a checkpoint differs from the first
+// divergent step on, even where the states agree again later. The steps
+// in between are then bisected: both go back to the last match, run to
+// the middle and compare there, so the divergent step is found in
+// log2(interval) probes and about two intervals of extra steps, whatever
+// the length of the run before it. The states right before that step
+// are compared in full, so a hash collision cannot pass unnoticed there.
+//
+// Guest threads are not compared, the search stops with an error at a
+// checkpoint where one is alive.
+template <class Word>
+class BasicDivergenceFinder
+{
+public:
+	BasicDivergenceFinder(void);
+	~BasicDivergenceFinder(void);
+
+	// false, with the loader's messages in error, if either does not load
+	bool open(const std::string & original, const std::string & modified, std::string & error);
+
+	// Runs both for at most max_steps; true if they diverge, with step()
+	// the first step after which their states differ. false with error()
+	// empty if they ran the same until both ended or max_steps
+	bool find(unsigned long long max_steps, unsigned long long interval);
+
+	unsigned long long step() const { return Step; }
+	const std::string & error() const { return Error; }
+	// What each side ran at step() and its state after it, two lines
+	const std::string & report() const { return Report; }
+	unsigned long long checkpoints() const { return Checkpoints; }
+	unsigned int probes() const { return Probes; }
+	unsigned long long executed() const;	// by both, replays included
+
+	// Runs vm from where it is to step, past its breakpoints and
+	// watchpoints; false, with vm.BreakReason saying why, if it ends first
+	static bool seek(BasicMachine<Word> & vm, unsigned long long step);
+
+private:
+	BasicDivergenceFinder(const BasicDivergenceFinder &);
+	BasicDivergenceFinder & operator=(const BasicDivergenceFinder &);
+
+	bool advance(unsigned long long step);
+	bool same();
+	void save();
+	void restore();
+	void describe();
+
+	basic_divergence_run<Word> *	Original;
+	basic_divergence_run<Word> *	Modified;
+	unsigned long long				Step;
+	std::string						Error;
+	std::string						Report;
+	unsigned long long				Checkpoints;
+	unsigned int					Probes;
+};
+
+typedef BasicDivergenceFinder<unsigned int> DivergenceFinder;
+
+// Steps between checkpoints unless the caller picks a number
+static const unsigned long long DIVERGE_INTERVAL = 1 << 16;
+static const unsigned long long DIVERGE_MAX_STEPS = 1000000000;
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __DivergenceFinder_h_
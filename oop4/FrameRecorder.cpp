@@ -0,0 +1,198 @@
+#include "FrameRecorder.h"
+#include "PngWriter.h"
+
+#include <cstdio>
+#include <OgreResourceGroupManager.h>
+#include <OgreTextureManager.h>
+#include <OgreHardwarePixelBuffer.h>
+#include <OgreViewport.h>
+
+static const unsigned int NO_FRAME = ~0u;
+
+//---------------------------------------------------------------------------
+FrameRecorder::FrameRecorder(void)
+	: Recording(false),
+	Width(0),
+	Height(0),
+	Next(0),
+	Frame(0),
+	Dropped(0),
+	Failed(0),
+	Quit(false)
+{
+	for (unsigned int i = 0; i < RECORD_SLOTS; ++i)
+	{
+		Slots[i].target = 0;
+		Slots[i].frame = NO_FRAME;
+	}
+}
+
+FrameRecorder::~FrameRecorder(void)
+{
+	stop();
+}
+
+//---------------------------------------------------------------------------
+bool FrameRecorder::start(Ogre::Camera * camera, unsigned int width, unsigned int height, const std::string & prefix)
+{
+	stop();
+
+	Ogre::TextureManager & textures = Ogre::TextureManager::getSingleton();
+	try
+	{
+		for (unsigned int i = 0; i < RECORD_SLOTS; ++i)
+		{
+			slot & s = Slots[i];
+			s.texture = textures.createManual("oop5/Record/" + std::to_string((unsigned long long)i),
+				Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME, Ogre::TEX_TYPE_2D,
+				width, height, 0, Ogre::PF_X8R8G8B8, Ogre::TU_RENDERTARGET);
+			s.target = s.texture->getBuffer()->getRenderTarget();
+			s.target->setAutoUpdated(false);
+			s.frame = NO_FRAME;
+
+			Ogre::Viewport * vp = s.target->addViewport(camera);
+			vp->setBackgroundColour(Ogre::ColourValue(0, 0, 0));
+			vp->setOverlaysEnabled(true);
+		}
+	}
+	catch (Ogre::Exception &)
+	{
+		for (unsigned int i = 0; i < RECORD_SLOTS; ++i)
+		{
+			if (!Slots[i].texture.isNull())
+				textures.remove(Slots[i].texture->getName());
+			Slots[i].texture.setNull();
+			Slots[i].target = 0;
+		}
+		return false;
+	}
+
+	Prefix = prefix;
+	Width = width;
+	Height = height;
+	Next = 0;
+	Frame = 0;
+	Dropped = 0;
+	Failed = 0;
+	Quit = false;
+
+	// The frame loop keeps a core for itself
+	unsigned int cores = std::thread::hardware_concurrency();
+	unsigned int count = (cores > 2) ? cores - 1 : 1;
+	for (unsigned int i = 0; i < count; ++i)
+		Workers.push_back(std::thread(&FrameRecorder::work, this));
+
+	Recording = true;
+	return true;
+}
+
+void FrameRecorder::stop()
+{
+	if (!Recording)
+		return;
+
+	// Oldest first, the ring is in capture order from Next on
+	for (unsigned int k = 0; k < RECORD_SLOTS; ++k)
+	{
+		slot & s = Slots[(Next + k) % RECORD_SLOTS];
+		if (s.frame != NO_FRAME)
+			readBack(s, false);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		Quit = true;
+	}
+	Ready.notify_all();
+	for (size_t i = 0; i < Workers.size(); ++i)
+		Workers[i].join();
+	Workers.clear();
+
+	Ogre::TextureManager & textures = Ogre::TextureManager::getSingleton();
+	for (unsigned int i = 0; i < RECORD_SLOTS; ++i)
+	{
+		textures.remove(Slots[i].texture->getName());
+		Slots[i].texture.setNull();
+		Slots[i].target = 0;
+	}
+	Free.clear();
+	Recording = false;
+}
+
+//---------------------------------------------------------------------------
+void FrameRecorder::capture()
+{
+	if (!Recording)
+		return;
+
+	slot & s = Slots[Next];
+	if (s.frame != NO_FRAME)
+		readBack(s, true);
+
+	s.target->update(false);
+	s.frame = Frame++;
+	Next = (Next + 1) % RECORD_SLOTS;
+}
+
+// Copies the slot's pixels into a pooled buffer and queues them; with
+// drop set, a full queue skips the frame instead of waiting
+void FrameRecorder::readBack(slot & s, bool drop)
+{
+	encode_job job;
+	job.frame = s.frame;
+	s.frame = NO_FRAME;
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		if (drop && Jobs.size() >= 2 * Workers.size())
+		{
+			++Dropped;
+			return;
+		}
+		if (!Free.empty())
+		{
+			job.pixels.swap(Free.back());
+			Free.pop_back();
+		}
+	}
+
+	job.pixels.resize((size_t)Width * Height * 3);
+	s.texture->getBuffer()->blitToMemory(Ogre::PixelBox(Width, Height, 1, Ogre::PF_BYTE_RGB, &job.pixels[0]));
+
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		Jobs.push_back(encode_job());
+		Jobs.back().frame = job.frame;
+		Jobs.back().pixels.swap(job.pixels);
+	}
+	Ready.notify_one();
+}
+
+// Worker thread: encodes until stop() has set Quit and the queue is empty
+void FrameRecorder::work()
+{
+	std::vector<unsigned char> png;
+	encode_job job;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(Lock);
+			while (Jobs.empty() && !Quit)
+				Ready.wait(lock);
+			if (Jobs.empty())
+				return;
+			job.frame = Jobs.front().frame;
+			job.pixels.swap(Jobs.front().pixels);
+			Jobs.pop_front();
+		}
+
+		char name[16];
+		sprintf(name, "%06u.png", job.frame);
+		bool ok = write_png(Prefix + name, &job.pixels[0], Width, Height, 3, (size_t)Width * 3, png);
+
+		std::lock_guard<std::mutex> lock(Lock);
+		if (!ok)
+			++Failed;
+		Free.push_back(std::vector<unsigned char>());
+		Free.back().swap(job.pixels);
+	}
+}
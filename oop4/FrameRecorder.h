@@ -0,0 +1,88 @@
+#ifndef __FrameRecorder_h_
+#define __FrameRecorder_h_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <OgreCamera.h>
+#include <OgreTexture.h>
+#include <OgreRenderTexture.h>
+
+//---------------------------------------------------------------------------
+// Records what the window shows, scene and overlays, as a PNG sequence
+// without going through the window: every capture() renders the camera
+// into one of RECORD_SLOTS render textures, so it also works on a hidden
+// window or a software GL on a headless box.
+//
+// Ogre 1.9 only reads textures back synchronously, so the readback is
+// deferred instead: a texture is read when the ring comes back to it,
+// RECORD_SLOTS - 1 frames later, by which time the GPU is long done with
+// it and blitToMemory copies without waiting. Encoding and writing run
+// on a pool of worker threads; when they fall behind, frames are dropped
+// and counted rather than stalling the frame loop.
+static const unsigned int RECORD_SLOTS = 3;
+
+class FrameRecorder
+{
+public:
+	FrameRecorder(void);
+	~FrameRecorder(void);
+
+	// Frame n goes to <prefix><n, six digits>.png; false if the render
+	// textures cannot be made
+	bool start(Ogre::Camera * camera, unsigned int width, unsigned int height, const std::string & prefix);
+	// Reads back the frames still in the ring and waits for the encoders
+	void stop();
+	bool isRecording() const { return Recording; }
+
+	void capture();
+
+	unsigned int frames() const { return Frame; }
+	unsigned int dropped() const { return Dropped; }
+	unsigned int failed() const { return Failed; }	// files not written, final after stop()
+
+private:
+	FrameRecorder(const FrameRecorder &);
+	FrameRecorder & operator=(const FrameRecorder &);
+
+	struct slot
+	{
+		Ogre::TexturePtr			texture;
+		Ogre::RenderTexture *		target;
+		unsigned int				frame;		// rendered and not read back yet, or NO_FRAME
+	};
+
+	struct encode_job
+	{
+		unsigned int				frame;
+		std::vector<unsigned char>	pixels;		// RGB rows, top first
+	};
+
+	void readBack(slot & s, bool drop);
+	void work();
+
+	bool						Recording;
+	std::string					Prefix;
+	unsigned int				Width;
+	unsigned int				Height;
+	slot						Slots[RECORD_SLOTS];
+	unsigned int				Next;			// slot of the next capture
+	unsigned int				Frame;
+	unsigned int				Dropped;
+
+	// Shared with the workers, under Lock
+	std::mutex					Lock;
+	std::condition_variable		Ready;
+	std::deque<encode_job>		Jobs;
+	std::vector<std::vector<unsigned char> >	Free;	// pixel buffers to reuse
+	unsigned int				Failed;
+	bool						Quit;
+	std::vector<std::thread>	Workers;
+};
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __FrameRecorder_h_
@@ -0,0 +1,543 @@
+// FuzzMachine.cpp
+// Fuzz target for the loaders and the instruction handlers, built without
+// Ogre. With libFuzzer:
+//   clang++ -DOOP5_FUZZ -fsanitize=fuzzer,address,undefined FuzzMachine.cpp
+//       Machine.cpp BatchMachine.cpp Predicate.cpp AsmLexer.cpp StringArena.cpp AddrRope.cpp CycleDetector.cpp
+//       StepGenerator.cpp Diagnostics.cpp DefUse.cpp SharedState.cpp StateExport.cpp
+//       ../../tinyxml/*.cpp
+// Adding -DOOP5_FUZZ_STANDALONE (and dropping -fsanitize=fuzzer) builds a
+// driver that feeds random inputs in a loop and reports steps per second.
+//
+// The first input byte picks the mode, modulo 6:
+//   0, 3  the rest is an XML document (both sample.xml and code.xml schemas)
+//   1, 4  the rest is .asm text
+//   2     the rest encodes a random program; it is written out as .asm, run
+//         through the loader and StepGenerator, and every step and its event
+//         are compared with RefMachine below; then BatchMachine runs it from several
+//         register sets and every lane is compared with its own RefMachine;
+//         for half of them with cycle detection on, where a reported cycle
+//         entry has to be the first state the reference comes back to;
+//         and as long as the run has only returned to call sites, every
+//         writer the handlers recorded has to be one DefUse allows at eip
+//   5     the same on Machine64, without BatchMachine, which is 32-bit only
+#ifdef OOP5_FUZZ
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Machine.h"
+#include "BatchMachine.h"
+#include "StepGenerator.h"
+
+static const unsigned int FUZZ_STEPS = 4096;
+static const unsigned int FUZZ_FLOW_SLOTS = 8;		// steps per full check of the slot writers against DefUse
+static const unsigned int FUZZ_LANES = 11;		// not a multiple of the vector width on purpose
+
+//---------------------------------------------------------------------------
+template <class Word>
+class QuietMachine : public BasicMachine<Word>
+{
+protected:
+	virtual void log(const std::string & /*message*/) {}
+};
+
+//---------------------------------------------------------------------------
+// Reference model, written from the instruction semantics rather than from
+// Machine: registers in an array, operands already decoded
+enum ref_op { R_MOV, R_PUSH, R_POP, R_JMP, R_CALL, R_RETN, R_OPS };
+enum ref_reg { R_ESP, R_EBP, R_EAX, R_IMM };
+
+template <class Word>
+struct ref_inst
+{
+	int op;
+	int dst;			// register for mov and pop
+	int src;			// register, or R_IMM for imm
+	Word imm;
+	unsigned int addr;
+	unsigned int size;
+};
+
+template <class Word>
+struct RefMachine
+{
+	std::vector<ref_inst<Word> >	prog;
+	std::vector<Word>			stack;
+	Word						reg[3];
+	Word						eip;
+
+	RefMachine() : eip(0) { reg[0] = reg[1] = reg[2] = 0; }
+
+	// What a step_event is checked against
+	struct state
+	{
+		Word reg[3];
+		Word eip;
+		size_t depth;
+		state(const RefMachine & m) : eip(m.eip), depth(m.stack.size()) { for (int r = 0; r < 3; ++r) reg[r] = m.reg[r]; }
+	};
+
+	Word value(const ref_inst<Word> & in) const
+	{
+		return (in.src == R_IMM) ? in.imm : reg[in.src];
+	}
+
+	void push(Word v)
+	{
+		stack.push_back(v);
+		reg[R_ESP] -= sizeof(Word);
+	}
+
+	Word pop()
+	{
+		Word v = stack.back();
+		stack.pop_back();
+		reg[R_ESP] += sizeof(Word);
+		return v;
+	}
+
+	// false when the program ended or faulted
+	bool step()
+	{
+		size_t idx = 0;
+		while (idx < prog.size() && prog[idx].addr < eip)
+			++idx;
+		if (idx == prog.size())
+			return false;
+
+		const ref_inst<Word> & in = prog[idx];
+		if ((in.op == R_POP || in.op == R_RETN) && stack.empty())
+			return false;
+
+		Word next = in.addr + in.size;
+		switch (in.op)
+		{
+		case R_MOV:
+			reg[in.dst] = value(in);
+			if (in.dst == R_ESP)
+			{
+				// Slots below the new esp are gone; the bottom one only goes with esp == 0
+				Word sp = reg[R_ESP];
+				if (sp == 0)
+					stack.clear();
+				while (stack.size() > 1 && sp >= (Word)0 - (Word)(sizeof(Word) * (stack.size() - 1)))
+					stack.pop_back();
+			}
+			eip = next;
+			break;
+		case R_PUSH:
+			push(value(in));
+			eip = next;
+			break;
+		case R_POP:
+			{
+				Word v = stack.back();
+				reg[in.dst] = v;
+				stack.pop_back();
+				reg[R_ESP] += sizeof(Word);
+				eip = next;
+			}
+			break;
+		case R_JMP:
+			eip = value(in);
+			break;
+		case R_CALL:
+			// The return address is taken from eip, which may point before the call
+			push(eip + in.size);
+			eip = value(in);
+			break;
+		case R_RETN:
+			eip = reg[R_EBP] = pop();
+			break;
+		}
+		return true;
+	}
+};
+
+//---------------------------------------------------------------------------
+static const char * reg_names[] = { "esp", "ebp", "eax" };
+static const char * reg_names64[] = { "rsp", "rbp", "rax" };
+static const char * op_names[] = { "mov", "push", "pop", "jmp", "call", "retn" };
+
+// Numbers are written in every notation the loaders accept
+static std::string format_number(unsigned long long v, unsigned char style)
+{
+	char buf[32];
+	switch (style % 3)
+	{
+	case 0: sprintf(buf, "%llu", v); break;
+	case 1: sprintf(buf, "0x%llX", v); break;
+	default: sprintf(buf, "0%llXh", v); break;
+	}
+	return buf;
+}
+
+// The 64-bit machine reads both register spellings, so both are written
+template <class Word>
+static void decode_program(const unsigned char * data, size_t size, RefMachine<Word> & ref, std::string & text)
+{
+	size_t count = size / 4;
+	unsigned int addr = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const unsigned char * b = data + i * 4;
+		ref_inst<Word> in;
+		in.op = b[0] % R_OPS;
+		in.dst = b[1] % 3;
+		in.src = (b[1] >> 2) % 4;
+		in.imm = (b[3] & 0x80) ? (Word)b[2] * ((Word)~0 / 0xFF) : b[2];
+		if ((in.op == R_JMP || in.op == R_CALL) && in.src == R_IMM)
+			in.imm = b[2] % (count + 1);	// instruction index for now, address below
+
+		in.size = (in.op == R_RETN) ? 1
+			: (in.op == R_PUSH || in.op == R_POP) ? ((in.op == R_POP || in.src != R_IMM) ? 2 : 1)
+			: (in.src != R_IMM) ? 2 : 5;
+		in.addr = addr;
+		addr += in.size;
+		ref.prog.push_back(in);
+	}
+
+	for (size_t i = 0; i < ref.prog.size(); ++i)
+	{
+		ref_inst<Word> & in = ref.prog[i];
+		const unsigned char * b = data + i * 4;
+		const char ** names = (sizeof(Word) > 4 && (b[1] & 0x80)) ? reg_names64 : reg_names;
+		char label[32];
+		sprintf(label, "L%u:\t", (unsigned int)i);
+		text += label;
+		text += op_names[in.op];
+
+		std::string src;
+		if (in.src != R_IMM)
+			src = names[in.src];
+		else if (in.op == R_JMP || in.op == R_CALL)
+		{
+			// Branch targets go through the symbol table
+			unsigned int target = (unsigned int)in.imm;
+			in.imm = (target < ref.prog.size()) ? ref.prog[target].addr : addr;
+			sprintf(label, "L%u", target);
+			src = (target < ref.prog.size()) ? label : "Lend";
+		}
+		else
+			src = format_number(in.imm, b[3]);
+
+		if (in.op == R_MOV)
+			text += std::string(" ") + names[in.dst] + ", " + src;
+		else if (in.op == R_POP)
+			text += std::string(" ") + names[in.dst];
+		else if (in.op != R_RETN)
+			text += " " + src;
+		text += (b[3] & 1) ? " ; comment\n" : "\n";
+	}
+	text += "Lend:\n";
+}
+
+static void mismatch(const std::string & text, unsigned int step, const char * what)
+{
+	fprintf(stderr, "reference mismatch at step %u (%s) in program:\n%s\n", step, what, text.c_str());
+	abort();
+}
+
+// The event has to describe the step from before to ref: registers that
+// changed are flagged as written, a push or call is the one store
+template <class Word>
+static void check_event(const basic_step_event<Word> & ev, const typename RefMachine<Word>::state & before,
+	const RefMachine<Word> & ref, unsigned int step, const std::string & text)
+{
+	if (ev.addr != before.eip || ev.reg[REG_EIP] != ref.eip)
+		mismatch(text, step, "event eip");
+	for (int r = 0; r < 3; ++r)
+	{
+		if (ev.reg[r] != ref.reg[r])
+			mismatch(text, step, "event registers");
+		if (ev.reg[r] != before.reg[r] && !(ev.written & (1 << r)))
+			mismatch(text, step, "event written registers");
+	}
+
+	bool store = (ev.op == OP_PUSH || ev.op == OP_CALL);
+	if (ev.stores != (store ? 1 : 0) || ref.prog[ev.idx].op != ev.op)
+		mismatch(text, step, "event opcode");
+	if (store && (ref.stack.size() != before.depth + 1 || ev.store_value != ref.stack.back()
+		|| ev.store_addr != (Word)0 - (Word)(ref.stack.size() * sizeof(Word))))
+		mismatch(text, step, "event store");
+}
+
+// Ground truth for cycle reports: the first step whose state comes back
+// within limit steps, -1 if none does
+template <class Word>
+static int first_repeat(RefMachine<Word> ref, unsigned int limit)
+{
+	std::unordered_map<size_t, unsigned int> seen;
+	std::hash<std::string> hasher;
+	for (unsigned int n = 0; ; ++n)
+	{
+		std::string key((const char *)ref.reg, sizeof(ref.reg));
+		key.append((const char *)&ref.eip, sizeof(ref.eip));
+		if (!ref.stack.empty())
+			key.append((const char *)&ref.stack[0], ref.stack.size() * sizeof(Word));
+		std::pair<std::unordered_map<size_t, unsigned int>::iterator, bool> it = seen.insert(std::make_pair(hasher(key), n));
+		if (!it.second)
+			return it.first->second;
+		if (n == limit || !ref.step())
+			return -1;
+	}
+}
+
+// Lane l starts from registers taken from the input, lane 0 from zeros,
+// so jmp/call through a register and mov esp split lanes off
+static unsigned int run_batch(const Machine & vm, const RefMachine<unsigned int> & prog, const std::string & text,
+	const unsigned char * data, size_t size)
+{
+	BatchMachine batch(vm.Instructions, FUZZ_LANES);
+	batch.setCycleDetection(vm.cycleDetection());
+	std::vector<RefMachine<unsigned int> > refs(FUZZ_LANES, RefMachine<unsigned int>());
+	for (unsigned int l = 0; l < FUZZ_LANES; ++l)
+	{
+		RefMachine<unsigned int> & ref = refs[l];
+		ref.prog = prog.prog;
+		for (int r = 0; l > 0 && r < 3; ++r)
+		{
+			unsigned char b = (size > 0) ? data[(l * 3 + r) % size] : 0;
+			ref.reg[r] = (b & 1) ? (unsigned int)b * 0x01010101u : b % (prog.prog.size() + 1);
+		}
+		batch.setRegisters(l, ref.reg[R_ESP], ref.reg[R_EBP], ref.reg[R_EAX]);
+	}
+
+	// Two runs, to also cover lanes carrying over from one run to the next
+	batch.run(FUZZ_STEPS / 2);
+	batch.run(FUZZ_STEPS / 2);
+
+	unsigned int total = 0;
+	for (unsigned int l = 0; l < FUZZ_LANES; ++l)
+	{
+		RefMachine<unsigned int> & ref = refs[l];
+		const batch_lane & lane = batch.lane(l);
+		bool cycle = lane.reason && strcmp(lane.reason, "entered cycle") == 0;
+		if (cycle && (int)lane.cycle != first_repeat(ref, lane.steps))
+			mismatch(text, lane.steps, "batch cycle entry");
+
+		unsigned int limit = cycle ? lane.steps : FUZZ_STEPS;
+		unsigned int steps = 0;
+		while (steps < limit && ref.step())
+			++steps;
+
+		if (lane.steps != steps)
+			mismatch(text, steps, "batch steps");
+		if (!cycle && (lane.reason != 0) != (steps < FUZZ_STEPS))
+			mismatch(text, steps, "batch end of program");
+		if (lane.reg[R_ESP] != ref.reg[R_ESP] || lane.reg[R_EBP] != ref.reg[R_EBP]
+			|| lane.reg[R_EAX] != ref.reg[R_EAX] || lane.eip != ref.eip)
+			mismatch(text, steps, "batch registers");
+		if (lane.stack != ref.stack)
+			mismatch(text, steps, "batch stack");
+		total += steps;
+	}
+	return total;
+}
+
+// BatchMachine only has 32-bit lanes
+static unsigned int run_batch(const Machine64 & /*vm*/, const RefMachine<unsigned long long> & /*prog*/,
+	const std::string & /*text*/, const unsigned char * /*data*/, size_t /*size*/)
+{
+	return 0;
+}
+
+// The dynamic writer has to be in the static set, where the analysis
+// follows the value at all
+static bool allowed(const std::vector<int> & writers, int idx)
+{
+	if (writers.size() == 1 && writers[0] == DEFUSE_MANY)
+		return true;
+	return std::binary_search(writers.begin(), writers.end(), (idx < 0) ? DEFUSE_INITIAL : idx);
+}
+
+// DefUse states by instruction, so a run that keeps coming back to the
+// same instructions replays each block once rather than once per step
+template <class Word>
+struct flow_cache
+{
+	flow_cache() : revision(~0u) {}
+
+	unsigned int revision;
+	std::vector<typename BasicDefUse<Word>::flow_state> states;
+	std::vector<unsigned char> known;		// 1 reached, 2 not reached
+};
+
+// Labels are on every instruction, so jumps through registers stay within
+// what DefUse assumes; returns only do while they go to call sites
+template <class Word>
+static bool check_flow(QuietMachine<Word> & vm, const basic_step_event<Word> & ev, unsigned int step,
+	const std::string & text, flow_cache<Word> & cache)
+{
+	int at = vm.findInstruction(vm.eip);
+	if (at < 0)
+		return true;
+	if (ev.op == OP_RETN && (at == 0 || vm.Instructions[at - 1].op != OP_CALL))
+		return false;
+
+	if (cache.revision != vm.Revision || cache.known.size() != vm.Instructions.size())
+	{
+		cache.revision = vm.Revision;
+		cache.states.assign(vm.Instructions.size(), typename BasicDefUse<Word>::flow_state());
+		cache.known.assign(vm.Instructions.size(), 0);
+	}
+	if (!cache.known[at])
+		cache.known[at] = vm.Flow.stateAt(vm, at, cache.states[at]) ? 1 : 2;
+	if (cache.known[at] != 1)
+		mismatch(text, step, "def-use: eip not reached");
+
+	const typename BasicDefUse<Word>::flow_state & s = cache.states[at];
+	for (int r = 0; r < 3; ++r)
+		if (!allowed(s.reg[r], vm.RegWriters[r]))
+			mismatch(text, step, "def-use: register writer");
+	// The top slot every step, all of them every FUZZ_FLOW_SLOTS steps
+	size_t depth = (step % FUZZ_FLOW_SLOTS == 0) ? s.stack.size() : std::min(s.stack.size(), (size_t)1);
+	for (size_t d = 0; d < vm.Stack.size() && d < depth; ++d)
+		if (!allowed(s.stack[s.stack.size() - 1 - d], vm.SlotWrites[vm.Stack.size() - 1 - d].idx))
+			mismatch(text, step, "def-use: slot writer");
+	return true;
+}
+
+template <class Word>
+static unsigned int run_differential(const unsigned char * data, size_t size)
+{
+	RefMachine<Word> ref;
+	std::string text;
+	decode_program(data, size, ref, text);
+
+	QuietMachine<Word> vm;
+	if (!vm.loadAsmText(text.data(), text.data() + text.size()))
+		mismatch(text, 0, "loader rejected a valid program");
+	vm.setCycleDetection(size > 0 && (data[size - 1] & 1));
+	RefMachine<Word> start = ref;
+	std::string cycle;
+	if (vm.Instructions.size() != ref.prog.size())
+		mismatch(text, 0, "instruction count");
+	for (size_t i = 0; i < ref.prog.size(); ++i)
+		if (vm.Instructions[i].addr != ref.prog[i].addr)
+			mismatch(text, 0, "address");
+
+	BasicStepGenerator<Word> gen(vm);
+	basic_step_event<Word> ev;
+	unsigned int steps = 0;
+	bool modelled = true;
+	flow_cache<Word> flows;
+	for (; steps < FUZZ_STEPS; ++steps)
+	{
+		typename RefMachine<Word>::state before(ref);
+		bool a = gen.next(ev);
+		bool b = ref.step();
+		if (a != b)
+			mismatch(text, steps, "end of program");
+		if (!a)
+			break;
+		check_event(ev, before, ref, steps, text);
+
+		// The handlers' write journal has to agree with the event
+		for (int r = 0; r < 3; ++r)
+			if ((vm.regAge(r) == 0) != ((ev.written >> r) & 1))
+				mismatch(text, steps, "journal registers");
+		if (ev.stores && vm.slotAge(vm.Stack.size() - 1) != 0)
+			mismatch(text, steps, "journal store");
+		if (vm.SlotWrites.size() != vm.Stack.size() || vm.DirtyFrom > vm.Stack.size())
+			mismatch(text, steps, "slot writers");
+		if (ev.stores && (vm.SlotWrites.back().idx != (int)ev.idx || vm.SlotWrites.back().step != vm.Steps))
+			mismatch(text, steps, "slot writer of the store");
+		for (int r = 0; r < 3; ++r)
+			if (((ev.written >> r) & 1) && vm.RegWriters[r] != (int)ev.idx)
+				mismatch(text, steps, "register writer");
+		if (modelled)
+			modelled = check_flow(vm, ev, steps, text, flows);
+		if (cycle.empty() && vm.BreakReason.compare(0, 13, "entered cycle") == 0)
+			cycle = vm.BreakReason;
+
+		if (vm.esp != ref.reg[R_ESP] || vm.ebp != ref.reg[R_EBP] || vm.eax != ref.reg[R_EAX] || vm.eip != ref.eip)
+			mismatch(text, steps, "registers");
+		if (vm.Stack.size() != ref.stack.size() || (ref.stack.size() > 0 && vm.Stack.back() != ref.stack.back()))
+			mismatch(text, steps, "stack");
+	}
+
+	if (vm.Stack != ref.stack)
+		mismatch(text, steps, "final stack");
+	if (!cycle.empty() && cycle != "entered cycle at step " + std::to_string((long long)first_repeat(start, steps)))
+		mismatch(text, steps, "cycle entry");
+	return steps + run_batch(vm, ref, text, data, size);
+}
+
+// Loader fuzzing: anything goes as long as nothing crashes
+static unsigned int run_loader(const unsigned char * data, size_t size, bool xml)
+{
+	std::string text((const char *)data, size);
+	QuietMachine<unsigned int> vm;
+	bool ok = xml ? vm.loadXmlText(text.c_str()) : vm.loadAsmText(text.data(), text.data() + text.size());
+	if (!ok)
+		return 0;
+
+	return vm.runInstructions(FUZZ_STEPS);
+}
+
+static unsigned int run_input(const unsigned char * data, size_t size)
+{
+	if (size == 0)
+		return 0;
+
+	switch (data[0] % 6)
+	{
+	case 0: case 3: return run_loader(data + 1, size - 1, true);
+	case 1: case 4: return run_loader(data + 1, size - 1, false);
+	case 2: return run_differential<unsigned int>(data + 1, size - 1);
+	default: return run_differential<unsigned long long>(data + 1, size - 1);
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const unsigned char * data, size_t size)
+{
+	run_input(data, size);
+	return 0;
+}
+
+//---------------------------------------------------------------------------
+#ifdef OOP5_FUZZ_STANDALONE
+
+#include <ctime>
+
+int main(int argc, char * argv[])
+{
+	unsigned long long iterations = (argc > 1) ? strtoull(argv[1], 0, 10) : 100000;
+	unsigned int seed = (argc > 2) ? (unsigned int)strtoul(argv[2], 0, 10) : (unsigned int)time(0);
+
+	// xorshift32, good enough to make programs
+	unsigned int x = seed ? seed : 1;
+	std::vector<unsigned char> input;
+	unsigned long long steps = 0;
+	clock_t start = clock();
+
+	for (unsigned long long it = 0; it < iterations; ++it)
+	{
+		size_t size = 1 + 4 * (1 + (x % 64));
+		input.resize(size);
+		for (size_t i = 0; i < size; ++i)
+		{
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			input[i] = (unsigned char)x;
+		}
+		input[0] = (x & 0x100) ? 5 : 2;	// random programs only, raw text rarely gets past the lexer
+		steps += run_input(&input[0], size);
+	}
+
+	double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	printf("seed %u: %llu programs, %llu steps, %.0f steps/s\n", seed, iterations, steps,
+		seconds > 0 ? steps / seconds : 0.0);
+	return 0;
+}
+
+#endif // #ifdef OOP5_FUZZ_STANDALONE
+
+#endif // #ifdef OOP5_FUZZ
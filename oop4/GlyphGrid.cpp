@@ -0,0 +1,268 @@
+#include "GlyphGrid.h"
+
+#include <algorithm>
+
+#include <OgreFontManager.h>
+#include <OgreHardwareBufferManager.h>
+#include <OgreOverlayManager.h>
+#include <OgreRoot.h>
+
+const Ogre::String GlyphGrid::TYPE_NAME = "GlyphGrid";
+
+// Unchanged cells between two changed ones are rewritten as well when the
+// gap is at most this long, one larger write being cheaper than two
+static const size_t MERGE_GAP = 8;
+
+static bool is_glyph(char c)
+{
+	return c > ' ' && c < 127;
+}
+
+//---------------------------------------------------------------------------
+void GlyphGrid::registerFactory()
+{
+	static GlyphGridFactory factory;
+	Ogre::OverlayManager::getSingleton().addOverlayElementFactory(&factory);
+}
+
+Ogre::OverlayElement * GlyphGridFactory::createOverlayElement(const Ogre::String & instanceName)
+{
+	return OGRE_NEW GlyphGrid(instanceName);
+}
+
+const Ogre::String & GlyphGridFactory::getTypeName(void) const
+{
+	return GlyphGrid::TYPE_NAME;
+}
+
+//---------------------------------------------------------------------------
+GlyphGrid::GlyphGrid(const Ogre::String & name)
+	: Ogre::OverlayElement(name),
+	CharHeight(16),
+	CellAspect(0.5f),
+	Colour(0xFFFFFFFF),
+	Cols(0),
+	Rows(0),
+	OriginX(0),
+	OriginY(0),
+	CellWidth(0),
+	CellHeight(0),
+	GlyphScale(0)
+{
+	mMetricsMode = Ogre::GMM_PIXELS;
+}
+
+GlyphGrid::~GlyphGrid(void)
+{
+	OGRE_DELETE RenderOp.vertexData;
+}
+
+void GlyphGrid::initialise(void)
+{
+	if (mInitialised)
+		return;
+
+	RenderOp.vertexData = OGRE_NEW Ogre::VertexData();
+	Ogre::VertexDeclaration * decl = RenderOp.vertexData->vertexDeclaration;
+	decl->addElement(0, 0, Ogre::VET_FLOAT3, Ogre::VES_POSITION);
+	decl->addElement(0, 12, Ogre::VET_FLOAT2, Ogre::VES_TEXTURE_COORDINATES, 0);
+	decl->addElement(0, 20, Ogre::VET_COLOUR, Ogre::VES_DIFFUSE);
+	RenderOp.vertexData->vertexStart = 0;
+	RenderOp.vertexData->vertexCount = 0;
+	RenderOp.operationType = Ogre::RenderOperation::OT_TRIANGLE_LIST;
+	RenderOp.useIndexes = false;
+	mInitialised = true;
+}
+
+const Ogre::String & GlyphGrid::getTypeName(void) const
+{
+	return TYPE_NAME;
+}
+
+void GlyphGrid::getRenderOperation(Ogre::RenderOperation & op)
+{
+	op = RenderOp;
+}
+
+//---------------------------------------------------------------------------
+void GlyphGrid::setFontName(const Ogre::String & font)
+{
+	Font = Ogre::FontManager::getSingleton().getByName(font);
+	if (Font.isNull())
+		OGRE_EXCEPT(Ogre::Exception::ERR_ITEM_NOT_FOUND, "Could not find font " + font, "GlyphGrid::setFontName");
+	Font->load();
+
+	mpMaterial = Font->getMaterial();
+	mpMaterial->setDepthCheckEnabled(false);
+	mpMaterial->setLightingEnabled(false);
+
+	CellAspect = 0;
+	for (int c = '!'; c < 127; ++c)
+		CellAspect = std::max(CellAspect, Font->getGlyphAspectRatio(c));
+	mGeomPositionsOutOfDate = true;
+}
+
+void GlyphGrid::setCharHeight(Ogre::Real pixels)
+{
+	CharHeight = pixels;
+	mGeomPositionsOutOfDate = true;
+}
+
+void GlyphGrid::setTextColour(const Ogre::ColourValue & colour)
+{
+	Ogre::Root::getSingleton().convertColourValue(colour, &Colour);
+	mGeomPositionsOutOfDate = true;
+}
+
+//---------------------------------------------------------------------------
+// Resizes the grid to the element and writes every cell; only needed
+// when the element, the viewport or the font changes
+void GlyphGrid::updatePositionGeometry(void)
+{
+	Ogre::OverlayManager & om = Ogre::OverlayManager::getSingleton();
+	Ogre::Real vpWidth = (Ogre::Real)om.getViewportWidth();
+	Ogre::Real vpHeight = (Ogre::Real)om.getViewportHeight();
+
+	OriginX = _getDerivedLeft() * 2 - 1;
+	OriginY = -(_getDerivedTop() * 2 - 1);
+	CellHeight = CharHeight / vpHeight * 2;
+	GlyphScale = CharHeight / vpWidth * 2;
+	CellWidth = GlyphScale * CellAspect;
+
+	unsigned int cols = (unsigned int)(mWidth * vpWidth / (CharHeight * CellAspect));
+	unsigned int rows = (unsigned int)(mHeight * vpHeight / CharHeight);
+	if (cols != Cols || rows != Rows || Buffer.isNull())
+	{
+		Cols = cols;
+		Rows = rows;
+		size_t cells = std::max((size_t)1, (size_t)Cols * Rows);
+		Buffer = Ogre::HardwareBufferManager::getSingleton().createVertexBuffer(sizeof(glyph_vertex),
+			cells * 6, Ogre::HardwareBuffer::HBU_DYNAMIC_WRITE_ONLY);
+		RenderOp.vertexData->vertexBufferBinding->setBinding(0, Buffer);
+		RenderOp.vertexData->vertexCount = Cols * Rows * 6;
+	}
+
+	// Everything is written again at the new place, in the current colours
+	layoutText(Cells, CellColours);
+	if (!Cells.empty())
+		writeCells(0, Cells.size());
+}
+
+void GlyphGrid::updateTextureGeometry(void)
+{
+	if (!Cells.empty())
+		writeCells(0, Cells.size());
+}
+
+//---------------------------------------------------------------------------
+void GlyphGrid::layoutText(std::vector<char> & cells, std::vector<Ogre::uint32> & colours) const
+{
+	cells.assign((size_t)Cols * Rows, ' ');
+	colours.assign((size_t)Cols * Rows, Colour);
+	size_t row = 0;
+	size_t col = 0;
+	for (size_t i = 0; i < Text.size() && row < Rows; ++i)
+	{
+		if (Text[i] == '\n')
+		{
+			++row;
+			col = 0;
+		}
+		else if (col < Cols)
+		{
+			if (row < LineColours.size())
+				colours[row * Cols + col] = LineColours[row];
+			cells[row * Cols + col++] = Text[i];
+		}
+	}
+}
+
+void GlyphGrid::setText(const std::string & text)
+{
+	LineColours.clear();
+	Text = text;
+	update();
+}
+
+void GlyphGrid::setText(const std::string & text, const std::vector<Ogre::ColourValue> & colours)
+{
+	LineColours.resize(colours.size());
+	for (size_t i = 0; i < colours.size(); ++i)
+		Ogre::Root::getSingleton().convertColourValue(colours[i], &LineColours[i]);
+	Text = text;
+	update();
+}
+
+// Blank cells are not drawn, so only the colour of a glyph counts
+void GlyphGrid::update()
+{
+	if (Cells.empty())
+		return;
+	layoutText(Next, NextColours);
+
+	// Runs of changed cells, close ones merged, each written with one call
+	size_t first = 0;
+	size_t last = 0;
+	bool open = false;
+	for (size_t i = 0; i < Next.size(); ++i)
+	{
+		if (Next[i] == Cells[i] && (NextColours[i] == CellColours[i] || !is_glyph(Next[i])))
+			continue;
+		Cells[i] = Next[i];
+		CellColours[i] = NextColours[i];
+		if (open && i - last > MERGE_GAP)
+		{
+			writeCells(first, last + 1 - first);
+			open = false;
+		}
+		if (!open)
+			first = i;
+		last = i;
+		open = true;
+	}
+	if (open)
+		writeCells(first, last + 1 - first);
+}
+
+// Six vertices per cell, two triangles; blank cells collapse to a point
+void GlyphGrid::writeCells(size_t first, size_t count)
+{
+	Staging.resize(count * 6);
+	glyph_vertex * v = &Staging[0];
+	for (size_t i = first; i < first + count; ++i)
+	{
+		float left = OriginX + (i % Cols) * CellWidth;
+		float top = OriginY - (i / Cols) * CellHeight;
+		float right = left;
+		float bottom = top;
+		Ogre::Font::UVRect uv(0, 0, 0, 0);
+		if (is_glyph(Cells[i]))
+		{
+			uv = Font->getGlyphTexCoords(Cells[i]);
+			right = left + GlyphScale * Font->getGlyphAspectRatio(Cells[i]);
+			bottom = top - CellHeight;
+		}
+
+		float corners[6][4] =
+		{
+			{ left, top, uv.left, uv.top },
+			{ left, bottom, uv.left, uv.bottom },
+			{ right, top, uv.right, uv.top },
+			{ right, top, uv.right, uv.top },
+			{ left, bottom, uv.left, uv.bottom },
+			{ right, bottom, uv.right, uv.bottom }
+		};
+		for (int k = 0; k < 6; ++k, ++v)
+		{
+			v->x = corners[k][0];
+			v->y = corners[k][1];
+			v->z = -1;
+			v->u = corners[k][2];
+			v->v = corners[k][3];
+			v->colour = CellColours[i];
+		}
+	}
+
+	Buffer->writeData(first * 6 * sizeof(glyph_vertex), count * 6 * sizeof(glyph_vertex), &Staging[0],
+		count == Cells.size());
+}
@@ -0,0 +1,97 @@
+#ifndef __GlyphGrid_h_
+#define __GlyphGrid_h_
+
+#include <string>
+#include <vector>
+#include <OgreOverlayElement.h>
+#include <OgreOverlayElementFactory.h>
+#include <OgreFont.h>
+#include <OgreHardwareVertexBuffer.h>
+
+//---------------------------------------------------------------------------
+// Monospace text as a fixed grid of glyph quads in one persistent vertex
+// buffer. setText compares against what is on screen and rewrites only
+// the quads of cells that changed, so a panel update costs time in the
+// number of changed characters; TextAreaOverlayElement rebuilds the whole
+// text on every caption change. Glyphs keep their own width and start at
+// the left of their cell, so proportional fonts line up too.
+class GlyphGrid : public Ogre::OverlayElement
+{
+public:
+	static const Ogre::String TYPE_NAME;
+	// Makes "GlyphGrid" known to OverlayManager::createOverlayElement
+	static void registerFactory();
+
+	GlyphGrid(const Ogre::String & name);
+	virtual ~GlyphGrid(void);
+
+	virtual void initialise(void);
+	virtual const Ogre::String & getTypeName(void) const;
+	virtual void getRenderOperation(Ogre::RenderOperation & op);
+
+	void setFontName(const Ogre::String & font);
+	void setCharHeight(Ogre::Real pixels);
+	void setTextColour(const Ogre::ColourValue & colour);
+
+	// Before the first layout these come from the pixel size alone
+	unsigned int cols() const { return Cols ? Cols : (unsigned int)(mPixelWidth / (CharHeight * CellAspect)); }
+	unsigned int rows() const { return Rows ? Rows : (unsigned int)(mPixelHeight / CharHeight); }
+
+	// One line per row, cut at the right edge; rows past the text are
+	// cleared. Line i is drawn in colours[i], lines past them in the text
+	// colour; a cell whose colour changes is rewritten like one whose
+	// character does.
+	void setText(const std::string & text);
+	void setText(const std::string & text, const std::vector<Ogre::ColourValue> & colours);
+
+protected:
+	virtual void updatePositionGeometry(void);
+	virtual void updateTextureGeometry(void);
+
+private:
+	struct glyph_vertex
+	{
+		float x, y, z;
+		float u, v;
+		Ogre::uint32 colour;
+	};
+
+	void layoutText(std::vector<char> & cells, std::vector<Ogre::uint32> & colours) const;
+	void update();
+	void writeCells(size_t first, size_t count);
+
+	Ogre::RenderOperation				RenderOp;
+	Ogre::HardwareVertexBufferSharedPtr	Buffer;
+	Ogre::FontPtr						Font;
+	Ogre::Real							CharHeight;		// pixels
+	Ogre::Real							CellAspect;		// widest glyph, width over height
+	Ogre::uint32						Colour;			// in the render system's format
+
+	std::string							Text;			// laid out again when the grid is resized
+	std::vector<Ogre::uint32>			LineColours;
+	unsigned int						Cols;
+	unsigned int						Rows;
+	std::vector<char>					Cells;			// what the buffer shows, ' ' for blank
+	std::vector<Ogre::uint32>			CellColours;
+	std::vector<char>					Next;			// scratch for setText
+	std::vector<Ogre::uint32>			NextColours;
+	std::vector<glyph_vertex>			Staging;
+
+	// Clip space layout, set by updatePositionGeometry
+	float								OriginX;
+	float								OriginY;
+	float								CellWidth;
+	float								CellHeight;
+	float								GlyphScale;		// clip width of a glyph with aspect 1
+};
+
+class GlyphGridFactory : public Ogre::OverlayElementFactory
+{
+public:
+	Ogre::OverlayElement * createOverlayElement(const Ogre::String & instanceName);
+	const Ogre::String & getTypeName(void) const;
+};
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __GlyphGrid_h_
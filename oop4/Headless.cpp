@@ -0,0 +1,157 @@
+// Headless.cpp
+// Entry point of the headless build: the machine and the debug server
+// without Ogre. Build it from the sources that do not need Ogre, e.g.
+//   g++ -DOOP5_HEADLESS Headless.cpp Machine.cpp Predicate.cpp AsmLexer.cpp StringArena.cpp AddrRope.cpp
+//       CycleDetector.cpp StepGenerator.cpp DebugServer.cpp Diagnostics.cpp DivergenceFinder.cpp DefUse.cpp
+//       SharedState.cpp StateExport.cpp ../../tinyxml/*.cpp -pthread -o oop5-headless
+// Runs stop at the first repeated state, see "cycles" in DebugServer.h;
+// -64 runs the program on the 64-bit machine. OOP5_DIAGNOSTICS=<file|->
+// writes the machine's diagnostics there.
+// -diverge <original> first looks for the step at which the program
+// stops doing what original does, see DivergenceFinder.h, prints it and
+// serves the program stopped right before that step.
+// -export [name] publishes the machine state into shared memory, see
+// StateExport.h; StateWatch.cpp is a reader for it.
+#ifdef OOP5_HEADLESS
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include "Machine.h"
+#include "DebugServer.h"
+#include "DivergenceFinder.h"
+#include "StateExport.h"
+
+// Prints where program leaves original and moves machine to the step
+// before; false if the search itself failed
+template <class Word>
+static bool diverge(BasicMachine<Word> & machine, const char * original, const char * program)
+{
+	BasicDivergenceFinder<Word> finder;
+	std::string error;
+	if (!finder.open(original, program, error))
+	{
+		std::cerr << error;
+		return false;
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool found = finder.find(DIVERGE_MAX_STEPS, DIVERGE_INTERVAL);
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	if (!finder.error().empty())
+	{
+		std::cerr << "divergence: " << finder.error() << std::endl;
+		return false;
+	}
+
+	std::cout << "divergence: " << finder.checkpoints() << " checkpoints, " << finder.probes() << " probes, "
+		<< finder.executed() << " steps in " << ms << " ms" << std::endl;
+	if (!found)
+	{
+		std::cout << "divergence: none in " << finder.step() << " steps" << std::endl;
+		return true;
+	}
+	std::cout << "divergence: at step " << finder.step() << std::endl << finder.report() << std::flush;
+	if (!BasicDivergenceFinder<Word>::seek(machine, finder.step() - 1))
+		std::cerr << "divergence: " << machine.BreakReason << " before step " << finder.step() << std::endl;
+	return true;
+}
+
+// Word picks the 32-bit or the 64-bit machine
+template <class Word>
+static int serve(const char * program, const std::string & path, const char * original, const char * shared)
+{
+	BasicMachine<Word> machine;
+	machine.setProgramPath(program);
+	if (!machine.loadProgram(program))
+	{
+		std::cerr << "cannot load " << program << std::endl;
+		return 1;
+	}
+	if (original && !diverge(machine, original, program))
+		return 1;
+	machine.setCycleDetection(true);
+
+	Diagnostics diags;
+	const char * diagPath = getenv("OOP5_DIAGNOSTICS");
+	if (diagPath)
+	{
+		if (diags.start(diagPath))
+			machine.Diag = &diags;
+		else
+			std::cerr << "cannot write diagnostics to " << diagPath << std::endl;
+	}
+
+	BasicStateExport<Word> state;
+	if (shared)
+	{
+		std::string error;
+		if (!state.start(shared, SHARED_STATE_WINDOW, error))
+		{
+			std::cerr << error << std::endl;
+			return 1;
+		}
+		machine.Export = &state;
+		state.publish(machine);
+	}
+
+	BasicDebugServer<Word> server(machine);
+	if (!server.start(path))
+	{
+		std::cerr << "cannot listen on " << path << std::endl;
+		return 1;
+	}
+
+	// Runs publish as they go; resets, edits and loads only change the
+	// machine between them
+	while (!server.isShutdown())
+		if (server.poll(1000))
+			state.publish(machine);
+
+	return 0;
+}
+
+int main(int argc, char * argv[])
+{
+	const char * self = argv[0];
+	bool wide = false;
+	const char * original = 0;
+	const char * shared = 0;
+	while (argc > 1 && argv[1][0] == '-')
+	{
+		std::string flag = argv[1];
+		if (flag == "-64")
+			wide = true;
+		else if (flag == "-diverge" && argc > 2)
+		{
+			original = argv[2];
+			--argc;
+			++argv;
+		}
+		else if (flag == "-export")
+		{
+			shared = SHARED_STATE_NAME;
+			if (argc > 2 && argv[2][0] == '/')
+			{
+				shared = argv[2];
+				--argc;
+				++argv;
+			}
+		}
+		else
+			break;
+		--argc;
+		++argv;
+	}
+	if (argc < 2)
+	{
+		std::cerr << "usage: " << self << " [-64] [-diverge <original>] [-export [/name]] <program.xml|program.asm> [socket]" << std::endl;
+		return 1;
+	}
+
+	std::string path = (argc > 2) ? argv[2] : "/tmp/oop5.sock";
+	return wide ? serve<unsigned long long>(argv[1], path, original, shared)
+		: serve<unsigned int>(argv[1], path, original, shared);
+}
+
+#endif // #ifdef OOP5_HEADLESS
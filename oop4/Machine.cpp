@@ -0,0 +1,1964 @@
+#include "Machine.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+// Handlers report through Diag on their error paths; OOP5_NO_DIAGNOSTICS
+// compiles the reports out
+#ifdef OOP5_NO_DIAGNOSTICS
+#define DIAGNOSE(severity, id, idx, detail) ((void)0)
+#else
+#define DIAGNOSE(severity, id, idx, detail) do { if (Diag) diagnose(severity, id, idx, detail); } while (0)
+#endif
+
+//---------------------------------------------------------------------------
+template <class Word>
+BasicMachine<Word>::BasicMachine(void)
+	: DirtyFrom(0),
+	ProgramPath("C:\\Users\\japro_000\\Desktop\\Universe\\power of 5\\OOP\\lab5\\project\\oop4\\sample.xml"),
+	LoadThreads(0),
+	esp(0),
+	ebp(0),
+	eax(0),
+	eip(0),
+	Steps(0),
+	ExecIdx(-1),
+	Revision(0),
+	StopDepth(-1),
+	StopThread(0),
+	ThreadId(0),
+	NextThread(0),
+	Quantum(100),
+	Diag(0),
+	Export(0),
+	Running(false),
+	InRun(false),
+	BreakHit(false),
+	Slice(0),
+	SpawnedThreads(1),
+	DetectCycles(false),
+	CycleArmed(false),
+	CycleFound(false),
+	StackHash(0),
+	AddrValid(0),
+	Epoch(0)
+{
+	clearJournal();
+	for (int r = 0; r < 3; ++r)
+		RegWriters[r] = -1;
+}
+
+//---------------------------------------------------------------------------
+template <class Word>
+BasicMachine<Word>::~BasicMachine(void)
+{
+}
+
+//---------------------------------------------------------------------------
+template <class Word>
+void BasicMachine<Word>::log(const std::string & message)
+{
+	std::cerr << message << std::endl;
+}
+
+// Back to the state right after loading; program and breakpoints are kept
+template <class Word>
+void BasicMachine<Word>::reset()
+{
+	Stack.clear();
+	SlotWrites.clear();
+	DirtyFrom = 0;
+	CallStack.clear();
+	esp = ebp = eax = eip = 0;
+	Threads.clear();
+	ThreadId = 0;
+	NextThread = 0;
+	Slice = 0;
+	SpawnedThreads = 1;
+	Steps = 0;
+	ExecIdx = -1;
+	for (int r = 0; r < 3; ++r)
+		RegWriters[r] = -1;
+	clearJournal();
+	StopDepth = -1;
+	Running = false;
+	BreakHit = false;
+	BreakReason = "";
+	disarmCycles();
+}
+
+//---------------------------------------------------------------------------
+template <class Word>
+void BasicMachine<Word>::setProgramPath(const std::string & path)
+{
+	ProgramPath = path;
+}
+
+// Returns false if the file cannot be read or has errors, which are logged
+template <class Word>
+bool BasicMachine<Word>::loadProgram(const std::string & path)
+{
+	std::string ext = (path.size() > 4) ? path.substr(path.size() - 4) : "";
+	for (size_t i = 0; i < ext.size(); ++i)
+		ext[i] = (char)tolower((unsigned char)ext[i]);
+
+	bool ok;
+	if (ext == ".asm")
+	{
+		MappedFile file;
+		ok = file.open(path) && loadAsmText(file.data(), file.data() + file.size());
+	}
+	else
+	{
+		TiXmlDocument doc(path.c_str());
+		ok = doc.LoadFile() && loadXmlDocument(doc);
+	}
+
+	updateBreakAt();
+	if (ok)
+		Flow.analyze(*this);
+	return ok;
+}
+
+template <class Word>
+bool BasicMachine<Word>::loadXmlText(const char * text)
+{
+	TiXmlDocument doc;
+	doc.Parse(text);
+	bool ok = !doc.Error() && loadXmlDocument(doc);
+
+	updateBreakAt();
+	return ok;
+}
+
+// Two schemas are accepted: top-level <instruction command arg1 arg2 />
+// as in sample.xml, and <level><instruction command par1 par2 /></level>
+// as in code.xml, where "ntn" means no operand and numbers are hex
+template <class Word>
+bool BasicMachine<Word>::loadXmlDocument(TiXmlDocument & doc)
+{
+	bool level = false;
+	TiXmlElement* itemElement = doc.FirstChildElement("instruction");
+	if (!itemElement && doc.FirstChildElement("level"))
+	{
+		itemElement = doc.FirstChildElement("level")->FirstChildElement("instruction");
+		level = true;
+	}
+
+	std::vector<TiXmlElement*> breakElements;
+	for( ; itemElement; itemElement = itemElement->NextSiblingElement() )
+	{
+		std::string element = itemElement->Value();
+		if (element == "breakpoint")
+		{
+			// Resolved below, once every address is known
+			breakElements.push_back(itemElement);
+			continue;
+		}
+		else if (element == "watchpoint")
+		{
+			loadWatchpoint(itemElement);
+			continue;
+		}
+		else if (element == "label")
+		{
+			const char * name = itemElement->Attribute("name");
+			if (!addLabel(name ? name : "", Instructions.size()))
+				return false;
+			continue;
+		}
+
+		const char * attr = itemElement->Attribute("command");
+		std::string command = attr ? attr : "";
+		std::string arg1 = (command != "retn") ? xml_operand(itemElement, level ? "par1" : "arg1", level) : "";
+		std::string arg2 = (command != "retn" && command == "mov") ? xml_operand(itemElement, level ? "par2" : "arg2", level) : "";
+		addInstruction(command, arg1, arg2);
+	}	
+
+	if (!resolveSymbols())
+		return false;
+
+	for (size_t i = 0; i < breakElements.size(); ++i)
+		loadBreakpoint(breakElements[i]);
+	return true;
+}
+
+template <class Word>
+std::string BasicMachine<Word>::xml_operand(TiXmlElement * element, const char * name, bool level)
+{
+	const char * attr = element->Attribute(name);
+	std::string value = attr ? attr : "";
+	if (!level)
+		return value;
+
+	if (value == "ntn")
+		return "";
+	if (value.size() > 0 && value[0] >= '0' && value[0] <= '9')
+		return value + "h";
+	return asm_operand(value);
+}
+
+//---------------------------------------------------------------------------
+// One line-aligned piece of an .asm file, parsed on its own thread into
+// its own arrays; loadAsmText stitches the pieces together
+template <class Word>
+struct basic_asm_chunk
+{
+	const char *				begin;
+	const char *				end;
+	std::vector<basic_instruction<Word> >	code;
+	std::vector<unsigned int>	texts;		// local indices of code with arena text
+	std::vector<std::pair<std::string, unsigned int> >	labels;	// name, local index
+	StringArena					names;
+	unsigned int				bytes;		// sum of the sizes in code
+	unsigned int				lines;
+	std::string					error;
+	unsigned int				error_line;
+};
+
+// Files are split so that every chunk has at least this much text
+static const size_t ASM_CHUNK_BYTES = 1 << 20;
+
+// Runs job(0) .. job(count - 1), all but the first on threads of their own
+template <class Job>
+static void run_chunks(size_t count, Job job)
+{
+	std::vector<std::thread> workers;
+	for (size_t i = 1; i < count; ++i)
+		workers.push_back(std::thread(job, i));
+	job(0);
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+
+template <class Word>
+bool BasicMachine<Word>::loadAsmText(const char * begin, const char * end)
+{
+	size_t threads = LoadThreads ? LoadThreads : std::thread::hardware_concurrency();
+	size_t count = std::max((size_t)1, std::min(threads, (size_t)(end - begin) / ASM_CHUNK_BYTES));
+
+	std::vector<asm_chunk> chunks(count);
+	const char * p = begin;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const char * q = (i + 1 == count) ? end : begin + (end - begin) / count * (i + 1);
+		if (q < p)
+			q = p;
+		while (q < end && q > begin && q[-1] != '\n')
+			++q;
+		chunks[i].begin = p;
+		chunks[i].end = q;
+		p = q;
+	}
+
+	run_chunks(count, [&](size_t i) { parseAsmChunk(chunks[i]); });
+
+	// Exclusive prefix sums over the chunks give each one its first index
+	// and address; the chunks then place their instructions in parallel
+	std::vector<size_t> first(count);
+	std::vector<unsigned int> base(count);
+	size_t total = Instructions.size();
+	unsigned int addr = Instructions.empty() ? 0 : Instructions.back().addr + Instructions.back().size;
+	unsigned int line = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (chunks[i].error.size() > 0)
+			return asm_error(line + chunks[i].error_line, chunks[i].error);
+		line += chunks[i].lines;
+
+		first[i] = total;
+		base[i] = addr;
+		total += chunks[i].code.size();
+		addr += chunks[i].bytes;
+	}
+
+	Instructions.resize(total);
+	run_chunks(count, [&](size_t i)
+	{
+		const asm_chunk & c = chunks[i];
+		unsigned int a = base[i];
+		for (size_t k = 0; k < c.code.size(); ++k)
+		{
+			instruction & inst = Instructions[first[i] + k];
+			inst = c.code[k];
+			inst.addr = a;
+			a += inst.size;
+		}
+	});
+
+	// Text and labels go through the shared arena and symbol table, in file order
+	for (size_t i = 0; i < count; ++i)
+	{
+		const asm_chunk & c = chunks[i];
+		for (size_t k = 0; k < c.texts.size(); ++k)
+		{
+			instruction & inst = Instructions[first[i] + c.texts[k]];
+			for (int t = 0; t < 2; ++t)
+				if (inst.text[t])
+					inst.text[t] = Names.intern(c.names.str(inst.text[t]));
+		}
+		for (size_t k = 0; k < c.labels.size(); ++k)
+			if (!addLabel(c.labels[k].first, first[i] + c.labels[k].second))
+				return false;
+	}
+
+	// Edits keep BreakAt one entry per instruction from here on
+	updateBreakAt();
+	return resolveSymbols();
+}
+
+template <class Word>
+static void chunk_error(basic_asm_chunk<Word> & c, const asm_token & tok, const std::string & message)
+{
+	c.error = message + " near '" + std::string(tok.text, tok.len) + "'";
+	c.error_line = tok.line;
+}
+
+template <class Word>
+void BasicMachine<Word>::parseAsmChunk(asm_chunk & c)
+{
+	c.bytes = 0;
+	c.lines = 0;
+	c.error_line = 0;
+	c.code.reserve((c.end - c.begin) / 12);
+
+	AsmLexer lexer(c.begin, c.end);
+	asm_token tok;
+	lexer.next(tok);
+
+	while (tok.type != T_END)
+	{
+		if (tok.type == T_NEWLINE)
+		{
+			lexer.next(tok);
+			continue;
+		}
+		if (tok.type != T_IDENT)
+			return chunk_error(c, tok, "expected mnemonic or label");
+
+		std::string word(tok.text, tok.len);
+		lexer.next(tok);
+
+		// "name:" defines a label, an instruction may follow on the same line
+		if (tok.type == T_COLON)
+		{
+			c.labels.push_back(std::make_pair(word, (unsigned int)c.code.size()));
+			lexer.next(tok);
+			continue;
+		}
+
+		std::string command = asm_operand(word);
+		std::string args[2];
+		int count = 0;
+		while (tok.type != T_NEWLINE && tok.type != T_END)
+		{
+			if (count == 2 || (tok.type != T_IDENT && tok.type != T_NUMBER))
+				return chunk_error(c, tok, "bad operand");
+			args[count++] = asm_operand(std::string(tok.text, tok.len));
+
+			lexer.next(tok);
+			if (tok.type == T_COMMA)
+				lexer.next(tok);
+			else if (tok.type != T_NEWLINE && tok.type != T_END)
+				return chunk_error(c, tok, "expected ','");
+		}
+
+		// Same operand layout as the XML loader: only mov keeps arg2
+		instruction s;
+		decodeInstruction(command, args[0], (command == "mov") ? args[1] : "", c.names, s);
+		if (s.text[0] || s.text[1])
+			c.texts.push_back(c.code.size());
+		c.bytes += s.size;
+		c.code.push_back(s);
+	}
+
+	c.lines = tok.line - 1;
+}
+
+template <class Word>
+static unsigned char decode_register(const std::string & value)
+{
+	for (unsigned char r = REG_ESP; r < REG_EIP; ++r)
+		if (value == word_traits<Word>::reg_name(r) || value == word_traits<unsigned int>::reg_name(r))
+			return r;
+	return OPND_NONE;
+}
+
+// Registers and mnemonics are case-insensitive in .asm files, "0x7B" is
+// rewritten to the "7Bh" form understood by parse_value
+template <class Word>
+std::string BasicMachine<Word>::asm_operand(const std::string & token)
+{
+	if (token.size() > 2 && token[0] == '0' && (token[1] == 'x' || token[1] == 'X'))
+		return "0" + token.substr(2) + "h";
+
+	std::string lower = token;
+	for (size_t i = 0; i < lower.size(); ++i)
+		lower[i] = (char)tolower((unsigned char)lower[i]);
+
+	if (decode_register<Word>(lower) != OPND_NONE || lower == "mov" || lower == "push"
+		|| lower == "pop" || lower == "jmp" || lower == "call" || lower == "retn" || lower == "ret"
+		|| lower == "spawn")
+		return (lower == "ret") ? "retn" : lower;
+
+	return token;
+}
+
+template <class Word>
+bool BasicMachine<Word>::asm_error(unsigned int line, const std::string & message)
+{
+	log("oop5: " + ProgramPath + "(" + std::to_string((unsigned long long)line) + "): " + message);
+	return false;
+}
+
+// Labels name the instruction at idx, which need not be loaded yet;
+// addresses are assigned in resolveSymbols
+template <class Word>
+bool BasicMachine<Word>::addLabel(const std::string & name, unsigned int idx)
+{
+	if (!is_symbol(name) || Symbols.count(name))
+	{
+		log("oop5: bad or duplicate label " + name);
+		return false;
+	}
+	Symbols[name] = idx;
+
+	if (!Labels.empty() && Labels.back().idx == idx)
+		Labels.back().name = Names.add(std::string(Names.str(Labels.back().name)) + ", " + name);
+	else
+	{
+		label_entry l;
+		l.idx = idx;
+		l.name = Names.add(name);	// labels are unique
+		Labels.push_back(l);
+	}
+	return true;
+}
+
+static const char * opcode_names[] = { "mov", "push", "pop", "jmp", "call", "retn", "spawn" };
+
+static unsigned char decode_opcode(const std::string & command)
+{
+	for (int op = OP_MOV; op < OP_NONE; ++op)
+		if (command == opcode_names[op])
+			return op;
+	return OP_NONE;
+}
+
+static bool is_decimal(const std::string & value)
+{
+	if (value.empty())
+		return false;
+	for (size_t i = 0; i < value.size(); ++i)
+		if (value[i] < '0' || value[i] > '9')
+			return false;
+	return true;
+}
+
+template <class Word>
+void BasicMachine<Word>::addInstruction(const std::string & command, const std::string & arg1, const std::string & arg2)
+{
+	instruction s;
+	decodeInstruction(command, arg1, arg2, Names, s);
+	s.addr = Instructions.empty() ? 0 : Instructions.back().addr + Instructions.back().size;
+	Instructions.push_back(s);
+}
+
+// Decodes the operands once, the handlers only ever see registers and
+// numbers; everything but addr is filled in
+template <class Word>
+void BasicMachine<Word>::decodeInstruction(const std::string & command, const std::string & arg1, const std::string & arg2,
+	StringArena & names, instruction & s)
+{
+	s.op = decode_opcode(command);
+	s.dst = OPND_NONE;
+	s.src = OPND_NONE;
+	s.flags = 0;
+	s.epoch = 0;
+	s.imm = 0;
+	s.text[0] = s.text[1] = 0;
+
+	if (s.op == OP_MOV || s.op == OP_POP)
+	{
+		// An unknown destination is ignored when executed, but still shown
+		s.dst = decode_register<Word>(arg1);
+		if (s.dst == OPND_NONE)
+			s.text[0] = names.intern(arg1);
+	}
+	if (s.op == OP_NONE)
+		s.text[1] = names.intern(command);
+
+	if (s.op != OP_POP && s.op != OP_RETN)
+	{
+		int k = (s.op == OP_MOV) ? 1 : 0;
+		const std::string & source = k ? arg2 : arg1;
+		s.src = decode_register<Word>(source);
+		if (s.src == OPND_NONE)
+		{
+			// Anything else is read as a number; labels are patched in resolveSymbols
+			bool is_hex = false;
+			std::string value = parse_value(source, is_hex);
+			s.src = OPND_IMM;
+			s.imm = to_word(value);
+			if (is_decimal(value))
+				s.flags |= is_hex ? INST_IMM | INST_HEX : INST_IMM;
+			else
+				s.text[k] = names.intern(source);
+		}
+	}
+
+	if (s.op == OP_MOV || s.op == OP_JMP || s.op == OP_CALL || s.op == OP_SPAWN)
+		s.size = (s.src < OPND_IMM) ? 2 : 5;
+	else if (s.op == OP_RETN)
+		s.size = 1;
+	else
+		s.size = (decode_register<Word>(arg1) != OPND_NONE) ? 2 : 1;
+}
+
+template <class Word>
+std::string BasicMachine<Word>::parse_value(std::string value, bool & is_hex)
+{
+	is_hex = false;
+	if (value.size() > 0 && (value[value.size() - 1] == 'h' || value[value.size() - 1] == 'H') && (value[0] >= '0' && value[0] <= '9'))
+	{
+		Word x = 0;
+		std::stringstream ss;
+		value.pop_back();
+		ss << std::hex << value.c_str();
+		ss >> x;
+
+		is_hex = true;
+		return std::to_string(x);
+	}
+	else
+		return value;
+}
+
+template <class Word>
+bool BasicMachine<Word>::is_symbol(const std::string & value)
+{
+	if (value.empty() || value == "None" || decode_register<Word>(value) != OPND_NONE)
+		return false;
+	return isalpha((unsigned char)value[0]) || value[0] == '_' || value[0] == '.';
+}
+
+// Patches symbolic operands with the address of their label once, so the
+// step loop only ever sees numbers; edits keep them patched from then on
+template <class Word>
+bool BasicMachine<Word>::resolveSymbols()
+{
+	disarmCycles();
+	AddrValid = Instructions.size();
+	Rope.clear();
+	Epoch = 0;
+	++Revision;
+
+	for (size_t i = 0; i < Instructions.size(); ++i)
+	{
+		instruction & inst = Instructions[i];
+		unsigned int target;
+		if (!symbolTarget(inst, target))
+			return false;
+		if (inst.flags & INST_SYMBOL)
+			inst.imm = addressOf(target);
+	}
+	return true;
+}
+
+// Sets INST_SYMBOL and idx when the source names a label; false only for
+// an undefined one
+template <class Word>
+bool BasicMachine<Word>::symbolTarget(instruction & inst, unsigned int & idx)
+{
+	const char * name = Names.str(inst.text[(inst.op == OP_MOV) ? 1 : 0]);
+	if (inst.src != OPND_IMM || !is_symbol(name))
+		return true;
+
+	std::unordered_map<std::string, unsigned int>::const_iterator it = Symbols.find(name);
+	if (it == Symbols.end())
+	{
+		log("oop5: undefined label " + std::string(name) + " in " + mnemonic(inst));
+		return false;
+	}
+	inst.flags |= INST_SYMBOL;
+	idx = it->second;
+	return true;
+}
+
+//---------------------------------------------------------------------------
+// Live editing
+
+// One line through the .asm parser, its text moved into Names
+template <class Word>
+bool BasicMachine<Word>::parseInstruction(const std::string & text, instruction & s, std::string & error)
+{
+	asm_chunk c;
+	c.begin = text.c_str();
+	c.end = c.begin + text.size();
+	parseAsmChunk(c);
+	if (c.error.size() > 0)
+	{
+		error = c.error;
+		return false;
+	}
+	if (c.code.size() != 1 || c.labels.size() > 0)
+	{
+		error = "expected one instruction without a label";
+		return false;
+	}
+
+	s = c.code[0];
+	for (int t = 0; t < 2; ++t)
+		if (s.text[t])
+			s.text[t] = Names.intern(c.names.str(s.text[t]));
+
+	unsigned int target;
+	if (!symbolTarget(s, target))
+	{
+		error = "undefined label";
+		return false;
+	}
+	return true;
+}
+
+template <class Word>
+unsigned int BasicMachine<Word>::addressOf(size_t idx) const
+{
+	if (idx < AddrValid)
+		return Instructions[idx].addr;
+	if (AddrValid == Instructions.size())
+		return Instructions.empty() ? 0 : Instructions.back().addr + Instructions.back().size;
+	return Rope.prefix(idx);
+}
+
+// Brings instruction::addr and every label operand up to date again, for
+// callers that walk the whole program anyway
+template <class Word>
+void BasicMachine<Word>::refreshAddresses()
+{
+	for (size_t i = AddrValid; i < Instructions.size(); ++i)
+		Instructions[i].addr = (i > 0) ? Instructions[i - 1].addr + Instructions[i - 1].size : 0;
+	AddrValid = Instructions.size();
+
+	if (Epoch != 0)
+		for (size_t i = 0; i < Instructions.size(); ++i)
+			if (Instructions[i].epoch != Epoch)
+				relocate(Instructions[i]);
+}
+
+// Label operands are placed lazily: edits that move code start a new
+// Epoch and an operand looks its label up again the next time it runs
+template <class Word>
+void BasicMachine<Word>::relocate(instruction & inst)
+{
+	inst.epoch = Epoch;
+	if (!(inst.flags & INST_SYMBOL))
+		return;
+	std::unordered_map<std::string, unsigned int>::const_iterator it
+		= Symbols.find(Names.str(inst.text[(inst.op == OP_MOV) ? 1 : 0]));
+	if (it != Symbols.end())
+		inst.imm = addressOf(it->second);
+}
+
+// The first edit builds the rope; it is kept in step from then on
+template <class Word>
+void BasicMachine<Word>::beginEdit()
+{
+	disarmCycles();
+	++Revision;
+	if (Rope.size() != Instructions.size() || Instructions.empty())
+		Rope.build(Instructions.empty() ? 0 : &Instructions[0].size, Instructions.size(), sizeof(instruction));
+}
+
+// Only push and call write slots, so a live frame's slot still holds its
+// return address
+template <class Word>
+static void shift_thread(Word from, int delta, Word & eip, std::vector<Word> & stack,
+	std::vector<basic_frame<Word> > & frames)
+{
+	if (eip >= from)
+		eip += delta;
+	for (size_t k = 0; k < frames.size(); ++k)
+	{
+		basic_frame<Word> & f = frames[k];
+		if (f.target >= from)
+			f.target += delta;
+		Word & ret = stack[f.depth - 1];
+		if (ret >= from)
+			ret += delta;
+	}
+}
+
+template <class Word>
+static void shift_calls(size_t from, int delta, std::vector<basic_frame<Word> > & frames)
+{
+	for (size_t k = 0; k < frames.size(); ++k)
+		if (frames[k].call_idx >= (int)from)
+			frames[k].call_idx += delta;
+}
+
+// Writers at or past from move by delta. With delta < 0 the instructions
+// in [from + delta, from) are gone, and what they wrote no longer has a
+// writer to show
+static void shift_writer(int from, int gone, int delta, int & writer)
+{
+	if (writer >= from)
+		writer += delta;
+	else if (writer >= gone)
+		writer = -1;
+}
+
+// One pass over every slot of the thread, the part of an edit that grows
+// with the stack
+static void shift_writers(size_t from, int delta, std::vector<slot_write> & writes)
+{
+	int gone = (int)from + std::min(delta, 0);
+	for (size_t k = 0; k < writes.size(); ++k)
+		shift_writer((int)from, gone, delta, writes[k].idx);
+}
+
+static void shift_registers(size_t from, int delta, int * writers)
+{
+	int gone = (int)from + std::min(delta, 0);
+	for (int r = 0; r < 3; ++r)
+		shift_writer((int)from, gone, delta, writers[r]);
+}
+
+// A frame whose call is gone is shown against what took its place
+template <class Word>
+static void clamp_calls(size_t count, std::vector<basic_frame<Word> > & frames)
+{
+	if (count == 0)
+		frames.clear();
+	for (size_t k = 0; k < frames.size(); ++k)
+		if (frames[k].call_idx >= (int)count)
+			frames[k].call_idx = (int)count - 1;
+}
+
+// Code addresses held by the machine that are at or past from move by
+// delta: eip and the target and return slot of frames, in every thread.
+// Label operands follow through relocate.
+template <class Word>
+void BasicMachine<Word>::shiftAddresses(Word from, int delta)
+{
+	// Epoch 0 is the unedited program; on wrap-around everything goes
+	// back to it, so no stale operand can carry the new Epoch
+	if (++Epoch == 0)
+	{
+		Epoch = 1;
+		for (size_t i = 0; i < Instructions.size(); ++i)
+			Instructions[i].epoch = 0;
+	}
+
+	shift_thread(from, delta, eip, Stack, CallStack);
+	for (size_t t = 0; t < Threads.size(); ++t)
+		shift_thread(from, delta, Threads[t].eip, Threads[t].stack, Threads[t].frames);
+}
+
+// Instruction indices at or past from move by delta; an erase (delta -1)
+// also forgets the slot and register writers of the erased instruction.
+// Linear in labels, symbols and the stack slots of every thread
+template <class Word>
+void BasicMachine<Word>::shiftIndices(size_t from, int delta)
+{
+	for (size_t i = 0; i < Labels.size(); ++i)
+		if (Labels[i].idx >= from)
+			Labels[i].idx += delta;
+	std::unordered_map<std::string, unsigned int>::iterator it;
+	for (it = Symbols.begin(); it != Symbols.end(); ++it)
+		if (it->second >= from)
+			it->second += delta;
+	for (size_t i = 0; i < Breakpoints.size(); ++i)
+		if (Breakpoints[i].idx >= (int)from)
+			Breakpoints[i].idx += delta;
+	shift_calls(from, delta, CallStack);
+	shift_writers(from, delta, SlotWrites);
+	shift_registers(from, delta, RegWriters);
+	for (size_t t = 0; t < Threads.size(); ++t)
+	{
+		shift_calls(from, delta, Threads[t].frames);
+		shift_writers(from, delta, Threads[t].writes);
+		shift_registers(from, delta, Threads[t].writers);
+	}
+	DirtyFrom = 0;
+}
+
+template <class Word>
+bool BasicMachine<Word>::replaceInstruction(size_t idx, const std::string & text, std::string & error)
+{
+	instruction s;
+	if (idx >= Instructions.size())
+	{
+		error = "no instruction " + std::to_string((unsigned long long)idx);
+		return false;
+	}
+	if (!parseInstruction(text, s, error))
+		return false;
+
+	beginEdit();
+	unsigned int addr = addressOf(idx);
+	unsigned int old = Instructions[idx].size;
+
+	if (s.size != old)
+	{
+		shiftAddresses(addr + old, (int)s.size - (int)old);
+		Rope.resize(idx, s.size);
+		AddrValid = std::min(AddrValid, idx + 1);
+	}
+	s.addr = addr;
+	Instructions[idx] = s;
+	relocate(Instructions[idx]);
+	return true;
+}
+
+// The new instruction goes before idx; what was at idx keeps its labels
+template <class Word>
+bool BasicMachine<Word>::insertInstruction(size_t idx, const std::string & text, std::string & error)
+{
+	instruction s;
+	if (idx > Instructions.size())
+	{
+		error = "no instruction " + std::to_string((unsigned long long)idx);
+		return false;
+	}
+	if (!parseInstruction(text, s, error))
+		return false;
+
+	beginEdit();
+	unsigned int addr = addressOf(idx);
+
+	shiftAddresses(addr, s.size);
+	shiftIndices(idx, 1);
+	s.addr = addr;
+	Instructions.insert(Instructions.begin() + idx, s);
+	Rope.insert(idx, s.size);
+	AddrValid = std::min(AddrValid, idx);
+	relocate(Instructions[idx]);
+	BreakAt.insert(BreakAt.begin() + idx, 0);
+	return true;
+}
+
+// Labels of the erased instruction move on to the next one
+template <class Word>
+bool BasicMachine<Word>::eraseInstruction(size_t idx, std::string & error)
+{
+	if (idx >= Instructions.size())
+	{
+		error = "no instruction " + std::to_string((unsigned long long)idx);
+		return false;
+	}
+
+	beginEdit();
+	unsigned int addr = addressOf(idx);
+	unsigned int old = Instructions[idx].size;
+
+	for (size_t i = Breakpoints.size(); i-- > 0; )
+		if (Breakpoints[i].idx == (int)idx)
+			Breakpoints.erase(Breakpoints.begin() + i);
+
+	// Slots and registers it wrote are forgotten by shiftIndices
+	shiftAddresses(addr + old, -(int)old);
+	shiftIndices(idx + 1, -1);
+	Instructions.erase(Instructions.begin() + idx);
+	Rope.erase(idx);
+	AddrValid = std::min(AddrValid, idx);
+
+	// The next instruction's labels now share idx with the erased one's
+	std::vector<label_entry>::iterator it = Labels.begin();
+	while (it != Labels.end() && it->idx < idx)
+		++it;
+	if (it != Labels.end() && it + 1 != Labels.end() && (it + 1)->idx == idx)
+	{
+		it->name = Names.add(std::string(Names.str(it->name)) + ", " + Names.str((it + 1)->name));
+		Labels.erase(it + 1);
+	}
+
+	clamp_calls(Instructions.size(), CallStack);
+	for (size_t t = 0; t < Threads.size(); ++t)
+		clamp_calls(Instructions.size(), Threads[t].frames);
+	BreakAt.erase(BreakAt.begin() + idx);
+	return true;
+}
+
+template <class Word>
+Word BasicMachine<Word>::hexstr_to_dec(std::string str)
+{
+	Word x = 0;
+	std::stringstream ss;
+	ss << std::hex << str;
+	ss >> x;
+	return x;
+}
+
+template <class Word>
+Word & BasicMachine<Word>::reg(unsigned char r)
+{
+	return (r == REG_ESP) ? esp : (r == REG_EBP) ? ebp : eax;
+}
+
+template <class Word>
+Word BasicMachine<Word>::source(const instruction & inst)
+{
+	return (inst.src < OPND_IMM) ? reg(inst.src) : inst.imm;
+}
+
+template <class Word>
+void BasicMachine<Word>::inst_mov(int idx)
+{
+	const instruction & inst = Instructions[idx];
+	if (inst.dst == OPND_NONE)
+		DIAGNOSE(DIAG_WARNING, DIAG_MOV_NO_DST, idx, Names.str(inst.text[0]));
+	else
+	{
+		reg(inst.dst) = source(inst);
+		noteWrite(inst.dst, idx);
+	}
+
+	if (inst.dst == REG_ESP)
+	{
+		if (esp == 0)
+		{
+			Stack.clear();
+			SlotWrites.clear();
+			DirtyFrom = 0;
+			StackHash = 0;
+		}
+		else
+		{
+			for (int i = Stack.size() - 1; i >= 0; --i)
+			{
+				if (esp > (Word)0 - (Word)i * SLOT_BYTES - 1)
+					popSlot();
+				else
+					break;
+			}
+		}
+		unwindCallStack();
+	}
+
+	eip = addressOf(idx) + inst.size;
+}
+
+template <class Word>
+void BasicMachine<Word>::inst_push(int idx)
+{
+	const instruction & inst = Instructions[idx];
+	pushSlot(source(inst), idx);
+
+	esp -= SLOT_BYTES;
+	noteWrite(REG_ESP, idx);
+	if (!Watchpoints.empty())
+		checkWatchpoints(slot_address(Stack.size() - 1));
+
+	eip = addressOf(idx) + inst.size;
+}
+
+template <class Word>
+void BasicMachine<Word>::inst_pop(int idx)
+{
+	const instruction & inst = Instructions[idx];
+	if (esp == 0)
+		DIAGNOSE(DIAG_WARNING, DIAG_POP_ESP_ZERO, idx, "");
+
+	if (inst.dst == OPND_NONE)
+		DIAGNOSE(DIAG_WARNING, DIAG_POP_NO_DST, idx, Names.str(inst.text[0]));
+	else
+		reg(inst.dst) = Stack[Stack.size() - 1];
+	
+	popSlot();
+	esp += SLOT_BYTES;
+	noteWrite(REG_ESP, idx);
+	if (inst.dst != OPND_NONE)
+		noteWrite(inst.dst, idx);
+	unwindCallStack();
+
+	eip = addressOf(idx) + inst.size;
+}
+
+template <class Word>
+void BasicMachine<Word>::inst_jmp(int idx)
+{
+	eip = source(Instructions[idx]);
+}
+
+template <class Word>
+void BasicMachine<Word>::inst_call(int idx)
+{
+	pushSlot(eip + Instructions[idx].size, idx);
+	esp -= SLOT_BYTES;
+	noteWrite(REG_ESP, idx);
+	if (!Watchpoints.empty())
+		checkWatchpoints(slot_address(Stack.size() - 1));
+
+	// call esp jumps to the slot just pushed
+	eip = source(Instructions[idx]);
+
+	frame f;
+	f.call_idx = idx;
+	f.target = eip;
+	f.esp = esp;
+	f.ebp = ebp;
+	f.depth = Stack.size();
+	CallStack.push_back(f);
+}
+
+template <class Word>
+void BasicMachine<Word>::inst_retn(int idx)
+{
+	eip = ebp = Stack[Stack.size() - 1];
+	popSlot();
+	esp += SLOT_BYTES;
+	noteWrite(REG_EBP, idx);
+	noteWrite(REG_ESP, idx);
+	unwindCallStack();
+}
+
+// The new thread waits for its turn at the back of the queue
+template <class Word>
+void BasicMachine<Word>::inst_spawn(int idx)
+{
+	const instruction & inst = Instructions[idx];
+	Threads.push_back(guest_thread());
+	guest_thread & t = Threads.back();
+	t.id = SpawnedThreads++;
+	t.esp = t.ebp = 0;
+	t.eax = eax;
+	t.eip = source(inst);
+	for (int r = 0; r < 3; ++r)
+		t.writers[r] = idx;
+
+	// The state hash only covers the running thread
+	disarmCycles();
+	eip = addressOf(idx) + inst.size;
+}
+
+// The only store there is, so it is also where the journal and the
+// slot writers see them
+template <class Word>
+void BasicMachine<Word>::pushSlot(Word value, int idx)
+{
+	if (CycleArmed)
+		StackHash ^= slot_hash(Stack.size(), value);
+	unsigned int k = Journal.next++ & (JOURNAL_SLOTS - 1);
+	Journal.slot[k] = Stack.size();
+	Journal.when[k] = Steps + 1;
+	if (Stack.size() < DirtyFrom)
+		DirtyFrom = Stack.size();
+
+	slot_write w;
+	w.step = Steps + 1;
+	w.idx = idx;
+	Stack.push_back(value);
+	SlotWrites.push_back(w);
+}
+
+template <class Word>
+void BasicMachine<Word>::popSlot()
+{
+	if (CycleArmed)
+		StackHash ^= slot_hash(Stack.size() - 1, Stack.back());
+	Stack.pop_back();
+	SlotWrites.pop_back();
+	if (Stack.size() < DirtyFrom)
+		DirtyFrom = Stack.size();
+}
+
+// Steps counts the write's step once it has run
+template <class Word>
+void BasicMachine<Word>::noteWrite(unsigned char r, int idx)
+{
+	Journal.reg[r] = Steps + 1;
+	RegWriters[r] = idx;
+}
+
+// Out of line so the handlers only carry the pointer test
+template <class Word>
+void BasicMachine<Word>::diagnose(diag_severity severity, diag_id id, int idx, const char * detail)
+{
+	Diag->report(severity, id, Steps + 1, eip, idx, detail);
+}
+
+template <class Word>
+void BasicMachine<Word>::clearJournal()
+{
+	for (int r = 0; r < 3; ++r)
+		Journal.reg[r] = ~0ull;
+	for (unsigned int k = 0; k < JOURNAL_SLOTS; ++k)
+		Journal.when[k] = ~0ull;
+	Journal.next = 0;
+}
+
+template <class Word>
+unsigned long long BasicMachine<Word>::regAge(int r) const
+{
+	return (Journal.reg[r] == ~0ull) ? ~0ull : Steps - Journal.reg[r];
+}
+
+// The newest write to the slot, an older one may have been popped since
+template <class Word>
+unsigned long long BasicMachine<Word>::slotAge(unsigned int slot) const
+{
+	unsigned long long age = ~0ull;
+	for (unsigned int k = 0; k < JOURNAL_SLOTS; ++k)
+		if (Journal.slot[k] == slot && Journal.when[k] != ~0ull)
+			age = std::min(age, Steps - Journal.when[k]);
+	return age;
+}
+
+// Drops the frames whose return address slot is gone; O(1) amortized
+template <class Word>
+void BasicMachine<Word>::unwindCallStack()
+{
+	while (!CallStack.empty() && CallStack.back().depth > Stack.size())
+		CallStack.pop_back();
+}
+
+template <class Word>
+int BasicMachine<Word>::findInstruction(Word addr)
+{
+	// Code addresses fit 32 bits in both widths
+	if (addr > 0xFFFFFFFFu)
+		return -1;
+
+	// Past the current part of instruction::addr the rope answers
+	if (AddrValid < Instructions.size() && (AddrValid == 0 || addr > Instructions[AddrValid - 1].addr))
+	{
+		size_t idx = Rope.lowerBound(addr);
+		return (idx < Instructions.size()) ? (int)idx : -1;
+	}
+
+	// Addresses grow with the index, so take the first one not below addr
+	int lo = 0;
+	int hi = AddrValid;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if ((unsigned int)Instructions[mid].addr < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo < (int)Instructions.size()) ? lo : -1;
+}
+
+// Where execute() would go from eip = imm
+template <class Word>
+int BasicMachine<Word>::targetOf(size_t idx)
+{
+	instruction & inst = Instructions[idx];
+	if (inst.epoch != Epoch)
+		relocate(inst);
+	return (inst.src == OPND_IMM) ? findInstruction(inst.imm) : -1;
+}
+
+template <class Word>
+bool BasicMachine<Word>::step()
+{
+	if (DetectCycles && !CycleArmed && !CycleFound && Threads.empty())
+		armCycles();
+
+	Word from = eip;
+	if (!execute())
+		return false;
+
+	// Only a jump backwards can close a loop
+	if (CycleArmed && eip <= from && Cycles.sample(state_hash(StackHash, esp, ebp, eax, eip), Steps))
+	{
+		unsigned long long entry;
+		if (findCycleEntry(Steps - Cycles.markStep(), entry))
+		{
+			BreakHit = true;
+			BreakReason = "entered cycle at step " + std::to_string(entry);
+			CycleFound = true;
+			CycleArmed = false;
+		}
+		else
+			Cycles.restart();
+	}
+	return true;
+}
+
+// One instruction, without the cycle samples
+template <class Word>
+bool BasicMachine<Word>::execute()
+{
+	// Find current instruction, in the next thread once this one's turn is over
+	int idx = Threads.empty() ? findInstruction(eip) : schedule();
+
+	// When all instructions passed
+	if (idx == -1)
+	{
+		BreakReason = "end of program";
+		return false;
+	}
+
+	instruction & inst = Instructions[idx];
+	if (inst.epoch != Epoch)
+		relocate(inst);
+
+	// Stack faults stop the machine like the end of the program does
+	unsigned char op = inst.op;
+	if (Stack.empty() && (op == OP_POP || op == OP_RETN))
+	{
+		BreakReason = "stack underflow";
+		return false;
+	}
+	if (Stack.size() >= MAX_STACK_SLOTS && (op == OP_PUSH || op == OP_CALL))
+	{
+		BreakReason = "stack overflow";
+		return false;
+	}
+	if (Threads.size() + 1 >= MAX_THREADS && op == OP_SPAWN)
+	{
+		BreakReason = "too many threads";
+		return false;
+	}
+
+	switch (op)
+	{
+	case OP_MOV: inst_mov(idx); break;
+	case OP_PUSH: inst_push(idx); break;
+	case OP_POP: inst_pop(idx); break;
+	case OP_JMP: inst_jmp(idx); break;
+	case OP_CALL: inst_call(idx); break;
+	case OP_RETN: inst_retn(idx); break;
+	case OP_SPAWN: inst_spawn(idx); break;
+	default:
+		DIAGNOSE(DIAG_ERROR, DIAG_UNKNOWN_OP, idx, mnemonic(inst));
+	}
+
+	++Steps;
+	++Slice;
+	ExecIdx = idx;
+	return true;
+}
+
+template <class Word>
+unsigned int BasicMachine<Word>::runInstructions(unsigned int budget)
+{
+	BreakHit = false;
+	InRun = true;
+	for (unsigned int n = 0; n < budget; ++n)
+	{
+		if (!step())
+		{
+			Running = false;
+			InRun = false;
+			StopDepth = -1;
+			if (Export)
+				Export->publish(*this);
+			return n;
+		}
+
+		if (shouldStop())
+		{
+			Running = false;
+			InRun = false;
+			StopDepth = -1;
+			if (Export)
+				Export->publish(*this);
+			return n + 1;
+		}
+
+		if (Export && (n & (STATE_EXPORT_STEPS - 1)) == STATE_EXPORT_STEPS - 1)
+			Export->publish(*this);
+	}
+	InRun = false;
+	if (Export)
+		Export->publish(*this);
+	return budget;
+}
+
+template <class Word>
+bool BasicMachine<Word>::shouldStop()
+{
+	// Watchpoints are checked by the handlers that write memory
+	return BreakHit || (!Breakpoints.empty() && checkBreakpoints())
+		|| ((int)CallStack.size() <= StopDepth && ThreadId == StopThread);
+}
+
+// Starts running through the call at eip; false if eip is not at a call
+template <class Word>
+bool BasicMachine<Word>::stepOver()
+{
+	int idx = findInstruction(eip);
+	if (idx == -1 || Instructions[idx].op != OP_CALL)
+		return false;
+
+	// Run through the callee until the call returns to this depth
+	StopDepth = CallStack.size();
+	StopThread = ThreadId;
+	BreakReason = "";
+	Running = true;
+	return true;
+}
+
+// Starts running until the current frame returns; false outside of calls
+template <class Word>
+bool BasicMachine<Word>::stepOut()
+{
+	if (CallStack.empty())
+		return false;
+
+	StopDepth = CallStack.size() - 1;
+	StopThread = ThreadId;
+	BreakReason = "";
+	Running = true;
+	return true;
+}
+
+//---------------------------------------------------------------------------
+// Guest threads
+
+template <class Word>
+int BasicMachine<Word>::schedule()
+{
+	// A turn is one step at least, whatever Quantum says
+	if (Slice >= Quantum && Slice > 0 && !Threads.empty())
+		switchThread();
+
+	int idx = findInstruction(eip);
+	while (idx == -1 && !Threads.empty())
+	{
+		exitThread();
+		idx = findInstruction(eip);
+	}
+	return idx;
+}
+
+template <class Word>
+void BasicMachine<Word>::swapThread(guest_thread & t)
+{
+	std::swap(ThreadId, t.id);
+	std::swap(esp, t.esp);
+	std::swap(ebp, t.ebp);
+	std::swap(eax, t.eax);
+	std::swap(eip, t.eip);
+	Stack.swap(t.stack);
+	SlotWrites.swap(t.writes);
+	CallStack.swap(t.frames);
+	std::swap_ranges(RegWriters, RegWriters + 3, t.writers);
+}
+
+// The running thread is parked where the next one was, so every thread
+// comes round once per Threads.size() + 1 turns
+template <class Word>
+void BasicMachine<Word>::switchThread()
+{
+	swapThread(Threads[NextThread]);
+	NextThread = (NextThread + 1) % Threads.size();
+	Slice = 0;
+	// The journal is the last thread's, the panels would show its writes
+	clearJournal();
+	DirtyFrom = 0;
+}
+
+// The running thread is done: the next one comes in and the last parked
+// one takes over the finished one's place in the turns
+template <class Word>
+void BasicMachine<Word>::exitThread()
+{
+	guest_thread & done = Threads[NextThread];
+	swapThread(done);
+	guest_thread & last = Threads.back();
+	if (&done != &last)
+	{
+		std::swap(done.id, last.id);
+		std::swap(done.esp, last.esp);
+		std::swap(done.ebp, last.ebp);
+		std::swap(done.eax, last.eax);
+		std::swap(done.eip, last.eip);
+		done.stack.swap(last.stack);
+		done.writes.swap(last.writes);
+		done.frames.swap(last.frames);
+		std::swap_ranges(done.writers, done.writers + 3, last.writers);
+	}
+	Threads.pop_back();
+	if (NextThread >= Threads.size())
+		NextThread = 0;
+	Slice = 0;
+	clearJournal();
+	DirtyFrom = 0;
+}
+
+//---------------------------------------------------------------------------
+// Cycle detection
+
+template <class Word>
+void BasicMachine<Word>::setCycleDetection(bool on)
+{
+	DetectCycles = on;
+	disarmCycles();
+}
+
+template <class Word>
+void BasicMachine<Word>::disarmCycles()
+{
+	CycleArmed = false;
+	CycleFound = false;
+}
+
+// Hashes the stack and keeps the state to replay from
+template <class Word>
+void BasicMachine<Word>::armCycles()
+{
+	StackHash = 0;
+	for (size_t i = 0; i < Stack.size(); ++i)
+		StackHash ^= slot_hash(i, Stack[i]);
+
+	CycleStart.esp = esp;
+	CycleStart.ebp = ebp;
+	CycleStart.eax = eax;
+	CycleStart.eip = eip;
+	CycleStart.stack = Stack;
+	CycleStart.writes = SlotWrites;
+	CycleStart.frames = CallStack;
+	CycleStart.steps = Steps;
+	CycleStart.hash = StackHash;
+	Cycles.restart();
+	CycleArmed = true;
+}
+
+template <class Word>
+void BasicMachine<Word>::swapState(machine_state & state)
+{
+	std::swap(esp, state.esp);
+	std::swap(ebp, state.ebp);
+	std::swap(eax, state.eax);
+	std::swap(eip, state.eip);
+	Stack.swap(state.stack);
+	SlotWrites.swap(state.writes);
+	CallStack.swap(state.frames);
+	std::swap(Steps, state.steps);
+	std::swap(StackHash, state.hash);
+	DirtyFrom = 0;
+}
+
+template <class Word>
+static bool same_state(const basic_machine_state<Word> & a, const basic_machine_state<Word> & b)
+{
+	return a.eip == b.eip && a.esp == b.esp && a.ebp == b.ebp && a.eax == b.eax
+		&& a.hash == b.hash && a.stack == b.stack;
+}
+
+// Brent's second phase, replayed from CycleStart: the hare goes period
+// steps ahead, then both step together until their states are equal,
+// which first happens where the cycle was entered. That is at the mark
+// at the latest; if they are still apart there the hashes collided.
+// The replay only repeats steps already taken, so it reports nothing,
+// fires no watchpoints and does not count towards the thread's turn.
+template <class Word>
+bool BasicMachine<Word>::findCycleEntry(unsigned long long period, unsigned long long & entry)
+{
+	Diagnostics * diag = Diag;
+	std::vector<watchpoint> watchpoints;
+	unsigned int slice = Slice;
+	Diag = 0;
+	Watchpoints.swap(watchpoints);
+
+	bool hit = BreakHit;
+	std::string reason = BreakReason;
+	int idx = ExecIdx;
+	int writers[3] = { RegWriters[0], RegWriters[1], RegWriters[2] };
+	write_journal journal = Journal;
+	unsigned long long last = Cycles.markStep();
+
+	machine_state tortoise = CycleStart;
+	machine_state hare = CycleStart;
+	bool found = false;
+	bool ok = true;
+
+	swapState(hare);
+	for (unsigned long long n = 0; n < period && ok; ++n)
+		ok = execute();
+	swapState(hare);
+
+	while (ok && tortoise.steps <= last)
+	{
+		if (same_state(tortoise, hare))
+		{
+			entry = tortoise.steps;
+			found = true;
+			break;
+		}
+		swapState(tortoise);
+		ok = execute();
+		swapState(tortoise);
+		swapState(hare);
+		ok = ok && execute();
+		swapState(hare);
+	}
+
+	Diag = diag;
+	Watchpoints.swap(watchpoints);
+	Slice = slice;
+	BreakHit = hit;
+	BreakReason = reason;
+	ExecIdx = idx;
+	std::copy(writers, writers + 3, RegWriters);
+	Journal = journal;
+	return found;
+}
+
+//---------------------------------------------------------------------------
+template <class Word>
+void BasicMachine<Word>::loadBreakpoint(TiXmlElement * element)
+{
+	const char * addr = element->Attribute("addr");
+	const char * cond = element->Attribute("cond");
+	std::string error;
+	if (!addBreakpoint(addr ? addr : "", cond ? cond : "", error))
+		log("oop5: breakpoint " + error);
+}
+
+template <class Word>
+void BasicMachine<Word>::loadWatchpoint(TiXmlElement * element)
+{
+	const char * addr = element->Attribute("addr");
+	const char * cond = element->Attribute("cond");
+	std::string error;
+	if (!addWatchpoint(addr ? addr : "", cond ? cond : "", error))
+		log("oop5: watchpoint " + error);
+}
+
+// addr is a label, a number or empty for a condition checked on every step
+template <class Word>
+bool BasicMachine<Word>::addBreakpoint(const std::string & addr, const std::string & cond, std::string & error)
+{
+	breakpoint bp;
+	bp.idx = -1;
+
+	if (addr.size() > 0)
+	{
+		Word value;
+		std::unordered_map<std::string, unsigned int>::const_iterator sym = Symbols.find(addr);
+		if (sym != Symbols.end())
+			value = addressOf(sym->second);
+		else if (!Predicate::parse_number(addr, value))
+			value = -1;
+
+		if ((bp.idx = findInstruction(value)) == -1
+			|| addressOf(bp.idx) != value)
+		{
+			error = "no instruction at " + addr;
+			return false;
+		}
+	}
+
+	if (cond.size() > 0 && !bp.cond.compile(cond, error))
+		return false;
+
+	// A breakpoint without address and condition would stop on every step
+	if (bp.idx == -1 && bp.cond.empty())
+	{
+		error = "needs an address or a condition";
+		return false;
+	}
+
+	Breakpoints.push_back(bp);
+	updateBreakAt();
+	return true;
+}
+
+template <class Word>
+bool BasicMachine<Word>::addWatchpoint(const std::string & addr, const std::string & cond, std::string & error)
+{
+	watchpoint wp;
+
+	if (!Predicate::parse_number(addr, wp.addr))
+	{
+		error = "needs a numeric address";
+		return false;
+	}
+
+	if (cond.size() > 0 && !wp.cond.compile(cond, error))
+		return false;
+
+	Watchpoints.push_back(wp);
+	return true;
+}
+
+template <class Word>
+void BasicMachine<Word>::updateBreakAt()
+{
+	BreakAt.assign(Instructions.size(), 0);
+	for (size_t i = 0; i < Breakpoints.size(); ++i)
+		if (Breakpoints[i].idx != -1)
+			BreakAt[Breakpoints[i].idx] = 1;
+}
+
+template <class Word>
+void BasicMachine<Word>::toggleBreakpoint()
+{
+	int idx = findInstruction(eip);
+	if (idx == -1)
+		return;
+
+	for (size_t i = 0; i < Breakpoints.size(); ++i)
+	{
+		if (Breakpoints[i].idx == idx && Breakpoints[i].cond.empty())
+		{
+			Breakpoints.erase(Breakpoints.begin() + i);
+			updateBreakAt();
+			return;
+		}
+	}
+
+	breakpoint bp;
+	bp.idx = idx;
+	Breakpoints.push_back(bp);
+	updateBreakAt();
+}
+
+template <class Word>
+bool BasicMachine<Word>::checkBreakpoints()
+{
+	int idx = findInstruction(eip);
+	if (idx == -1)
+		return false;
+
+	Word regs[REG_COUNT];
+	regs[REG_ESP] = esp;
+	regs[REG_EBP] = ebp;
+	regs[REG_EAX] = eax;
+	regs[REG_EIP] = eip;
+
+	for (size_t i = 0; i < Breakpoints.size(); ++i)
+	{
+		const breakpoint & bp = Breakpoints[i];
+		if (bp.idx != -1 && bp.idx != idx)
+			continue;
+
+		if (bp.cond.empty() || bp.cond.eval(regs, Stack))
+		{
+			BreakReason = bp.cond.empty() ? "breakpoint" : "breakpoint: " + bp.cond.source();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+template <class Word>
+void BasicMachine<Word>::checkWatchpoints(Word addr)
+{
+	Word regs[REG_COUNT];
+	regs[REG_ESP] = esp;
+	regs[REG_EBP] = ebp;
+	regs[REG_EAX] = eax;
+	regs[REG_EIP] = eip;
+
+	for (size_t i = 0; i < Watchpoints.size(); ++i)
+	{
+		const watchpoint & wp = Watchpoints[i];
+		if (wp.addr != addr)
+			continue;
+
+		if (wp.cond.empty() || wp.cond.eval(regs, Stack))
+		{
+			BreakHit = true;
+			BreakReason = "watchpoint 0x" + fill_word(decint_to_hexstr(addr));
+			return;
+		}
+	}
+}
+
+//---------------------------------------------------------------------------
+// Snapshot file, native byte order:
+//   snapshot_header
+//   frame[frames]						the shadow call stack
+//   { index, slot[SNAPSHOT_PAGE_SLOTS] }[pages]
+// Only stack pages with a non-zero slot are stored; slot i of page p is
+// Stack[p * SNAPSHOT_PAGE_SLOTS + i], anything past Stack.size() is zero.
+// Registers, frames and slots are words, so a snapshot only loads into a
+// machine of the width it was taken with.
+static const char SNAPSHOT_MAGIC[4] = { 'O', 'O', 'P', '5' };
+static const unsigned int SNAPSHOT_VERSION = 2;
+static const unsigned int SNAPSHOT_PAGE_SLOTS = 1024;	// 4 KB of 32-bit slots, 8 KB of 64-bit ones
+
+template <class Word>
+struct snapshot_header
+{
+	char magic[4];
+	unsigned int version;
+	unsigned long long program;		// programHash() of the program it was taken from
+	Word esp;
+	Word ebp;
+	Word eax;
+	Word eip;
+	unsigned int slots;				// Stack.size()
+	unsigned int frames;
+	unsigned int pages;
+	unsigned int word;				// sizeof(Word), 0 in files from before 64-bit machines
+};
+
+// FNV-1a over the decoded program, which is what execution depends on;
+// addresses follow from the sizes. Label operands are only current
+// after refreshAddresses.
+template <class Word>
+unsigned long long BasicMachine<Word>::programHash() const
+{
+	unsigned long long h = 14695981039346656037ull;
+	for (size_t i = 0; i < Instructions.size(); ++i)
+	{
+		const instruction & d = Instructions[i];
+		unsigned int fields[6] = { d.op, d.dst, d.src, (unsigned int)d.imm, d.size,
+			(unsigned int)((unsigned long long)d.imm >> 32) };
+		const unsigned char * p = (const unsigned char *)fields;
+		// The high half of imm only where there is one, 32-bit hashes stay as they were
+		size_t bytes = (sizeof(Word) > 4) ? sizeof(fields) : 5 * sizeof(unsigned int);
+		for (size_t k = 0; k < bytes; ++k)
+			h = (h ^ p[k]) * 1099511628211ull;
+	}
+	return h;
+}
+
+// The whole file is built in memory and written with one fwrite
+template <class Word>
+bool BasicMachine<Word>::saveSnapshot(const std::string & path)
+{
+	if (!Threads.empty())
+	{
+		log("oop5: snapshots hold one thread, " + std::to_string((unsigned long long)threadCount()) + " are alive");
+		return false;
+	}
+
+	refreshAddresses();
+	unsigned int page_count = (Stack.size() + SNAPSHOT_PAGE_SLOTS - 1) / SNAPSHOT_PAGE_SLOTS;
+	std::vector<unsigned int> pages;
+	for (unsigned int p = 0; p < page_count; ++p)
+	{
+		size_t first = (size_t)p * SNAPSHOT_PAGE_SLOTS;
+		size_t last = std::min(first + SNAPSHOT_PAGE_SLOTS, Stack.size());
+		size_t i = first;
+		while (i < last && Stack[i] == 0)
+			++i;
+		if (i < last)
+			pages.push_back(p);
+	}
+
+	snapshot_header<Word> h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = SNAPSHOT_VERSION;
+	h.program = programHash();
+	h.esp = esp;
+	h.ebp = ebp;
+	h.eax = eax;
+	h.eip = eip;
+	h.slots = Stack.size();
+	h.frames = CallStack.size();
+	h.pages = pages.size();
+	h.word = sizeof(Word);
+
+	size_t page_bytes = sizeof(unsigned int) + SNAPSHOT_PAGE_SLOTS * sizeof(Word);
+	std::vector<char> buf(sizeof(h) + h.frames * sizeof(frame) + h.pages * page_bytes, 0);
+	char * out = &buf[0];
+	memcpy(out, &h, sizeof(h));
+	out += sizeof(h);
+	// Field by field into a zeroed frame, so padding does not carry
+	// whatever was in memory into the file
+	for (size_t k = 0; k < CallStack.size(); ++k, out += sizeof(frame))
+	{
+		frame f;
+		memset(&f, 0, sizeof(f));
+		f.call_idx = CallStack[k].call_idx;
+		f.target = CallStack[k].target;
+		f.esp = CallStack[k].esp;
+		f.ebp = CallStack[k].ebp;
+		f.depth = CallStack[k].depth;
+		memcpy(out, &f, sizeof(f));
+	}
+
+	for (size_t k = 0; k < pages.size(); ++k, out += page_bytes)
+	{
+		size_t first = (size_t)pages[k] * SNAPSHOT_PAGE_SLOTS;
+		size_t count = std::min((size_t)SNAPSHOT_PAGE_SLOTS, Stack.size() - first);
+		memcpy(out, &pages[k], sizeof(unsigned int));
+		memcpy(out + sizeof(unsigned int), &Stack[first], count * sizeof(Word));
+	}
+
+	FILE * f = fopen(path.c_str(), "wb");
+	bool ok = f && fwrite(&buf[0], 1, buf.size(), f) == buf.size();
+	if (f && fclose(f) != 0)
+		ok = false;
+	if (!ok)
+		log("oop5: cannot write snapshot " + path);
+	return ok;
+}
+
+// Maps the file and copies it in; the machine is left alone on any error
+template <class Word>
+bool BasicMachine<Word>::loadSnapshot(const std::string & path)
+{
+	refreshAddresses();
+	MappedFile file;
+	if (!file.open(path) || file.size() < sizeof(snapshot_header<Word>))
+	{
+		log("oop5: cannot read snapshot " + path);
+		return false;
+	}
+
+	snapshot_header<Word> h;
+	memcpy(&h, file.data(), sizeof(h));
+	size_t page_bytes = sizeof(unsigned int) + SNAPSHOT_PAGE_SLOTS * sizeof(Word);
+	if (memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0 || h.version != SNAPSHOT_VERSION
+		|| (h.word != sizeof(Word) && !(h.word == 0 && sizeof(Word) == 4))
+		|| h.slots > MAX_STACK_SLOTS || h.frames > h.slots
+		|| file.size() != sizeof(h) + (size_t)h.frames * sizeof(frame) + (size_t)h.pages * page_bytes)
+	{
+		log("oop5: " + path + " is not a snapshot");
+		return false;
+	}
+	if (h.program != programHash())
+	{
+		log("oop5: snapshot " + path + " was taken from another program");
+		return false;
+	}
+
+	const char * in = file.data() + sizeof(h);
+	std::vector<frame> frames(h.frames);
+	if (h.frames > 0)
+		memcpy(&frames[0], in, h.frames * sizeof(frame));
+	in += h.frames * sizeof(frame);
+	// Frames hold at least their return address and nest upwards; the
+	// edit and unwind code index the stack by depth - 1 in that order
+	for (size_t k = 0; k < frames.size(); ++k)
+	{
+		if (frames[k].call_idx < 0 || frames[k].call_idx >= (int)Instructions.size()
+			|| frames[k].depth == 0 || frames[k].depth > h.slots
+			|| (k > 0 && frames[k].depth <= frames[k - 1].depth))
+		{
+			log("oop5: snapshot " + path + " has a bad call stack");
+			return false;
+		}
+	}
+
+	std::vector<Word> stack(h.slots, 0);
+	for (unsigned int k = 0; k < h.pages; ++k, in += page_bytes)
+	{
+		unsigned int page;
+		memcpy(&page, in, sizeof(page));
+		size_t first = (size_t)page * SNAPSHOT_PAGE_SLOTS;
+		if (first >= stack.size())
+		{
+			log("oop5: snapshot " + path + " has a page past the end of the stack");
+			return false;
+		}
+		size_t count = std::min((size_t)SNAPSHOT_PAGE_SLOTS, stack.size() - first);
+		memcpy(&stack[first], in + sizeof(unsigned int), count * sizeof(Word));
+	}
+
+	reset();
+	Stack.swap(stack);
+	slot_write unknown;
+	unknown.step = ~0ull;
+	unknown.idx = -1;
+	SlotWrites.assign(Stack.size(), unknown);
+	CallStack.swap(frames);
+	esp = h.esp;
+	ebp = h.ebp;
+	eax = h.eax;
+	eip = h.eip;
+	return true;
+}
+
+//---------------------------------------------------------------------------
+template <class Word>
+const char * BasicMachine<Word>::mnemonic(const instruction & inst) const
+{
+	return (inst.op < OP_NONE) ? opcode_names[inst.op] : Names.str(inst.text[1]);
+}
+
+// Registers by name, labels and anything unusual as written, numbers in
+// the base they were written in
+template <class Word>
+std::string BasicMachine<Word>::operand(const instruction & inst, int k)
+{
+	if (inst.text[k] != 0 && !(inst.op == OP_NONE && k == 1))
+		return Names.str(inst.text[k]);
+
+	bool is_dst = (k == 0 && (inst.op == OP_MOV || inst.op == OP_POP));
+	bool is_src = (k == ((inst.op == OP_MOV) ? 1 : 0) && inst.op != OP_POP && inst.op != OP_RETN);
+	unsigned char r = is_dst ? inst.dst : is_src ? inst.src : (unsigned char)OPND_NONE;
+	if (r < OPND_IMM)
+		return word_traits<Word>::reg_name(r);
+	if (is_src && (inst.flags & INST_IMM))
+		return (inst.flags & INST_HEX) ? decint_to_hexstr(inst.imm) + 'h' : std::to_string((unsigned long long)inst.imm);
+	return "";
+}
+
+template <class Word>
+const char * BasicMachine<Word>::label(size_t idx) const
+{
+	size_t lo = 0;
+	size_t hi = Labels.size();
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (Labels[mid].idx < idx)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < Labels.size() && Labels[lo].idx == idx) ? Names.str(Labels[lo].name) : "";
+}
+
+template <class Word>
+bool BasicMachine<Word>::read_slot(Word addr, Word & value) const
+{
+	// Slot i lives at slot_address(i)
+	Word offset = (Word)0 - addr;
+	Word slot = offset / SLOT_BYTES - 1;
+	if (offset == 0 || offset % SLOT_BYTES != 0 || slot >= Stack.size())
+		return false;
+
+	value = Stack[slot];
+	return true;
+}
+
+template <class Word>
+Word BasicMachine<Word>::to_word(const std::string & str)
+{
+	return (Word)strtoull(str.c_str(), 0, 10);
+}
+
+//---------------------------------------------------------------------------
+template <class Word>
+std::string BasicMachine<Word>::decint_to_hexstr(Word dec)
+{
+	std::stringstream stream;
+	stream << std::hex << dec;
+	return stream.str();
+}
+
+template <class Word>
+std::string BasicMachine<Word>::fill_zeros(std::string str)
+{
+	std::string tmp = "";
+	for (int j = str.size(); j < 4; j++)
+		tmp += "0";
+	tmp += str;
+	return tmp;
+}
+
+template <class Word>
+std::string BasicMachine<Word>::fill_word(std::string str)
+{
+	std::string tmp = "";
+	for (int j = str.size(); j < word_traits<Word>::HEX_DIGITS; j++)
+		tmp += "0";
+	tmp += str;
+	return tmp;
+}
+
+//---------------------------------------------------------------------------
+template class BasicMachine<unsigned int>;
+template class BasicMachine<unsigned long long>;
@@ -0,0 +1,396 @@
+#ifndef __Machine_h_
+#define __Machine_h_
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "../../tinyxml/tinyxml.h"
+#include "Predicate.h"
+#include "AsmLexer.h"
+#include "StringArena.h"
+#include "AddrRope.h"
+#include "CycleDetector.h"
+#include "Diagnostics.h"
+#include "DefUse.h"
+#include "StateExport.h"
+
+//---------------------------------------------------------------------------
+enum opcode { OP_MOV, OP_PUSH, OP_POP, OP_JMP, OP_CALL, OP_RETN, OP_SPAWN, OP_NONE };
+
+// Operands are REG_ESP, REG_EBP, REG_EAX (Predicate.h), or:
+enum { OPND_IMM = REG_COUNT, OPND_NONE };
+
+//---------------------------------------------------------------------------
+// The machine runs with 32-bit or 64-bit registers and stack slots, as
+// BasicMachine<unsigned int> or BasicMachine<unsigned long long>. Both are
+// instantiated in Machine.cpp and compiled separately, so the step loop
+// never asks which one it is. Code addresses and instruction sizes are
+// the same in both; a program runs the same apart from the width.
+template <class Word> struct word_traits;
+
+template <> struct word_traits<unsigned int>
+{
+	enum { HEX_DIGITS = 8 };
+	static const char * reg_name(int r) { static const char * names[] = { "esp", "ebp", "eax", "eip" }; return names[r]; }
+};
+
+// The 32-bit names are read as well, so programs written for one run on both
+template <> struct word_traits<unsigned long long>
+{
+	enum { HEX_DIGITS = 16 };
+	static const char * reg_name(int r) { static const char * names[] = { "rsp", "rbp", "rax", "rip" }; return names[r]; }
+};
+
+// instruction::flags
+enum
+{
+	INST_IMM = 1,		// the source was written as a number
+	INST_HEX = 2,		// ... in hex
+	INST_SYMBOL = 4		// the source is a label, imm holds its address
+};
+
+// One decoded instruction with everything inline; the few strings it
+// needs for display are interned in Machine::Names. Operand 0 is the
+// destination of mov and pop and the source of push, jmp and call;
+// operand 1 is the source of mov; spawn takes its target like jmp.
+template <class Word>
+struct basic_instruction
+{
+	unsigned char op;
+	unsigned char dst;		// mov and pop, OPND_NONE otherwise
+	unsigned char src;		// mov, push, jmp and call: a register or OPND_IMM
+	unsigned char size;
+	unsigned char flags;
+	unsigned short epoch;	// Machine::Epoch when imm was last placed, see relocate
+	Word imm;
+	unsigned int addr;		// see Machine::addressOf once the program has been edited
+	unsigned int text[2];	// operand as written when it is neither a register nor
+							// a number (labels, junk); the mnemonic of OP_NONE in text[1]
+};
+
+// Labels are rare, so they sit beside the instructions instead of in them
+struct label_entry
+{
+	unsigned int idx;
+	unsigned int name;		// all labels of the instruction, ", "-separated
+};
+
+// Pushing beyond this many slots is a stack overflow fault
+static const unsigned int MAX_STACK_SLOTS = 1 << 24;
+// Spawning beyond this many live threads is a fault as well
+static const unsigned int MAX_THREADS = 1 << 16;
+
+// Stops "run" before the instruction at idx when cond holds (or is empty)
+struct breakpoint
+{
+	int idx;			// instruction index, -1 to check on every step
+	Predicate cond;
+};
+
+// Shadow call stack entry, pushed by call and dropped by retn
+template <class Word>
+struct basic_frame
+{
+	int call_idx;			// instruction index of the call
+	Word target;
+	Word esp;				// at entry, pointing at the return address
+	Word ebp;
+	unsigned int depth;		// Stack.size() at entry
+};
+
+// Stops "run" after a write to the stack slot at addr when cond holds (or is empty)
+template <class Word>
+struct basic_watchpoint
+{
+	Word addr;
+	Predicate cond;
+};
+
+// Who wrote a stack slot and when, kept beside every slot
+struct slot_write
+{
+	unsigned long long step;		// Machine::Steps once the write ran, ~0 if not known
+	int idx;						// instruction that wrote it, -1 if not known
+};
+
+// Writes of the last few steps, recorded by the handlers so the panels can
+// highlight what changed without comparing states. A step writes at most
+// one slot, so the ring holds at least the last JOURNAL_SLOTS steps.
+static const unsigned int JOURNAL_SLOTS = 16;		// a power of two
+
+struct write_journal
+{
+	unsigned long long reg[3];				// Machine::Steps once the write ran, ~0 for never
+	unsigned long long when[JOURNAL_SLOTS];
+	unsigned int slot[JOURNAL_SLOTS];		// stack slot index
+	unsigned int next;
+};
+
+// Everything execution depends on, plus the shadow call stack; a run is
+// replayed from one of these to find where it entered a cycle
+template <class Word>
+struct basic_machine_state
+{
+	Word esp;
+	Word ebp;
+	Word eax;
+	Word eip;
+	std::vector<Word> stack;
+	std::vector<slot_write> writes;
+	std::vector<basic_frame<Word> > frames;
+	unsigned long long steps;
+	unsigned long long hash;		// of the stack, see slot_hash
+};
+
+// A guest thread while another one runs. The running thread lives in the
+// machine's own registers, Stack and CallStack, and a context switch
+// swaps it with a parked one, so only vector pointers move
+template <class Word>
+struct basic_guest_thread
+{
+	unsigned int id;
+	Word esp;
+	Word ebp;
+	Word eax;
+	Word eip;
+	std::vector<Word> stack;
+	std::vector<slot_write> writes;
+	std::vector<basic_frame<Word> > frames;
+	int writers[3];			// see RegWriters
+};
+
+template <class Word> struct basic_asm_chunk;
+
+//---------------------------------------------------------------------------
+// Program, registers and stack of the emulated machine, without any Ogre
+// dependency so it also runs in the headless build. The registers keep
+// their 32-bit names in the code whatever Word is.
+template <class Word>
+class BasicMachine
+{
+public:
+	typedef basic_instruction<Word> instruction;
+	typedef basic_frame<Word> frame;
+	typedef basic_watchpoint<Word> watchpoint;
+	typedef basic_machine_state<Word> machine_state;
+	typedef basic_guest_thread<Word> guest_thread;
+	typedef basic_asm_chunk<Word> asm_chunk;
+
+	BasicMachine(void);
+	virtual ~BasicMachine(void);
+
+	void setProgramPath(const std::string & path);
+	bool loadProgram(const std::string & path);
+	bool loadXmlText(const char * text);
+	bool loadAsmText(const char * begin, const char * end);
+	void reset();
+
+	int findInstruction(Word addr);
+	// Instruction an immediate jmp, call or spawn at idx goes to, -1 for
+	// a register operand or an address past the program
+	int targetOf(size_t idx);
+	unsigned int addressOf(size_t idx) const;
+	void refreshAddresses();
+	bool step();
+	unsigned int runInstructions(unsigned int budget);
+	// After a step of a run: a watchpoint, cycle or breakpoint hit, or the
+	// call depth stepOver/stepOut wait for was reached
+	bool shouldStop();
+	bool stepOver();
+	bool stepOut();
+
+	// Steps since register r (REG_ESP, REG_EBP or REG_EAX) or a stack slot
+	// was last written, 0 for the last step; ~0 when not in the journal
+	unsigned long long regAge(int r) const;
+	unsigned long long slotAge(unsigned int slot) const;
+
+	// With cycle detection on, a run that comes back to a state it has
+	// been in stops with BreakReason "entered cycle at step N", N counted
+	// like Steps. Programs that loop forever then end in about twice the
+	// steps it takes them to close the loop instead of at the step limit
+	void setCycleDetection(bool on);
+	bool cycleDetection() const { return DetectCycles; }
+
+	// "spawn target" starts a thread at target with an empty stack of its
+	// own and the spawner's eax. Threads take turns of Quantum steps in
+	// the order they were spawned in; one that runs off the end of the
+	// program is done, and the program ends with the last one. A fault
+	// in any thread stops the machine. Cycle detection sleeps while more
+	// than one thread is alive.
+	//
+	// schedule() picks the thread the next step runs on, rotating after a
+	// quantum, and returns the instruction at its eip, -1 once every
+	// thread has ended; step() calls it, callers only need it to look at
+	// the thread before the step runs
+	int schedule();
+	size_t threadCount() const { return Threads.size() + 1; }
+
+	bool addBreakpoint(const std::string & addr, const std::string & cond, std::string & error);
+	bool addWatchpoint(const std::string & addr, const std::string & cond, std::string & error);
+	void updateBreakAt();
+	void toggleBreakpoint();
+
+	// Registers, call stack, non-zero stack pages and the program hash,
+	// see SNAPSHOT_* in Machine.cpp for the layout
+	bool saveSnapshot(const std::string & path);
+	bool loadSnapshot(const std::string & path);
+	unsigned long long programHash() const;
+
+	// Display text of an instruction, as close to the source as the
+	// decoded form allows
+	const char * mnemonic(const instruction & inst) const;
+	std::string operand(const instruction & inst, int k);
+	const char * label(size_t idx) const;
+
+	// Live editing; text is one .asm instruction without a label. The
+	// instructions after idx move through the rope in O(log n) instead of
+	// being re-addressed; labels, breakpoints, the call stack and eip are
+	// shifted so they stay on the same instructions
+	bool replaceInstruction(size_t idx, const std::string & text, std::string & error);
+	bool insertInstruction(size_t idx, const std::string & text, std::string & error);
+	bool eraseInstruction(size_t idx, std::string & error);
+
+	bool read_slot(Word addr, Word & value) const;
+	// Decimal operand as stored by the loader; out of range wraps like a register would
+	static Word to_word(const std::string & str);
+	// Typed as a Word so address arithmetic wraps at the word width
+	static const Word SLOT_BYTES = sizeof(Word);
+	// Address of stack slot i, -(i + 1) * SLOT_BYTES
+	static Word slot_address(size_t i) { return (Word)0 - (Word)(i + 1) * SLOT_BYTES; }
+
+	std::string decint_to_hexstr(Word dec);
+	std::string fill_zeros(std::string str);
+	// Pads to the digits of a full word, 8 or 16
+	std::string fill_word(std::string str);
+
+	std::vector<Word>			Stack;
+	std::vector<slot_write>		SlotWrites;		// one per slot of Stack
+	// Slots from here up may differ from what a view last drew; the
+	// handlers only ever lower it, the view raises it to Stack.size()
+	// once it has caught up
+	size_t						DirtyFrom;
+	std::vector<instruction>	Instructions;
+	std::vector<label_entry>	Labels;			// ordered by idx
+	StringArena					Names;
+	std::unordered_map<std::string, unsigned int>	Symbols;	// label -> instruction index
+	std::string					ProgramPath;	// .xml or .asm
+	unsigned int				LoadThreads;	// .asm parsing threads, 0 for one per core
+	// int							StackAddr;
+	Word						esp;
+	Word						ebp;
+	Word						eax;
+	Word						eip;
+	unsigned long long			Steps;			// since reset or load
+	int							ExecIdx;		// instruction run by the last step, -1 before one
+	int							RegWriters[3];	// instruction that last wrote esp, ebp and eax, -1 for none
+	unsigned int				Revision;		// of the program, moves on with every load and edit
+	BasicDefUse<Word>			Flow;			// which instructions can have written what, see DefUse.h
+
+	std::vector<frame>			CallStack;
+	int							StopDepth;		// "run" stops once CallStack is this deep, -1 if unused
+	unsigned int				StopThread;		// ... in this thread
+
+	std::vector<breakpoint>		Breakpoints;
+	std::vector<unsigned char>	BreakAt;		// per instruction, set if some breakpoint targets it
+	std::vector<watchpoint>		Watchpoints;
+	unsigned int				ThreadId;		// of the running thread, 0 for the first one
+	std::deque<guest_thread>	Threads;		// parked, in turn order from NextThread on
+	size_t						NextThread;
+	unsigned int				Quantum;		// steps per turn
+
+	Diagnostics *				Diag;			// where handlers report bad operands, 0 for nowhere
+	BasicStateExport<Word> *	Export;			// where runs publish their state, 0 for nowhere
+
+	bool						Running;
+	bool						InRun;			// inside runInstructions, whatever Running says
+	bool						BreakHit;		// set by handlers when a watchpoint fires, and on a cycle
+	std::string					BreakReason;
+
+protected:
+	// Loader errors and warnings; the GUI sends them to the Ogre log
+	virtual void log(const std::string & message);
+
+	static std::string parse_value(std::string value, bool & is_hex);
+	Word hexstr_to_dec(std::string str);
+	bool loadXmlDocument(TiXmlDocument & doc);
+	std::string xml_operand(TiXmlElement * element, const char * name, bool level);
+	static std::string asm_operand(const std::string & token);
+	static void parseAsmChunk(asm_chunk & chunk);
+	bool asm_error(unsigned int line, const std::string & message);
+	bool addLabel(const std::string & name, unsigned int idx);
+	void addInstruction(const std::string & command, const std::string & arg1, const std::string & arg2);
+	static void decodeInstruction(const std::string & command, const std::string & arg1, const std::string & arg2,
+		StringArena & names, instruction & s);
+	bool is_symbol(const std::string & value);
+	bool resolveSymbols();
+	bool parseInstruction(const std::string & text, instruction & s, std::string & error);
+	bool symbolTarget(instruction & inst, unsigned int & idx);
+	void beginEdit();
+	void shiftAddresses(Word from, int delta);
+	void shiftIndices(size_t from, int delta);
+	void relocate(instruction & inst);
+	bool execute();
+	void pushSlot(Word value, int idx);
+	void popSlot();
+	void noteWrite(unsigned char r, int idx);
+	void diagnose(diag_severity severity, diag_id id, int idx, const char * detail);
+	void clearJournal();
+	Word & reg(unsigned char r);
+	Word source(const instruction & inst);
+
+	void loadBreakpoint(TiXmlElement * element);
+	void loadWatchpoint(TiXmlElement * element);
+	bool checkBreakpoints();
+	void checkWatchpoints(Word addr);
+	void unwindCallStack();
+
+	// The stack hash is only kept while armed; anything that changes the
+	// state other than by stepping disarms, and the next step arms again
+	// from there
+	void armCycles();
+	void disarmCycles();
+	void swapState(machine_state & state);
+	bool findCycleEntry(unsigned long long period, unsigned long long & entry);
+
+	void swapThread(guest_thread & t);
+	void switchThread();
+	void exitThread();
+
+	unsigned int				Slice;			// steps of the running thread's turn so far
+	unsigned int				SpawnedThreads;	// ids handed out
+
+	bool						DetectCycles;
+	bool						CycleArmed;
+	bool						CycleFound;		// reported, quiet until disarmed
+	CycleDetector				Cycles;
+	unsigned long long			StackHash;
+	machine_state				CycleStart;		// where the samples began
+
+	// instruction::addr is current below AddrValid; past it, once the
+	// program has been edited, the rope has the addresses
+	size_t						AddrValid;
+	AddrRope					Rope;
+	unsigned short				Epoch;			// bumped whenever an edit moves code
+	write_journal				Journal;
+
+	void inst_mov(int idx);
+	void inst_push(int idx);
+	void inst_pop(int idx);
+	void inst_jmp(int idx);
+	void inst_call(int idx);
+	void inst_retn(int idx);
+	void inst_spawn(int idx);
+};
+
+typedef BasicMachine<unsigned int> Machine;
+typedef BasicMachine<unsigned long long> Machine64;
+
+// The 32-bit types, which the GUI and BatchMachine work with
+typedef basic_instruction<unsigned int> instruction;
+typedef basic_frame<unsigned int> frame;
+typedef basic_watchpoint<unsigned int> watchpoint;
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __Machine_h_
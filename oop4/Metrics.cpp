@@ -0,0 +1,189 @@
+#include "Metrics.h"
+
+#include <cstring>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <chrono>
+#endif
+
+#ifdef OOP5_COUNT_ALLOCS
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Counting every operator new of the process; new[] and delete[] forward here
+static std::atomic<unsigned long long> alloc_count(0);
+
+void * operator new(size_t size)
+{
+	alloc_count.fetch_add(1, std::memory_order_relaxed);
+	void * p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void * p) throw()
+{
+	free(p);
+}
+
+static unsigned long long allocation_count()
+{
+	return alloc_count.load(std::memory_order_relaxed);
+}
+#else
+static unsigned long long allocation_count()
+{
+	return 0;
+}
+#endif
+
+static const char * metric_names[METRIC_COUNT] =
+{
+	"steps", "allocs", "interpret", "print_code", "print_reg", "print_stack", "load", "frame"
+};
+
+//---------------------------------------------------------------------------
+Metrics::Metrics(void)
+	: WindowStart(now()),
+	Allocs(allocation_count()),
+	Interval(1.0),
+	LastSeconds(0),
+	Export(0),
+	Csv(false)
+{
+	memset(Current, 0, sizeof(Current));
+	memset(Last, 0, sizeof(Last));
+}
+
+Metrics::~Metrics(void)
+{
+	if (Export)
+		fclose(Export);
+}
+
+// VC11's steady_clock and high_resolution_clock are system_clock, which
+// ticks in 100 ns and follows clock adjustments; the performance counter
+// does neither
+unsigned long long Metrics::now()
+{
+#if defined(_WIN32)
+	static LARGE_INTEGER frequency = { 0 };
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+
+	// Whole seconds apart so the scaling does not overflow 64 bits
+	unsigned long long ticks = counter.QuadPart;
+	unsigned long long hz = frequency.QuadPart;
+	return ticks / hz * 1000000000ull + ticks % hz * 1000000000ull / hz;
+#else
+	using namespace std::chrono;
+	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void Metrics::addTime(metric_id id, unsigned long long ns)
+{
+	metric_window & w = Current[id];
+	++w.count;
+	w.ns += ns;
+	if (ns > w.max_ns)
+		w.max_ns = ns;
+}
+
+const char * Metrics::name(metric_id id)
+{
+	return metric_names[id];
+}
+
+//---------------------------------------------------------------------------
+bool Metrics::setExport(const std::string & path)
+{
+	if (Export)
+		fclose(Export);
+
+	Csv = path.size() > 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+	Export = fopen(path.c_str(), "w");
+	if (!Export)
+		return false;
+
+	if (Csv)
+	{
+		fprintf(Export, "seconds,%s,%s", metric_names[METRIC_STEPS], metric_names[METRIC_ALLOCS]);
+		for (int id = METRIC_INTERPRET; id < METRIC_COUNT; ++id)
+			fprintf(Export, ",%s_calls,%s_ms,%s_max_ms", metric_names[id], metric_names[id], metric_names[id]);
+		fprintf(Export, "\n");
+	}
+	return true;
+}
+
+bool Metrics::tick()
+{
+	unsigned long long t = now();
+	double seconds = (t - WindowStart) * 1e-9;
+	if (seconds < Interval)
+		return false;
+
+	unsigned long long allocs = allocation_count();
+	Current[METRIC_ALLOCS].count = allocs - Allocs;
+	memcpy(Last, Current, sizeof(Last));
+	memset(Current, 0, sizeof(Current));
+	LastSeconds = seconds;
+	WindowStart = t;
+	Allocs = allocs;
+
+	if (Export)
+		exportWindow();
+	return true;
+}
+
+void Metrics::exportWindow()
+{
+	if (Csv)
+	{
+		fprintf(Export, "%.3f,%llu,%llu", LastSeconds, Last[METRIC_STEPS].count, Last[METRIC_ALLOCS].count);
+		for (int id = METRIC_INTERPRET; id < METRIC_COUNT; ++id)
+			fprintf(Export, ",%llu,%.3f,%.3f", Last[id].count, Last[id].ns * 1e-6, Last[id].max_ns * 1e-6);
+	}
+	else
+	{
+		fprintf(Export, "{\"seconds\":%.3f,\"%s\":%llu,\"%s\":%llu", LastSeconds,
+			metric_names[METRIC_STEPS], Last[METRIC_STEPS].count, metric_names[METRIC_ALLOCS], Last[METRIC_ALLOCS].count);
+		for (int id = METRIC_INTERPRET; id < METRIC_COUNT; ++id)
+			fprintf(Export, ",\"%s\":{\"calls\":%llu,\"ms\":%.3f,\"max_ms\":%.3f}",
+				metric_names[id], Last[id].count, Last[id].ns * 1e-6, Last[id].max_ns * 1e-6);
+		fprintf(Export, "}");
+	}
+	fprintf(Export, "\n");
+	fflush(Export);
+}
+
+// Panel text for the last window: rates for counters, average and worst
+// call plus share of wall time for timers
+std::string Metrics::format(metric_id id) const
+{
+	char buf[64];
+	const metric_window & w = Last[id];
+	double seconds = (LastSeconds > 0) ? LastSeconds : 1;
+
+	if (id == METRIC_STEPS)
+		sprintf(buf, "%.2f M/s", w.count / seconds * 1e-6);
+	else if (id == METRIC_ALLOCS)
+	{
+#ifdef OOP5_COUNT_ALLOCS
+		sprintf(buf, "%.0f /s", w.count / seconds);
+#else
+		strcpy(buf, "not counted");
+#endif
+	}
+	else if (w.count == 0)
+		strcpy(buf, "-");
+	else
+		sprintf(buf, "%.3f / %.3f ms, %.1f%%", w.ns * 1e-6 / w.count, w.max_ns * 1e-6, w.ns * 1e-7 / seconds);
+	return buf;
+}
@@ -0,0 +1,87 @@
+#ifndef __Metrics_h_
+#define __Metrics_h_
+
+#include <cstdio>
+#include <string>
+
+//---------------------------------------------------------------------------
+enum metric_id
+{
+	METRIC_STEPS = 0,		// counter: instructions executed
+	METRIC_ALLOCS,			// counter: operator new calls, with OOP5_COUNT_ALLOCS
+	METRIC_INTERPRET,		// timers from here on
+	METRIC_PRINT_CODE,
+	METRIC_PRINT_REG,
+	METRIC_PRINT_STACK,
+	METRIC_LOAD,
+	METRIC_FRAME,
+	METRIC_COUNT
+};
+
+// Totals over one window; for counters ns stays 0
+struct metric_window
+{
+	unsigned long long count;		// timer: calls, counter: sum
+	unsigned long long ns;
+	unsigned long long max_ns;
+};
+
+//---------------------------------------------------------------------------
+// Counters and timers summed into fixed slots, so recording is a couple of
+// additions. tick() closes a window every Interval seconds; the closed
+// window feeds the panel and, if set, one line of the export file.
+class Metrics
+{
+public:
+	Metrics(void);
+	~Metrics(void);
+
+	void add(metric_id id, unsigned long long n) { Current[id].count += n; }
+	void addTime(metric_id id, unsigned long long ns);
+	static unsigned long long now();		// ns, monotonic
+
+	// .csv gets a header and one row per window, anything else one JSON
+	// object per line
+	bool setExport(const std::string & path);
+	void setInterval(double seconds) { Interval = seconds; }
+	bool tick();
+
+	const metric_window & last(metric_id id) const { return Last[id]; }
+	double lastSeconds() const { return LastSeconds; }
+	std::string format(metric_id id) const;
+	static const char * name(metric_id id);
+
+private:
+	Metrics(const Metrics &);
+	Metrics & operator=(const Metrics &);
+
+	void exportWindow();
+
+	metric_window		Current[METRIC_COUNT];
+	metric_window		Last[METRIC_COUNT];
+	unsigned long long	WindowStart;
+	unsigned long long	Allocs;			// allocation_count() at WindowStart
+	double				Interval;
+	double				LastSeconds;
+	FILE *				Export;
+	bool				Csv;
+};
+
+// Adds the time until the end of the scope to a timer
+class ScopedTimer
+{
+public:
+	ScopedTimer(Metrics & metrics, metric_id id) : M(metrics), Id(id), Start(Metrics::now()) {}
+	~ScopedTimer() { M.addTime(Id, Metrics::now() - Start); }
+
+private:
+	ScopedTimer & operator=(const ScopedTimer &);
+
+	Metrics &			M;
+	metric_id			Id;
+	unsigned long long	Start;
+};
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __Metrics_h_
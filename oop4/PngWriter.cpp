@@ -0,0 +1,250 @@
+#include "PngWriter.h"
+
+#include <algorithm>
+#include <cstdio>
+
+//---------------------------------------------------------------------------
+// Deflate, RFC 1951, with the fixed codes of block type 1
+static const unsigned int MIN_MATCH = 3;
+static const unsigned int MAX_MATCH = 258;
+static const unsigned int WINDOW = 32768;
+static const unsigned int HASH_BITS = 15;
+
+static const unsigned short length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const unsigned char length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const unsigned short dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const unsigned char dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Deflate sends bits least significant first, Huffman codes most
+// significant first, so the codes are stored reversed
+static unsigned int reverse_bits(unsigned int code, unsigned int len)
+{
+	unsigned int r = 0;
+	for (unsigned int i = 0; i < len; ++i, code >>= 1)
+		r = (r << 1) | (code & 1);
+	return r;
+}
+
+struct bit_writer
+{
+	std::vector<unsigned char> &	out;
+	unsigned long long				bits;
+	unsigned int					count;
+
+	bit_writer(std::vector<unsigned char> & o) : out(o), bits(0), count(0) {}
+
+	void put(unsigned int value, unsigned int n)
+	{
+		bits |= (unsigned long long)value << count;
+		count += n;
+		while (count >= 8)
+		{
+			out.push_back((unsigned char)bits);
+			bits >>= 8;
+			count -= 8;
+		}
+	}
+
+	void flush()
+	{
+		if (count > 0)
+			out.push_back((unsigned char)bits);
+		bits = 0;
+		count = 0;
+	}
+};
+
+static unsigned int hash3(const unsigned char * p)
+{
+	return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// One final block; the tables are built per call, a few hundred entries,
+// so nothing is shared between threads
+static void deflate_fixed(std::vector<unsigned char> & out, const unsigned char * p, size_t n)
+{
+	unsigned short code[288];
+	unsigned char bits[288];
+	for (unsigned int s = 0; s < 288; ++s)
+	{
+		unsigned int c, len;
+		if (s < 144) { c = 0x30 + s; len = 8; }
+		else if (s < 256) { c = 0x190 + s - 144; len = 9; }
+		else if (s < 280) { c = s - 256; len = 7; }
+		else { c = 0xC0 + s - 280; len = 8; }
+		code[s] = (unsigned short)reverse_bits(c, len);
+		bits[s] = (unsigned char)len;
+	}
+	unsigned char length_code[MAX_MATCH + 1];
+	for (unsigned int k = 0; k < 29; ++k)
+		for (unsigned int len = length_base[k]; len <= MAX_MATCH && (k == 28 || len < length_base[k + 1]); ++len)
+			length_code[len] = (unsigned char)k;
+
+	bit_writer w(out);
+	w.put(1, 1);		// BFINAL
+	w.put(1, 2);		// BTYPE 01, fixed codes
+
+	std::vector<int> head((size_t)1 << HASH_BITS, -1);
+	size_t i = 0;
+	while (i < n)
+	{
+		size_t best = 0;
+		size_t dist = 0;
+		if (i + MIN_MATCH <= n)
+		{
+			unsigned int h = hash3(p + i);
+			int cand = head[h];
+			head[h] = (int)i;
+			if (cand >= 0 && i - cand <= WINDOW)
+			{
+				size_t limit = std::min((size_t)MAX_MATCH, n - i);
+				size_t k = 0;
+				while (k < limit && p[cand + k] == p[i + k])
+					++k;
+				if (k >= MIN_MATCH)
+				{
+					best = k;
+					dist = i - cand;
+				}
+			}
+		}
+
+		if (best == 0)
+		{
+			w.put(code[p[i]], bits[p[i]]);
+			++i;
+			continue;
+		}
+
+		unsigned int lc = length_code[best];
+		w.put(code[257 + lc], bits[257 + lc]);
+		w.put((unsigned int)(best - length_base[lc]), length_extra[lc]);
+		unsigned int dc = (unsigned int)(std::upper_bound(dist_base, dist_base + 30, dist) - dist_base) - 1;
+		w.put(reverse_bits(dc, 5), 5);
+		w.put((unsigned int)(dist - dist_base[dc]), dist_extra[dc]);
+
+		// The positions inside the match are indexed too, so a run finds
+		// itself one step back
+		for (size_t k = 1; k < best && i + k + MIN_MATCH <= n; ++k)
+			head[hash3(p + i + k)] = (int)(i + k);
+		i += best;
+	}
+
+	w.put(code[256], bits[256]);
+	w.flush();
+}
+
+//---------------------------------------------------------------------------
+static void put_u32(std::vector<unsigned char> & out, unsigned int v)
+{
+	out.push_back((unsigned char)(v >> 24));
+	out.push_back((unsigned char)(v >> 16));
+	out.push_back((unsigned char)(v >> 8));
+	out.push_back((unsigned char)v);
+}
+
+static unsigned int adler32(const unsigned char * p, size_t n)
+{
+	unsigned int a = 1;
+	unsigned int b = 0;
+	while (n > 0)
+	{
+		// 5552 bytes keep b below 2^32 between reductions
+		size_t k = std::min(n, (size_t)5552);
+		n -= k;
+		for (; k > 0; --k)
+		{
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return b << 16 | a;
+}
+
+// Length, type, data and the CRC of type and data; data is already in
+// out, starting at start
+static void end_chunk(std::vector<unsigned char> & out, size_t start, const unsigned int * crc_table)
+{
+	size_t len = out.size() - start - 4;
+	out[start - 4] = (unsigned char)(len >> 24);
+	out[start - 3] = (unsigned char)(len >> 16);
+	out[start - 2] = (unsigned char)(len >> 8);
+	out[start - 1] = (unsigned char)len;
+
+	unsigned int crc = 0xFFFFFFFFu;
+	for (size_t i = start; i < out.size(); ++i)
+		crc = crc_table[(crc ^ out[i]) & 0xFF] ^ (crc >> 8);
+	put_u32(out, crc ^ 0xFFFFFFFFu);
+}
+
+static size_t begin_chunk(std::vector<unsigned char> & out, const char * type)
+{
+	put_u32(out, 0);
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	return start;
+}
+
+void encode_png(std::vector<unsigned char> & out, const unsigned char * pixels,
+	unsigned int width, unsigned int height, unsigned int channels, size_t stride)
+{
+	unsigned int crc_table[256];
+	for (unsigned int n = 0; n < 256; ++n)
+	{
+		unsigned int c = n;
+		for (int k = 0; k < 8; ++k)
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		crc_table[n] = c;
+	}
+
+	// Filter type 0 on every row; the matcher takes care of repeats
+	size_t row = (size_t)width * channels;
+	std::vector<unsigned char> raw((row + 1) * height);
+	for (unsigned int y = 0; y < height; ++y)
+	{
+		raw[y * (row + 1)] = 0;
+		std::copy(pixels + y * stride, pixels + y * stride + row, raw.begin() + y * (row + 1) + 1);
+	}
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	out.assign(signature, signature + 8);
+
+	size_t start = begin_chunk(out, "IHDR");
+	put_u32(out, width);
+	put_u32(out, height);
+	out.push_back(8);							// bit depth
+	out.push_back((channels == 4) ? 6 : 2);		// RGBA or RGB
+	out.push_back(0);							// deflate
+	out.push_back(0);							// adaptive filters
+	out.push_back(0);							// not interlaced
+	end_chunk(out, start, crc_table);
+
+	start = begin_chunk(out, "IDAT");
+	out.push_back(0x78);						// zlib, 32K window
+	out.push_back(0x01);
+	deflate_fixed(out, raw.empty() ? 0 : &raw[0], raw.size());
+	put_u32(out, adler32(raw.empty() ? 0 : &raw[0], raw.size()));
+	end_chunk(out, start, crc_table);
+
+	start = begin_chunk(out, "IEND");
+	end_chunk(out, start, crc_table);
+}
+
+bool write_png(const std::string & path, const unsigned char * pixels,
+	unsigned int width, unsigned int height, unsigned int channels, size_t stride,
+	std::vector<unsigned char> & scratch)
+{
+	encode_png(scratch, pixels, width, height, channels, stride);
+
+	FILE * f = fopen(path.c_str(), "wb");
+	bool ok = f && fwrite(&scratch[0], 1, scratch.size(), f) == scratch.size();
+	if (f && fclose(f) != 0)
+		ok = false;
+	return ok;
+}
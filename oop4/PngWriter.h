@@ -0,0 +1,25 @@
+#ifndef __PngWriter_h_
+#define __PngWriter_h_
+
+#include <string>
+#include <vector>
+
+//---------------------------------------------------------------------------
+// 8-bit RGB (channels 3) or RGBA (channels 4) rows, top row first, as a
+// PNG in out. The pixels are deflated with the fixed Huffman codes and a
+// one-candidate LZ77 match finder: no zlib needed, and screen captures,
+// which are mostly runs of one colour, still shrink many times over.
+// Plain functions on caller memory, so any number of threads can encode
+// at once.
+void encode_png(std::vector<unsigned char> & out, const unsigned char * pixels,
+	unsigned int width, unsigned int height, unsigned int channels, size_t stride);
+
+// encode_png into a scratch buffer and one fwrite; false if the file
+// cannot be written
+bool write_png(const std::string & path, const unsigned char * pixels,
+	unsigned int width, unsigned int height, unsigned int channels, size_t stride,
+	std::vector<unsigned char> & scratch);
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __PngWriter_h_
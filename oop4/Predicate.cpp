@@ -0,0 +1,321 @@
+#include "Predicate.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+static const unsigned int MAX_PRED_DEPTH = 32;
+
+//---------------------------------------------------------------------------
+Predicate::Predicate(void)
+	: Pos(0),
+	CurDepth(0),
+	Depth(0),
+	Nesting(0)
+{
+}
+
+//---------------------------------------------------------------------------
+template <class Word>
+bool Predicate::parse_number(const std::string & str, Word & value)
+{
+	if (str.empty() || !isdigit((unsigned char)str[0]))
+		return false;
+
+	std::string digits = str;
+	int base = 10;
+	if (digits.size() > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X'))
+	{
+		digits = digits.substr(2);
+		base = 16;
+	}
+	else if (digits[digits.size() - 1] == 'h' || digits[digits.size() - 1] == 'H')
+	{
+		digits.pop_back();
+		base = 16;
+	}
+
+	if (digits.empty())
+		return false;
+
+	char * end = 0;
+	value = (Word)strtoull(digits.c_str(), &end, base);
+	return *end == '\0';
+}
+
+template bool Predicate::parse_number<unsigned int>(const std::string & str, unsigned int & value);
+template bool Predicate::parse_number<unsigned long long>(const std::string & str, unsigned long long & value);
+
+int Predicate::parse_register(const std::string & name)
+{
+	std::string reg;
+	for (size_t i = 0; i < name.size(); ++i)
+		reg += (char)tolower((unsigned char)name[i]);
+
+	if (reg == "esp" || reg == "rsp") return REG_ESP;
+	if (reg == "ebp" || reg == "rbp") return REG_EBP;
+	if (reg == "eax" || reg == "rax") return REG_EAX;
+	if (reg == "eip" || reg == "rip") return REG_EIP;
+	return REG_COUNT;
+}
+
+//---------------------------------------------------------------------------
+bool Predicate::compile(const std::string & source, std::string & error)
+{
+	Code.clear();
+	Source = source;
+	Error = "";
+	Pos = 0;
+	CurDepth = 0;
+	Depth = 0;
+	Nesting = 0;
+
+	bool ok = parse_or();
+	skip_spaces();
+	if (ok && Pos != Source.size())
+	{
+		Error = "unexpected '" + Source.substr(Pos, 1) + "'";
+		ok = false;
+	}
+	if (ok && Depth > MAX_PRED_DEPTH)
+	{
+		Error = "expression is too deep";
+		ok = false;
+	}
+
+	if (!ok)
+	{
+		Code.clear();
+		error = Error + " in \"" + Source + "\"";
+	}
+	return ok;
+}
+
+void Predicate::skip_spaces()
+{
+	while (Pos < Source.size() && isspace((unsigned char)Source[Pos]))
+		++Pos;
+}
+
+bool Predicate::accept(const char * token)
+{
+	skip_spaces();
+	size_t len = strlen(token);
+	if (Source.compare(Pos, len, token) != 0)
+		return false;
+	Pos += len;
+	return true;
+}
+
+void Predicate::emit(unsigned char op, unsigned long long arg)
+{
+	pred_inst inst;
+	inst.op = op;
+	inst.arg = arg;
+	Code.push_back(inst);
+
+	// Track the operand stack depth so eval can use a fixed array
+	if (op == P_IMM || op == P_REG)
+		++CurDepth;
+	else if (op != P_LOAD && op != P_NEG && op != P_NOT)
+		--CurDepth;
+	if (CurDepth > Depth)
+		Depth = CurDepth;
+}
+
+// Brackets and prefix operators recurse; the parser stops at
+// MAX_PRED_DEPTH levels rather than run out of stack on "((((..."
+bool Predicate::nest()
+{
+	if (++Nesting > MAX_PRED_DEPTH)
+	{
+		Error = "expression is too deep";
+		return false;
+	}
+	return true;
+}
+
+bool Predicate::parse_or()
+{
+	if (!parse_and())
+		return false;
+	while (accept("||"))
+	{
+		if (!parse_and())
+			return false;
+		emit(P_OR);
+	}
+	return true;
+}
+
+bool Predicate::parse_and()
+{
+	if (!parse_cmp())
+		return false;
+	while (accept("&&"))
+	{
+		if (!parse_cmp())
+			return false;
+		emit(P_AND);
+	}
+	return true;
+}
+
+bool Predicate::parse_cmp()
+{
+	if (!parse_sum())
+		return false;
+
+	unsigned char op;
+	if (accept("==")) op = P_EQ;
+	else if (accept("!=")) op = P_NE;
+	else if (accept("<=")) op = P_LE;
+	else if (accept(">=")) op = P_GE;
+	else if (accept("<")) op = P_LT;
+	else if (accept(">")) op = P_GT;
+	else return true;
+
+	if (!parse_sum())
+		return false;
+	emit(op);
+	return true;
+}
+
+bool Predicate::parse_sum()
+{
+	if (!parse_unary())
+		return false;
+	for (;;)
+	{
+		unsigned char op;
+		if (accept("+")) op = P_ADD;
+		else if (accept("-")) op = P_SUB;
+		else return true;
+
+		if (!parse_unary())
+			return false;
+		emit(op);
+	}
+}
+
+bool Predicate::parse_unary()
+{
+	if (accept("!"))
+	{
+		if (!nest() || !parse_unary())
+			return false;
+		--Nesting;
+		emit(P_NOT);
+		return true;
+	}
+	if (accept("-"))
+	{
+		if (!nest() || !parse_unary())
+			return false;
+		--Nesting;
+		emit(P_NEG);
+		return true;
+	}
+	return parse_primary();
+}
+
+bool Predicate::parse_primary()
+{
+	if (accept("("))
+	{
+		if (!nest() || !parse_or())
+			return false;
+		--Nesting;
+		if (!accept(")"))
+		{
+			Error = "missing ')'";
+			return false;
+		}
+		return true;
+	}
+	if (accept("["))
+	{
+		if (!nest() || !parse_or())
+			return false;
+		--Nesting;
+		if (!accept("]"))
+		{
+			Error = "missing ']'";
+			return false;
+		}
+		emit(P_LOAD);
+		return true;
+	}
+
+	skip_spaces();
+	size_t start = Pos;
+	while (Pos < Source.size() && isalnum((unsigned char)Source[Pos]))
+		++Pos;
+	std::string word = Source.substr(start, Pos - start);
+
+	if (word.empty())
+	{
+		Error = (Pos < Source.size()) ? "unexpected '" + Source.substr(Pos, 1) + "'" : "unexpected end";
+		return false;
+	}
+
+	unsigned long long value;
+	int reg = parse_register(word);
+	if (reg != REG_COUNT)
+		emit(P_REG, reg);
+	else if (parse_number(word, value))
+		emit(P_IMM, value);
+	else
+	{
+		Error = "unknown operand '" + word + "'";
+		return false;
+	}
+	return true;
+}
+
+//---------------------------------------------------------------------------
+template <class Word>
+bool Predicate::eval(const Word * regs, const std::vector<Word> & stack) const
+{
+	Word st[MAX_PRED_DEPTH];
+	int top = -1;
+
+	for (size_t i = 0; i < Code.size(); ++i)
+	{
+		const pred_inst & inst = Code[i];
+		switch (inst.op)
+		{
+		case P_IMM:
+			st[++top] = (Word)inst.arg;
+			break;
+		case P_REG:
+			st[++top] = regs[inst.arg];
+			break;
+		case P_LOAD:
+		{
+			// Slot i lives at address -(i + 1) * sizeof(Word)
+			Word offset = (Word)0 - st[top];
+			Word slot = offset / (Word)sizeof(Word) - 1;
+			st[top] = (offset != 0 && offset % (Word)sizeof(Word) == 0 && slot < stack.size()) ? stack[slot] : 0;
+			break;
+		}
+		case P_NEG: st[top] = (Word)0 - st[top]; break;
+		case P_NOT: st[top] = !st[top]; break;
+		case P_ADD: --top; st[top] = st[top] + st[top + 1]; break;
+		case P_SUB: --top; st[top] = st[top] - st[top + 1]; break;
+		case P_EQ: --top; st[top] = st[top] == st[top + 1]; break;
+		case P_NE: --top; st[top] = st[top] != st[top + 1]; break;
+		case P_LT: --top; st[top] = st[top] < st[top + 1]; break;
+		case P_LE: --top; st[top] = st[top] <= st[top + 1]; break;
+		case P_GT: --top; st[top] = st[top] > st[top + 1]; break;
+		case P_GE: --top; st[top] = st[top] >= st[top + 1]; break;
+		case P_AND: --top; st[top] = st[top] && st[top + 1]; break;
+		case P_OR: --top; st[top] = st[top] || st[top + 1]; break;
+		}
+	}
+
+	return top >= 0 && st[top] != 0;
+}
+
+template bool Predicate::eval<unsigned int>(const unsigned int * regs, const std::vector<unsigned int> & stack) const;
+template bool Predicate::eval<unsigned long long>(const unsigned long long * regs, const std::vector<unsigned long long> & stack) const;
@@ -0,0 +1,94 @@
+#ifndef __Predicate_h_
+#define __Predicate_h_
+
+#include <string>
+#include <vector>
+
+//---------------------------------------------------------------------------
+// Register indices shared by the predicate program and the machine
+enum reg_index
+{
+	REG_ESP = 0,
+	REG_EBP,
+	REG_EAX,
+	REG_EIP,
+	REG_COUNT
+};
+
+// Opcodes of the predicate program (a tiny stack machine)
+enum pred_op
+{
+	P_IMM,		// push arg
+	P_REG,		// push regs[arg]
+	P_LOAD,		// pop address, push stack slot at that address (0 if not mapped)
+	P_ADD,
+	P_SUB,
+	P_NEG,
+	P_NOT,
+	P_EQ,
+	P_NE,
+	P_LT,
+	P_LE,
+	P_GT,
+	P_GE,
+	P_AND,
+	P_OR
+};
+
+struct pred_inst
+{
+	unsigned char op;
+	unsigned long long arg;		// numbers are cut to the word width by eval
+};
+
+//---------------------------------------------------------------------------
+// Condition like "eax == 145B8h && esp < 0xFFFFFF00" parsed once and
+// evaluated in the step loop without touching strings
+class Predicate
+{
+public:
+	Predicate(void);
+
+	// Returns false and fills error on a syntax error
+	bool compile(const std::string & source, std::string & error);
+	// Word is the register width of the machine, unsigned int or unsigned
+	// long long; both are instantiated in Predicate.cpp
+	template <class Word>
+	bool eval(const Word * regs, const std::vector<Word> & stack) const;
+
+	bool empty() const { return Code.empty(); }
+	const std::string & source() const { return Source; }
+
+	// Parses "123", "0x7B" or "7Bh"; returns false if str is not a number
+	// and wraps values too wide for Word
+	template <class Word>
+	static bool parse_number(const std::string & str, Word & value);
+	// Returns REG_COUNT if name is not a register; rax and the other 64-bit
+	// names are the same registers as eax and co
+	static int parse_register(const std::string & name);
+
+private:
+	bool parse_or();
+	bool parse_and();
+	bool parse_cmp();
+	bool parse_sum();
+	bool parse_unary();
+	bool parse_primary();
+
+	bool nest();
+	void skip_spaces();
+	bool accept(const char * token);
+	void emit(unsigned char op, unsigned long long arg = 0);
+
+	std::vector<pred_inst>	Code;
+	std::string				Source;
+	std::string				Error;
+	size_t					Pos;
+	unsigned int			CurDepth;	// operand stack depth after the last emit
+	unsigned int			Depth;		// max operand stack depth
+	unsigned int			Nesting;	// brackets and prefix operators the parser is inside
+};
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __Predicate_h_
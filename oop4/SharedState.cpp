@@ -0,0 +1,193 @@
+#include "SharedState.h"
+
+#include <cerrno>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//---------------------------------------------------------------------------
+SharedRegion::SharedRegion(void)
+	: Data(0),
+	Size(0),
+	Owner(false)
+#if defined(_WIN32)
+	, Mapping(0)
+#endif
+{
+}
+
+SharedRegion::~SharedRegion(void)
+{
+	close();
+}
+
+bool SharedRegion::open(const std::string & name, size_t size, bool create, std::string & error)
+{
+	close();
+
+#if defined(_WIN32)
+	// Kernel object names take no leading slash
+	std::string object = "Local\\" + name.substr(name.compare(0, 1, "/") == 0 ? 1 : 0);
+	if (create)
+		Mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE, 0, (DWORD)size, object.c_str());
+	else
+		Mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, object.c_str());
+	if (!Mapping)
+	{
+		error = "cannot open shared memory " + name;
+		return false;
+	}
+	Data = MapViewOfFile(Mapping, create ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, create ? size : 0);
+	if (!Data)
+	{
+		CloseHandle(Mapping);
+		Mapping = 0;
+		error = "cannot map shared memory " + name;
+		return false;
+	}
+	if (!create)
+	{
+		MEMORY_BASIC_INFORMATION info;
+		VirtualQuery(Data, &info, sizeof(info));
+		size = info.RegionSize;
+	}
+#else
+	// A region left behind by a writer that died would keep its old size
+	if (create)
+		shm_unlink(name.c_str());
+	int fd = shm_open(name.c_str(), create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDONLY, 0644);
+	if (fd < 0)
+	{
+		error = "cannot open shared memory " + name + ": " + strerror(errno);
+		return false;
+	}
+
+	struct stat st;
+	if (create ? ftruncate(fd, size) != 0 : fstat(fd, &st) != 0)
+	{
+		error = "cannot size shared memory " + name + ": " + strerror(errno);
+		::close(fd);
+		if (create)
+			shm_unlink(name.c_str());
+		return false;
+	}
+	if (!create)
+		size = (size_t)st.st_size;
+
+	void * data = (size == 0) ? MAP_FAILED
+		: mmap(0, size, create ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED)
+	{
+		error = "cannot map shared memory " + name;
+		if (create)
+			shm_unlink(name.c_str());
+		return false;
+	}
+	Data = data;
+#endif
+
+	Name = name;
+	Size = size;
+	Owner = create;
+	return true;
+}
+
+void SharedRegion::close()
+{
+	if (!Data)
+		return;
+
+#if defined(_WIN32)
+	UnmapViewOfFile(Data);
+	CloseHandle(Mapping);
+	Mapping = 0;
+#else
+	munmap(Data, Size);
+	if (Owner)
+		shm_unlink(Name.c_str());
+#endif
+	Data = 0;
+	Size = 0;
+	Owner = false;
+}
+
+//---------------------------------------------------------------------------
+SharedStateReader::SharedStateReader(void)
+	: Header(0),
+	Slots(0)
+{
+}
+
+bool SharedStateReader::open(const std::string & name, std::string & error)
+{
+	close();
+	if (!Region.open(name, 0, false, error))
+		return false;
+
+	const shared_state_header * h = (const shared_state_header *)Region.data();
+	if (Region.size() < sizeof(shared_state_header) || h->magic != SHARED_STATE_MAGIC
+		|| h->version != SHARED_STATE_VERSION
+		|| Region.size() < sizeof(shared_state_header) + h->window * sizeof(unsigned long long))
+	{
+		error = "shared memory " + name + " does not hold a machine state";
+		Region.close();
+		return false;
+	}
+
+	Header = h;
+	Slots = (const unsigned long long *)(h + 1);
+	return true;
+}
+
+unsigned int SharedStateReader::sequence() const
+{
+	return Header ? Header->seq.load(std::memory_order_acquire) : 0;
+}
+
+// The copy may race with the writer; the second look at seq tells whether
+// it did, and the fence keeps the copy from moving past that look
+bool SharedStateReader::read(shared_state & state, unsigned int tries)
+{
+	if (!Header)
+		return false;
+
+	for (unsigned int attempt = 0; attempt < tries; ++attempt)
+	{
+		unsigned int seq = Header->seq.load(std::memory_order_acquire);
+		if (seq & 1)
+			continue;
+
+		state.running = Header->running != 0;
+		state.steps = Header->steps;
+		state.esp = Header->esp;
+		state.ebp = Header->ebp;
+		state.eax = Header->eax;
+		state.eip = Header->eip;
+		state.depth = Header->depth;
+		state.thread = Header->thread;
+		state.threads = Header->threads;
+		unsigned int count = Header->count;
+		if (count > Header->window)
+			continue;
+		state.slots.resize(count);
+		if (count)
+			memcpy(&state.slots[0], Slots, count * sizeof(unsigned long long));
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (Header->seq.load(std::memory_order_relaxed) != seq)
+			continue;
+
+		state.seq = seq;
+		state.word_bytes = Header->word_bytes;
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,124 @@
+#ifndef __SharedState_h_
+#define __SharedState_h_
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+//---------------------------------------------------------------------------
+// Layout of the shared-memory region StateExport publishes the machine
+// into, and the reader side of it. Nothing here needs the machine, so
+// external tools only build SharedState.cpp.
+//
+// The region is a shared_state_header followed by window slots, each an
+// unsigned long long whatever the word width, the top of the stack first.
+// Everything after seq is written under a seqlock: seq is odd while the
+// writer is in the middle of an update, and a reader that sees the same
+// even seq before and after its copy has a consistent state. The writer
+// never waits for readers, and readers never write to the region.
+static const unsigned int SHARED_STATE_MAGIC = 0x35504f4f;		// "OOP5"
+static const unsigned int SHARED_STATE_VERSION = 1;
+static const unsigned int SHARED_STATE_WINDOW = 256;			// slots published by default
+static const char * const SHARED_STATE_NAME = "/oop5-state";
+
+struct shared_state_header
+{
+	// Set once when the region is created
+	unsigned int magic;
+	unsigned int version;
+	unsigned int word_bytes;		// 4 for Machine, 8 for Machine64
+	unsigned int window;			// slots the region has room for
+
+	std::atomic<unsigned int> seq;
+	unsigned int running;			// 1 while a run is in progress
+
+	unsigned long long steps;		// Machine::Steps
+	unsigned long long esp;
+	unsigned long long ebp;
+	unsigned long long eax;
+	unsigned long long eip;
+	unsigned long long depth;		// slots on the stack of the running thread
+	unsigned int count;				// of them in the window, the top ones
+	unsigned int thread;			// id of the running thread
+	unsigned int threads;			// alive
+	unsigned int pad;
+};
+
+// What a reader gets out of one consistent read
+struct shared_state
+{
+	shared_state() : seq(0), word_bytes(0), running(false), steps(0), esp(0), ebp(0), eax(0), eip(0),
+		depth(0), thread(0), threads(0) {}
+
+	unsigned int seq;
+	unsigned int word_bytes;
+	bool running;
+	unsigned long long steps;
+	unsigned long long esp;
+	unsigned long long ebp;
+	unsigned long long eax;
+	unsigned long long eip;
+	unsigned long long depth;
+	unsigned int thread;
+	unsigned int threads;
+	std::vector<unsigned long long> slots;	// top first, slots[k] is at -(depth - k) * word_bytes
+};
+
+//---------------------------------------------------------------------------
+// A named mapping; POSIX shm_open, or a named file mapping on Windows
+class SharedRegion
+{
+public:
+	SharedRegion(void);
+	~SharedRegion(void);
+
+	// create makes a new region of size bytes, replacing one of the same
+	// name; otherwise an existing one is mapped whole, read-only
+	bool open(const std::string & name, size_t size, bool create, std::string & error);
+	void close();
+
+	void * data() const { return Data; }
+	size_t size() const { return Size; }
+
+private:
+	SharedRegion(const SharedRegion &);
+	SharedRegion & operator=(const SharedRegion &);
+
+	std::string		Name;
+	void *			Data;
+	size_t			Size;
+	bool			Owner;			// unlinks the name on close
+#if defined(_WIN32)
+	void *			Mapping;		// HANDLE
+#endif
+};
+
+//---------------------------------------------------------------------------
+// Reads what a StateExport publishes, at whatever rate the caller likes
+class SharedStateReader
+{
+public:
+	SharedStateReader(void);
+
+	// false, with error set, if there is no region of that name or it is
+	// not one a StateExport wrote
+	bool open(const std::string & name, std::string & error);
+	void close() { Region.close(); Header = 0; }
+	bool isOpen() const { return Header != 0; }
+
+	// Copies the latest state; false if the writer kept updating through
+	// tries attempts, which only happens while it publishes continuously
+	bool read(shared_state & state, unsigned int tries = 1000);
+	// seq as it is now, so pollers can skip reads while it stays the same
+	unsigned int sequence() const;
+
+private:
+	SharedRegion					Region;
+	const shared_state_header *		Header;
+	const unsigned long long *		Slots;
+};
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __SharedState_h_
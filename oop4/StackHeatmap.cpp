@@ -0,0 +1,259 @@
+#include "StackHeatmap.h"
+
+#include <algorithm>
+#include <OgreHardwarePixelBuffer.h>
+#include <OgreMaterialManager.h>
+#include <OgreOverlayManager.h>
+#include <OgrePass.h>
+#include <OgreResourceGroupManager.h>
+#include <OgreTechnique.h>
+#include <OgreTextureManager.h>
+#include <OgreTextureUnitState.h>
+
+static const char * HEAT_NAME = "oop5/Heatmap";
+static const Ogre::uint32 HEAT_EMPTY = 0x000000;		// past the top of the stack
+static const Ogre::uint32 HEAT_UNKNOWN = 0x303030;	// no writer or time, e.g. after a snapshot
+
+// Age colours by power of two of steps: fresh writes are pale yellow,
+// going through orange and red to a dark blue after about 2^28 steps
+static const unsigned int AGE_BUCKETS = 28;
+static const unsigned char age_stops[5][4] =
+{
+	// bucket, r, g, b
+	{ 0, 255, 255, 200 },
+	{ 6, 255, 200, 40 },
+	{ 12, 230, 60, 20 },
+	{ 20, 60, 30, 120 },
+	{ 28, 25, 25, 60 }
+};
+
+static Ogre::uint32 age_colour(unsigned int bucket)
+{
+	int k = 0;
+	while (k < 3 && bucket > age_stops[k + 1][0])
+		++k;
+	const unsigned char * a = age_stops[k];
+	const unsigned char * b = age_stops[k + 1];
+	unsigned int t = std::min(bucket, (unsigned int)b[0]) - a[0];
+	unsigned int span = b[0] - a[0];
+	Ogre::uint32 c = 0;
+	for (int i = 1; i <= 3; ++i)
+		c = (c << 8) | (Ogre::uint32)((a[i] * (span - t) + b[i] * t) / span);
+	return c;
+}
+
+// Equal values, or writers, get equal colours and near ones differ
+static Ogre::uint32 hash_colour(unsigned long long x)
+{
+	return ((Ogre::uint32)mix_state(x) & 0xFFFFFF) | 0x303030;
+}
+
+//---------------------------------------------------------------------------
+StackHeatmap::StackHeatmap(void)
+	: Mode(HEAT_OFF),
+	Redraw(true),
+	Layer(0),
+	Panel(0),
+	Rows(0),
+	Shown(0)
+{
+}
+
+StackHeatmap::~StackHeatmap(void)
+{
+}
+
+const char * StackHeatmap::modeName(int mode)
+{
+	static const char * names[HEAT_MODES] = { "off", "value", "age", "writer" };
+	return names[mode];
+}
+
+//---------------------------------------------------------------------------
+void StackHeatmap::create(Ogre::Real left, Ogre::Real top, Ogre::Real width, Ogre::Real height)
+{
+	Material = Ogre::MaterialManager::getSingleton().create(HEAT_NAME,
+		Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME).staticCast<Ogre::Material>();
+	Ogre::Pass * pass = Material->getTechnique(0)->getPass(0);
+	pass->setLightingEnabled(false);
+	pass->setDepthCheckEnabled(false);
+	pass->setDepthWriteEnabled(false);
+	if (!resize(1))
+		return;
+
+	// One texel per slot, unfiltered, so neighbouring slots do not blend
+	Ogre::TextureUnitState * unit = pass->createTextureUnitState(Texture->getName());
+	unit->setTextureFiltering(Ogre::TFO_NONE);
+	unit->setTextureAddressingMode(Ogre::TAM_CLAMP);
+
+	Ogre::OverlayManager & overlays = Ogre::OverlayManager::getSingleton();
+	Panel = static_cast<Ogre::PanelOverlayElement *>(overlays.createOverlayElement("Panel", std::string(HEAT_NAME) + "/Panel"));
+	Panel->setMetricsMode(Ogre::GMM_PIXELS);
+	Panel->setPosition(left, top);
+	Panel->setDimensions(width, height);
+	Panel->setMaterialName(Material->getName());
+	Layer = overlays.create(std::string(HEAT_NAME) + "/Overlay");
+	Layer->add2D(Panel);
+	Layer->hide();
+}
+
+// Before the overlay system and the root go
+void StackHeatmap::destroy()
+{
+	if (Layer)
+	{
+		Ogre::OverlayManager::getSingleton().destroy(Layer);
+		Ogre::OverlayManager::getSingleton().destroyOverlayElement(Panel);
+		Layer = 0;
+		Panel = 0;
+	}
+	if (!Texture.isNull())
+		Ogre::TextureManager::getSingleton().remove(Texture->getName());
+	Texture.setNull();
+	if (!Material.isNull())
+		Ogre::MaterialManager::getSingleton().remove(Material->getName());
+	Material.setNull();
+	Rows = 0;
+}
+
+int StackHeatmap::nextMode()
+{
+	if (!Layer)
+		return Mode;
+
+	Mode = (Mode + 1) % HEAT_MODES;
+	Redraw = true;
+	if (Mode == HEAT_OFF)
+		Layer->hide();
+	else
+		Layer->show();
+	return Mode;
+}
+
+//---------------------------------------------------------------------------
+// The texture grows in powers of two and starts over empty
+bool StackHeatmap::resize(size_t rows)
+{
+	size_t height = 16;
+	while (height < rows)
+		height *= 2;
+	height = std::min(height, (size_t)HEAT_MAX_ROWS);
+
+	Ogre::TextureManager & textures = Ogre::TextureManager::getSingleton();
+	if (!Texture.isNull())
+		textures.remove(Texture->getName());
+	Texture.setNull();
+	Rows = 0;
+	try
+	{
+		Texture = textures.createManual(HEAT_NAME, Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME,
+			Ogre::TEX_TYPE_2D, HEAT_WIDTH, (Ogre::uint)height, 0, Ogre::PF_X8R8G8B8, Ogre::TU_DYNAMIC_WRITE_ONLY);
+	}
+	catch (Ogre::Exception &)
+	{
+		Texture.setNull();
+		return false;
+	}
+
+	Rows = height;
+	RowChange.assign(Rows, ~0ull);
+	Redraw = true;
+	if (Panel)
+		Material->getTechnique(0)->getPass(0)->getTextureUnitState(0)->setTextureName(Texture->getName());
+	return true;
+}
+
+unsigned int StackHeatmap::update(Machine & vm)
+{
+	if (Mode == HEAT_OFF || Texture.isNull())
+		return 0;
+
+	size_t n = std::min(vm.Stack.size(), (size_t)HEAT_WIDTH * HEAT_MAX_ROWS);
+	size_t rows = (n + HEAT_WIDTH - 1) / HEAT_WIDTH;
+	if (rows > Rows && !resize(rows))
+		return 0;
+
+	// Rows from the lowest slot pushed or popped since the last update
+	// up to the higher of the old and the new top, which clears popped ones
+	size_t first = Redraw ? 0 : std::min(vm.DirtyFrom, n) / HEAT_WIDTH;
+	size_t last = Redraw ? Rows : (std::max(n, Shown) + HEAT_WIDTH - 1) / HEAT_WIDTH;
+	unsigned int uploaded = 0;
+
+	// Below that only ages move, a run of rows at a time
+	if (Mode == HEAT_AGE)
+	{
+		size_t r = 0;
+		while (r < first)
+		{
+			if (RowChange[r] > vm.Steps)
+			{
+				++r;
+				continue;
+			}
+			size_t end = r + 1;
+			while (end < first && RowChange[end] <= vm.Steps)
+				++end;
+			uploaded += drawRows(vm, r, end);
+			r = end;
+		}
+	}
+	if (first < last)
+		uploaded += drawRows(vm, first, last);
+
+	Shown = n;
+	Redraw = false;
+	vm.DirtyFrom = vm.Stack.size();
+
+	// The rows in use fill the panel, the top of the stack at its top
+	Ogre::Real u = (n < HEAT_WIDTH) ? (Ogre::Real)std::max(n, (size_t)1) / HEAT_WIDTH : 1;
+	Panel->setUV(0, (Ogre::Real)std::max(rows, (size_t)1) / Rows, u, 0);
+	return uploaded;
+}
+
+unsigned int StackHeatmap::drawRows(const Machine & vm, size_t first, size_t last)
+{
+	Pixels.resize((last - first) * HEAT_WIDTH);
+	size_t n = std::min(vm.Stack.size(), (size_t)HEAT_WIDTH * HEAT_MAX_ROWS);
+	for (size_t r = first; r < last; ++r)
+	{
+		Ogre::uint32 * row = &Pixels[(r - first) * HEAT_WIDTH];
+		unsigned long long change = ~0ull;
+		size_t slot = r * HEAT_WIDTH;
+		for (unsigned int x = 0; x < HEAT_WIDTH; ++x, ++slot)
+			row[x] = (slot < n) ? colour(vm, slot, change) : HEAT_EMPTY;
+		RowChange[r] = change;
+	}
+
+	// Texture row r is image row r, so slot 0 ends up bottom left once
+	// the panel flips v
+	Ogre::PixelBox src(HEAT_WIDTH, last - first, 1, Ogre::PF_X8R8G8B8, &Pixels[0]);
+	Texture->getBuffer()->blitFromMemory(src, Ogre::Box(0, first, HEAT_WIDTH, last));
+	return (unsigned int)(last - first);
+}
+
+// change is lowered to the step at which this slot's colour changes by
+// itself, which only happens in age mode
+Ogre::uint32 StackHeatmap::colour(const Machine & vm, size_t slot, unsigned long long & change) const
+{
+	const slot_write & w = vm.SlotWrites[slot];
+	switch (Mode)
+	{
+	case HEAT_VALUE:
+		return vm.Stack[slot] ? hash_colour(vm.Stack[slot]) : 0x181818;
+	case HEAT_WRITER:
+		return (w.idx >= 0) ? hash_colour((unsigned long long)w.idx + 1) : HEAT_UNKNOWN;
+	default:
+		{
+			if (w.step == ~0ull || w.step > vm.Steps)
+				return HEAT_UNKNOWN;
+			// Bucket b holds ages with age + 1 in [2^b, 2^(b+1))
+			unsigned long long age = vm.Steps - w.step;
+			unsigned int bucket = 0;
+			while (bucket < AGE_BUCKETS && (age + 1) >> (bucket + 1))
+				++bucket;
+			if (bucket < AGE_BUCKETS)
+				change = std::min(change, w.step + (2ull << bucket) - 1);
+			return age_colour(bucket);
+		}
+	}
+}
@@ -0,0 +1,69 @@
+#ifndef __StackHeatmap_h_
+#define __StackHeatmap_h_
+
+#include <vector>
+#include <OgreOverlay.h>
+#include <OgrePanelOverlayElement.h>
+#include <OgreMaterial.h>
+#include <OgreTexture.h>
+#include "Machine.h"
+
+//---------------------------------------------------------------------------
+// H cycles through these
+enum heat_mode { HEAT_OFF, HEAT_VALUE, HEAT_AGE, HEAT_WRITER, HEAT_MODES };
+
+static const unsigned int HEAT_WIDTH = 1024;		// slots per texture row
+static const unsigned int HEAT_MAX_ROWS = 4096;		// 4M slots; deeper ones are not drawn
+
+//---------------------------------------------------------------------------
+// The running thread's stack as one texel per slot, coloured by value,
+// by how long ago it was written or by the instruction that wrote it.
+// Slot 0 is at the bottom left, rows of HEAT_WIDTH slots go up, and the
+// panel stretches the rows in use over its area.
+//
+// The texture lives on the GPU and only rows that changed are uploaded:
+// those from Machine::DirtyFrom up, which the handlers lower on every
+// push and pop, and in age mode the rows where some slot's age crossed a
+// power of two, which is when its colour changes. A run that works near
+// the top of a stack of millions of slots uploads a row or two a frame.
+class StackHeatmap
+{
+public:
+	StackHeatmap(void);
+	~StackHeatmap(void);
+
+	// Panel at left, top, in pixels; hidden while the mode is HEAT_OFF
+	void create(Ogre::Real left, Ogre::Real top, Ogre::Real width, Ogre::Real height);
+	void destroy();
+
+	int nextMode();
+	int mode() const { return Mode; }
+	static const char * modeName(int mode);
+
+	// Uploads what changed since the last update and returns how many
+	// rows that was; raises vm.DirtyFrom to the top of the stack
+	unsigned int update(Machine & vm);
+
+private:
+	StackHeatmap(const StackHeatmap &);
+	StackHeatmap & operator=(const StackHeatmap &);
+
+	bool resize(size_t rows);
+	unsigned int drawRows(const Machine & vm, size_t first, size_t last);
+	Ogre::uint32 colour(const Machine & vm, size_t slot, unsigned long long & change) const;
+
+	int								Mode;
+	bool							Redraw;		// everything, after a mode change
+	Ogre::Overlay *					Layer;
+	Ogre::PanelOverlayElement *		Panel;
+	Ogre::MaterialPtr				Material;
+	Ogre::TexturePtr				Texture;
+	size_t							Rows;		// of the texture, a power of two
+	size_t							Shown;		// slots drawn by the last update
+	std::vector<unsigned long long>	RowChange;	// age mode: step at which a row's colours change next
+	std::vector<Ogre::uint32>		Pixels;		// the rows being uploaded
+};
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __StackHeatmap_h_
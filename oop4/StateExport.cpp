@@ -0,0 +1,73 @@
+#include "StateExport.h"
+
+#include <algorithm>
+#include <new>
+#include "Machine.h"
+
+//---------------------------------------------------------------------------
+template <class Word>
+BasicStateExport<Word>::BasicStateExport(void)
+	: Header(0),
+	Slots(0),
+	Seq(0)
+{
+}
+
+template <class Word>
+bool BasicStateExport<Word>::start(const std::string & name, unsigned int window, std::string & error)
+{
+	stop();
+	size_t size = sizeof(shared_state_header) + window * sizeof(unsigned long long);
+	if (!Region.open(name, size, true, error))
+		return false;
+
+	// The region comes zeroed; magic goes in last so a reader that opens
+	// it early does not take it for a finished one
+	Header = new (Region.data()) shared_state_header();
+	Slots = (unsigned long long *)(Header + 1);
+	Seq = 0;
+	Header->version = SHARED_STATE_VERSION;
+	Header->word_bytes = sizeof(Word);
+	Header->window = window;
+	Header->seq.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	Header->magic = SHARED_STATE_MAGIC;
+	return true;
+}
+
+// Seqlock: odd while the fields change, even again once they are done.
+// The release fence keeps the writes after the odd seq, the release store
+// keeps them before the even one
+template <class Word>
+void BasicStateExport<Word>::publish(const BasicMachine<Word> & vm)
+{
+	if (!Header)
+		return;
+
+	Header->seq.store(++Seq, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	// The debug server clears Running before it runs the machine itself;
+	// the GUI keeps it set between the slices of a run it spreads over frames
+	Header->running = (vm.InRun || vm.Running) ? 1 : 0;
+	Header->steps = vm.Steps;
+	Header->esp = vm.esp;
+	Header->ebp = vm.ebp;
+	Header->eax = vm.eax;
+	Header->eip = vm.eip;
+	Header->depth = vm.Stack.size();
+	Header->thread = vm.ThreadId;
+	Header->threads = (unsigned int)vm.threadCount();
+
+	size_t count = std::min(vm.Stack.size(), (size_t)Header->window);
+	const Word * top = vm.Stack.empty() ? 0 : &vm.Stack.back();
+	for (size_t k = 0; k < count; ++k)
+		Slots[k] = *(top - k);
+	Header->count = (unsigned int)count;
+
+	Header->seq.store(++Seq, std::memory_order_release);
+}
+
+//---------------------------------------------------------------------------
+template class BasicStateExport<unsigned int>;
+template class BasicStateExport<unsigned long long>;
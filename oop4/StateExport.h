@@ -0,0 +1,51 @@
+#ifndef __StateExport_h_
+#define __StateExport_h_
+
+#include <string>
+#include "SharedState.h"
+
+template <class Word> class BasicMachine;
+
+// Machine::runInstructions publishes every this many steps of a run, a
+// power of two, so readers see long runs move without the step loop
+// paying more than a counter test
+static const unsigned int STATE_EXPORT_STEPS = 1 << 16;
+
+//---------------------------------------------------------------------------
+// Publishes registers, eip and the top of the running thread's stack into
+// a shared-memory region, see SharedState.h for the layout. External
+// viewers read it through SharedStateReader at any rate without a socket
+// or a copy of the machine, and never slow the writer down: publish()
+// is a seqlock update of a few hundred bytes that does not wait.
+//
+// The machine publishes through an export it has been given, from
+// runInstructions; whoever changes it outside of runs (reset, edits,
+// snapshots, the debug server) calls publish() itself afterwards.
+template <class Word>
+class BasicStateExport
+{
+public:
+	BasicStateExport(void);
+
+	// Creates the region, replacing one of the same name, with room for
+	// window slots; false, with error set, if it cannot
+	bool start(const std::string & name, unsigned int window, std::string & error);
+	void stop() { Region.close(); Header = 0; }
+	bool isRunning() const { return Header != 0; }
+
+	// From the thread that steps the machine
+	void publish(const BasicMachine<Word> & vm);
+
+private:
+	SharedRegion				Region;
+	shared_state_header *		Header;
+	unsigned long long *		Slots;
+	unsigned int				Seq;		// only this side writes seq, so it keeps its own copy
+};
+
+typedef BasicStateExport<unsigned int> StateExport;
+typedef BasicStateExport<unsigned long long> StateExport64;
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __StateExport_h_
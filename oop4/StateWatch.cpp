@@ -0,0 +1,70 @@
+// StateWatch.cpp
+// Sample reader of the state a machine publishes with OOP5_SHARED_STATE
+// or the headless -export flag, see StateExport.h. It only needs the
+// reader side:
+//   g++ -DOOP5_STATE_WATCH StateWatch.cpp SharedState.cpp -o oop5-watch
+// (-lrt on older glibc). Prints a line per interval while the state
+// changes: steps, steps per second since the last line, the registers
+// and the top few stack slots.
+//   oop5-watch [/name] [interval ms] [slots]
+#ifdef OOP5_STATE_WATCH
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include "SharedState.h"
+
+int main(int argc, char * argv[])
+{
+	const char * name = (argc > 1) ? argv[1] : SHARED_STATE_NAME;
+	int interval = (argc > 2) ? atoi(argv[2]) : 200;
+	size_t shown = (argc > 3) ? (size_t)atoi(argv[3]) : 4;
+	if (interval <= 0)
+		interval = 200;
+
+	SharedStateReader reader;
+	std::string error;
+	if (!reader.open(name, error))
+	{
+		std::cerr << error << std::endl;
+		return 1;
+	}
+
+	shared_state state;
+	unsigned int seen = ~0u;
+	unsigned long long lastSteps = 0;
+	std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+	for (;;)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+		if (reader.sequence() == seen)
+			continue;
+		if (!reader.read(state))
+		{
+			std::cerr << "state kept changing, skipped" << std::endl;
+			continue;
+		}
+		seen = state.seq;
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		double seconds = std::chrono::duration<double>(now - last).count();
+		double rate = (state.steps >= lastSteps && seconds > 0) ? (state.steps - lastSteps) / seconds : 0;
+		last = now;
+		lastSteps = state.steps;
+
+		int digits = state.word_bytes * 2;
+		printf("%s step %llu (%.0f/s)  esp %0*llx  ebp %0*llx  eax %0*llx  eip %0*llx  depth %llu",
+			state.running ? "run " : "stop", state.steps, rate, digits, state.esp, digits, state.ebp,
+			digits, state.eax, digits, state.eip, state.depth);
+		if (state.threads > 1)
+			printf("  thread %u of %u", state.thread, state.threads);
+		for (size_t k = 0; k < shown && k < state.slots.size(); ++k)
+			printf(" %s%0*llx", k ? "" : " [", digits, state.slots[k]);
+		printf("%s\n", state.slots.empty() || shown == 0 ? "" : "]");
+		fflush(stdout);
+	}
+}
+
+#endif // #ifdef OOP5_STATE_WATCH
@@ -0,0 +1,76 @@
+#include "StepGenerator.h"
+
+//---------------------------------------------------------------------------
+template <class Word>
+BasicStepGenerator<Word>::BasicStepGenerator(BasicMachine<Word> & machine)
+	: Vm(machine)
+{
+}
+
+template <class Word>
+bool BasicStepGenerator<Word>::next(step_event & ev)
+{
+	// Switch threads first, so the event starts from the thread that runs
+	if (!Vm.Threads.empty())
+		Vm.schedule();
+	Word addr = Vm.eip;
+	unsigned int thread = Vm.ThreadId;
+	Vm.BreakHit = false;
+	if (!Vm.step())
+	{
+		Vm.Running = false;
+		Vm.StopDepth = -1;
+		return false;
+	}
+
+	const basic_instruction<Word> & inst = Vm.Instructions[Vm.ExecIdx];
+	ev.step = Vm.Steps;
+	ev.idx = Vm.ExecIdx;
+	ev.addr = (unsigned int)addr;		// code addresses fit 32 bits
+	ev.thread = thread;
+	ev.op = inst.op;
+	ev.reg[REG_ESP] = Vm.esp;
+	ev.reg[REG_EBP] = Vm.ebp;
+	ev.reg[REG_EAX] = Vm.eax;
+	ev.reg[REG_EIP] = Vm.eip;
+
+	unsigned char dst = (inst.dst < OPND_IMM) ? (unsigned char)(1 << inst.dst) : 0;
+	ev.stores = 0;
+	switch (inst.op)
+	{
+	case OP_MOV: ev.written = dst; break;
+	case OP_POP: ev.written = dst | (1 << REG_ESP); break;
+	case OP_RETN: ev.written = (1 << REG_EBP) | (1 << REG_ESP); break;
+	case OP_PUSH:
+	case OP_CALL:
+		ev.written = 1 << REG_ESP;
+		ev.stores = 1;
+		ev.store_addr = Vm.slot_address(Vm.Stack.size() - 1);
+		ev.store_value = Vm.Stack.back();
+		break;
+	default: ev.written = 0; break;
+	}
+	ev.written |= 1 << REG_EIP;
+
+	ev.stop = Vm.shouldStop();
+	if (ev.stop)
+	{
+		Vm.Running = false;
+		Vm.StopDepth = -1;
+	}
+	return true;
+}
+
+template <class Word>
+unsigned int BasicStepGenerator<Word>::next(step_event * events, unsigned int count)
+{
+	unsigned int n = 0;
+	while (n < count && next(events[n]))
+		if (events[n++].stop)
+			break;
+	return n;
+}
+
+//---------------------------------------------------------------------------
+template class BasicStepGenerator<unsigned int>;
+template class BasicStepGenerator<unsigned long long>;
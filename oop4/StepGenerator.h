@@ -0,0 +1,55 @@
+#ifndef __StepGenerator_h_
+#define __StepGenerator_h_
+
+#include "Machine.h"
+
+//---------------------------------------------------------------------------
+// One executed instruction. The registers an instruction writes are
+// flagged even when the value stays the same; eip is always written.
+template <class Word>
+struct basic_step_event
+{
+	unsigned long long step;		// Machine::Steps once it ran
+	unsigned int idx;
+	unsigned int addr;				// where it was fetched from
+	unsigned int thread;			// Machine::ThreadId of the thread it ran in
+	unsigned char op;
+	unsigned char written;			// 1 << REG_ESP | ... of the registers written
+	unsigned char stores;			// memory writes, 0 or 1
+	bool stop;						// a run would stop here, Machine::BreakReason says why
+	Word reg[REG_COUNT];			// all registers once it ran
+	Word store_addr;
+	Word store_value;
+};
+
+//---------------------------------------------------------------------------
+// Pull-style stepping: every next() runs one instruction and describes it
+// in a step_event the caller owns, so the UI, tracers and tests take as
+// many events as they like without callbacks or allocations. Stops are
+// those of Machine::runInstructions; the event that hits one is flagged,
+// and the caller decides whether to pull on.
+template <class Word>
+class BasicStepGenerator
+{
+public:
+	typedef basic_step_event<Word> step_event;
+
+	BasicStepGenerator(BasicMachine<Word> & machine);
+
+	// False, without an event, when the machine cannot step any more
+	bool next(step_event & ev);
+	// Up to count events; ends early after one that stops
+	unsigned int next(step_event * events, unsigned int count);
+
+private:
+	BasicStepGenerator & operator=(const BasicStepGenerator &);
+
+	BasicMachine<Word> &		Vm;
+};
+
+typedef BasicStepGenerator<unsigned int> StepGenerator;
+typedef basic_step_event<unsigned int> step_event;
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __StepGenerator_h_
@@ -0,0 +1,41 @@
+#include "StringArena.h"
+
+//---------------------------------------------------------------------------
+StringArena::StringArena(void)
+{
+	clear();
+}
+
+void StringArena::clear()
+{
+	Data.assign(1, '\0');
+	Index.clear();
+}
+
+unsigned int StringArena::intern(const char * text, size_t len)
+{
+	if (len == 0)
+		return 0;
+
+	std::string key(text, len);
+	std::unordered_map<std::string, unsigned int>::const_iterator it = Index.find(key);
+	if (it != Index.end())
+		return it->second;
+
+	unsigned int id = Data.size();
+	Data.insert(Data.end(), text, text + len);
+	Data.push_back('\0');
+	Index[key] = id;
+	return id;
+}
+
+unsigned int StringArena::add(const std::string & text)
+{
+	if (text.empty())
+		return 0;
+
+	unsigned int id = Data.size();
+	Data.insert(Data.end(), text.begin(), text.end());
+	Data.push_back('\0');
+	return id;
+}
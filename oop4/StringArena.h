@@ -0,0 +1,31 @@
+#ifndef __StringArena_h_
+#define __StringArena_h_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+//---------------------------------------------------------------------------
+// Interned strings packed into one buffer and named by their offset.
+// Offset 0 is the empty string, so a zeroed id means "no text".
+class StringArena
+{
+public:
+	StringArena(void);
+
+	unsigned int intern(const char * text, size_t len);
+	unsigned int intern(const std::string & text) { return intern(text.data(), text.size()); }
+	// Appends without looking for an equal string, for text known to be unique
+	unsigned int add(const std::string & text);
+	const char * str(unsigned int id) const { return &Data[id]; }
+	size_t bytes() const { return Data.capacity(); }
+	void clear();
+
+private:
+	std::vector<char>								Data;
+	std::unordered_map<std::string, unsigned int>	Index;	// one entry per distinct string
+};
+
+//---------------------------------------------------------------------------
+
+#endif // #ifndef __StringArena_h_
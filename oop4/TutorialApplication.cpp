@@ -64,6 +64,15 @@ extern "C" {
         // Create application object
         TutorialApplication app;
 
+        // oop5: optional program file (.xml or .asm) on the command line
+#if OGRE_PLATFORM == OGRE_PLATFORM_WIN32
+        if (strCmdLine && strCmdLine[0])
+            app.setProgramPath(strCmdLine);
+#else
+        if (argc > 1)
+            app.setProgramPath(argv[1]);
+#endif
+
         try {
             app.go();
         } catch(Ogre::Exception& e)  {
@@ -0,0 +1,27 @@
+; sample.xml as plain text, loaded when the program path ends in .asm
+		jmp main
+
+func:	mov eax, 10
+		mov ebp, 15
+		mov eax, ebp
+		mov eax, 30
+		mov ebp, eax
+		push ebp
+		pop eax
+		retn
+
+		push eax
+		push 10
+		push ebp
+		push esp
+
+main:	mov eax, func
+		call eax
+		push esp
+		mov ebp, esp
+		push esp
+		push esp
+		push esp
+		mov esp, ebp
+		pop eax
+		mov ebp, 100h